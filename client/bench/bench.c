@@ -0,0 +1,124 @@
+#define _GNU_SOURCE
+#include "bench.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+uint64_t bench_now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int bench_pin_cpu(int cpu){
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+double bench_tsc_ghz(void){
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns0, ns1, c0, c1;
+
+    ns0 = bench_now_ns();
+    c0  = bench_start();
+    do {
+        ns1 = bench_now_ns();
+    } while (ns1 - ns0 < 100000000ull);    // 100ms
+    c1  = bench_stop();
+
+    return (double)(c1 - c0) / (double)(ns1 - ns0);
+#else
+    return 1.0;     // bench_start/bench_stop already return ns
+#endif
+}
+
+void samples_init(struct bench_samples *s, const char *name, long cap){
+    memset(s, 0, sizeof(*s));
+    s->name   = name;
+    s->cap    = cap;
+    s->cycles = malloc(cap * sizeof(uint64_t));
+    if (!s->cycles){
+        fprintf(stderr, "[bench] cannot allocate %ld samples for %s\n", cap, name);
+        exit(1);
+    }
+}
+
+void samples_free(struct bench_samples *s){
+    free(s->cycles);
+    s->cycles = NULL;
+    s->n = 0;
+}
+
+void samples_skip(struct bench_samples *s, const char *why){
+    s->skipped = 1;
+    s->note    = why;
+    fprintf(stderr, "[bench] skipping %s: %s\n", s->name, why);
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t *sorted, long n, double p){
+    long i = (long)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void json_distribution(FILE *out, const char *unit, uint64_t *v, long n, double div){
+    double sum = 0;
+
+    for (long i = 0; i < n; i++) sum += v[i];
+
+    fprintf(out,
+        "\"%s\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+        "\"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}",
+        unit,
+        v[0] / div,
+        sum / n / div,
+        percentile(v, n, 0.50) / div,
+        percentile(v, n, 0.99) / div,
+        percentile(v, n, 0.999) / div,
+        v[n - 1] / div);
+}
+
+static int json_first;
+
+void json_begin(FILE *out, const char *bench, int cpu, double ghz){
+    fprintf(out, "{\n  \"benchmark\": \"%s\",\n  \"cpu\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"results\": [",
+            bench, cpu, ghz);
+    json_first = 1;
+}
+
+void json_result(FILE *out, struct bench_samples *s, double ghz){
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", ", json_first ? "" : ",", s->name);
+    json_first = 0;
+
+    if (s->note) fprintf(out, "\"note\": \"%s\", ", s->note);
+
+    if (s->skipped || s->n == 0){
+        fprintf(out, "\"skipped\": true}");
+        return;
+    }
+
+    qsort(s->cycles, s->n, sizeof(uint64_t), cmp_u64);
+
+    fprintf(out, "\"samples\": %ld, ", s->n);
+    json_distribution(out, "cycles", s->cycles, s->n, 1.0);
+    fprintf(out, ", ");
+    json_distribution(out, "ns", s->cycles, s->n, ghz);
+    fprintf(out, "}");
+}
+
+void json_end(FILE *out){
+    fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+// Helpers shared by the client benchmarks: timestamping, cpu pinning,
+// sample collection and JSON output.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// Samples of a single measured operation, in TSC cycles
+struct bench_samples{
+
+    const char *name;
+    const char *note;       // Printed in the JSON output if not NULL
+
+    uint64_t   *cycles;
+    long        n;
+    long        cap;
+
+    int         skipped;    // Operation could not be measured
+};
+
+
+uint64_t bench_now_ns(void);
+
+// Serialized timestamps: no instruction of the measured operation may be
+// moved outside of the [bench_start, bench_stop] window.
+static inline uint64_t bench_start(void){
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_lfence();
+    return __rdtsc();
+#else
+    return bench_now_ns();
+#endif
+}
+
+static inline uint64_t bench_stop(void){
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+#else
+    return bench_now_ns();
+#endif
+}
+
+static inline void samples_add(struct bench_samples *s, uint64_t cycles){
+    if (s->n < s->cap) s->cycles[s->n++] = cycles;
+}
+
+// Pins the calling thread to cpu, returns 0 on success
+int bench_pin_cpu(int cpu);
+
+// TSC frequency measured against CLOCK_MONOTONIC
+double bench_tsc_ghz(void);
+
+void samples_init(struct bench_samples *s, const char *name, long cap);
+void samples_free(struct bench_samples *s);
+
+// Marks a benchmark as skipped, e.g. when /dev/fibers is not available
+void samples_skip(struct bench_samples *s, const char *why);
+
+// JSON output: one object with machine info and an array of results
+void json_begin(FILE *out, const char *bench, int cpu, double ghz);
+void json_result(FILE *out, struct bench_samples *s, double ghz);
+void json_end(FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,144 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Cost per fiber of creating a batch of n fibers with n CreateFiber calls
+// and with a single CreateFibers call, for several batch sizes. Each batch
+// size runs in a child process, so that it starts from an empty registry
+// and its fibers are reclaimed.
+//
+// Usage: bench_bulk [-c cpu] [-b batch,...] [-m max_fibers] [-o out.json]
+
+#define MAX_BATCHES 16
+
+static int  cpu = 0;
+static long max_fibers = 16384;     // Per method and batch size
+
+static void idle_fn(void *param){
+    // Never switched to
+}
+
+static int cmp_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// Runs rounds batches with each method, writes one JSON object to res.
+// Samples are cycles per fiber of a whole batch.
+static int run_batch(FILE *res, long batch, double ghz){
+    long rounds = max_fibers / batch, i, r;
+    uint64_t *single, *bulk;
+    uint64_t t0, t1;
+
+    if (rounds < 1) rounds = 1;
+    if (rounds > 256) rounds = 256;
+
+    single = calloc(rounds, sizeof(uint64_t));
+    bulk   = calloc(rounds, sizeof(uint64_t));
+    if (!single || !bulk) return 1;
+
+    bench_pin_cpu(cpu);
+    if (ConvertThreadToFiber() == -1) return 1;
+
+    for (r = 0; r < rounds; r++){
+        t0 = bench_start();
+        for (i = 0; i < batch; i++)
+            if (CreateFiber(idle_fn, NULL) == -1) return 1;
+        t1 = bench_stop();
+        single[r] = (t1 - t0) / batch;
+
+        t0 = bench_start();
+        if (CreateFibers(batch, idle_fn, NULL, NULL, 0) == -1) return 1;
+        t1 = bench_stop();
+        bulk[r] = (t1 - t0) / batch;
+    }
+
+    qsort(single, rounds, sizeof(uint64_t), cmp_u64);
+    qsort(bulk,   rounds, sizeof(uint64_t), cmp_u64);
+
+    fprintf(res, "{\"batch\": %ld, \"rounds\": %ld, "
+                 "\"CreateFiber_ns_per_fiber_p50\": %.1f, "
+                 "\"CreateFibers_ns_per_fiber_p50\": %.1f, "
+                 "\"speedup\": %.2f}",
+            batch, rounds, single[rounds/2] / ghz, bulk[rounds/2] / ghz,
+            bulk[rounds/2] ? (double) single[rounds/2] / bulk[rounds/2] : 0.0);
+
+    free(single);
+    free(bulk);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    long batches[MAX_BATCHES] = {16, 256, 4096};
+    int  nbatches = 3;
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    char line[1024];
+    double ghz;
+    int opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "c:b:m:o:")) != -1){
+        switch (opt){
+            case 'c': cpu        = atoi(optarg); break;
+            case 'm': max_fibers = atol(optarg); break;
+            case 'o': out_path   = optarg;       break;
+            case 'b':
+                nbatches = 0;
+                for (char *tok = strtok(optarg, ","); tok && nbatches < MAX_BATCHES; tok = strtok(NULL, ","))
+                    batches[nbatches++] = atol(tok);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu] [-b batch,...] [-m max_fibers] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    ghz = bench_tsc_ghz();
+
+    fprintf(out, "{\n  \"benchmark\": \"bulk\",\n  \"cpu\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"results\": [",
+            cpu, ghz);
+
+    for (int b = 0; b < nbatches; b++){
+        int fds[2];
+        pid_t child;
+        FILE *in;
+
+        if (batches[b] <= 0 || batches[b] > FIBERS_BULK_MAX) continue;
+        if (pipe(fds)) { perror("[bench] pipe"); return 1; }
+
+        fflush(out);
+        child = fork();
+        if (child == 0){
+            FILE *res = fdopen(fds[1], "w");
+            close(fds[0]);
+            exit(run_batch(res, batches[b], ghz) ? 1 : (fclose(res), 0));
+        }
+
+        close(fds[1]);
+        in = fdopen(fds[0], "r");
+        if (fgets(line, sizeof(line), in)){
+            fprintf(out, "%s\n    %s", first ? "" : ",", line);
+            first = 0;
+        } else {
+            fprintf(stderr, "[bench] batch %ld failed, is the module loaded?\n", batches[b]);
+        }
+        fclose(in);
+        waitpid(child, NULL, 0);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Latency distributions of every fibers call, plus two userspace context
+// switch baselines (ucontext and a minimal hand-written switch) measured
+// on the same cpu.
+//
+// Usage: bench_latency [-c cpu] [-n iterations] [-w warmup] [-o out.json]
+
+#define BASELINE_STACK_SIZE (64*1024)
+
+static long iterations = 100000;
+static long warmup     = 10000;
+static int  cpu        = 0;
+
+
+// ---------------------------------------------------------------------
+// Kernel fibers
+// ---------------------------------------------------------------------
+
+static struct bench_samples s_convert, s_create, s_switch, s_exit;
+static struct bench_samples s_fls_alloc, s_fls_set, s_fls_get, s_fls_free;
+
+static pid_t main_fid, pong_fid;
+static volatile uint64_t switch_t0;
+static volatile long     pong_rounds;
+static volatile int      recording;
+
+
+static void pong_fn(void *param){
+    uint64_t t1;
+
+    while (1){
+        t1 = bench_stop();
+        if (recording) samples_add(&s_switch, t1 - switch_t0);
+        pong_rounds++;
+
+        switch_t0 = bench_start();
+        SwitchToFiber(main_fid);
+    }
+}
+
+static void bench_switch(void){
+    uint64_t t1;
+    long i;
+
+    pong_fid = CreateFiber(pong_fn, NULL);
+    if (pong_fid == -1){
+        samples_skip(&s_switch, "CreateFiber failed");
+        return;
+    }
+
+    // Every round trip yields one sample per direction
+    for (i = 0; i < warmup + iterations / 2; i++){
+        recording = i >= warmup;
+
+        switch_t0 = bench_start();
+        SwitchToFiber(pong_fid);
+        t1 = bench_stop();
+
+        if (recording) samples_add(&s_switch, t1 - switch_t0);
+    }
+}
+
+static void bench_create(void){
+    uint64_t t0, t1;
+    long i;
+
+    for (i = 0; i < warmup + iterations; i++){
+        t0 = bench_start();
+        pid_t fid = CreateFiber(pong_fn, NULL);
+        t1 = bench_stop();
+
+        if (fid == -1){
+            samples_skip(&s_create, "CreateFiber failed");
+            return;
+        }
+        if (i >= warmup) samples_add(&s_create, t1 - t0);
+    }
+}
+
+static void bench_fls(void){
+    long n = s_fls_alloc.cap, i;
+    long *index = malloc(n * sizeof(long));
+    uint64_t t0, t1;
+
+    // The FLS has FLS_SIZE slots: alloc them all, touch them, free them
+    for (i = 0; i < n; i++){
+        t0 = bench_start();
+        index[i] = FlsAlloc();
+        t1 = bench_stop();
+        if (index[i] == -1) break;
+        samples_add(&s_fls_alloc, t1 - t0);
+    }
+    n = i;
+
+    for (long round = 0; round < 8; round++){
+        for (i = 0; i < n; i++){
+            t0 = bench_start();
+            FlsSetValue(index[i], round);
+            t1 = bench_stop();
+            if (round) samples_add(&s_fls_set, t1 - t0);
+
+            t0 = bench_start();
+            FlsGetValue(index[i]);
+            t1 = bench_stop();
+            if (round) samples_add(&s_fls_get, t1 - t0);
+        }
+    }
+
+    for (i = 0; i < n; i++){
+        t0 = bench_start();
+        FlsFree(index[i]);
+        t1 = bench_stop();
+        samples_add(&s_fls_free, t1 - t0);
+    }
+
+    free(index);
+}
+
+static void *convert_thread(void *arg){
+    uint64_t t0, t1;
+
+    bench_pin_cpu(cpu);
+
+    t0 = bench_start();
+    pid_t fid = ConvertThreadToFiber();
+    t1 = bench_stop();
+
+    if (fid != -1) samples_add(&s_convert, t1 - t0);
+    return NULL;
+}
+
+static void bench_convert(long threads){
+    pthread_t t;
+
+    for (long i = 0; i < threads; i++){
+        pthread_create(&t, NULL, convert_thread, NULL);
+        pthread_join(t, NULL);
+    }
+}
+
+static volatile uint64_t exit_t0;
+
+static void *exit_thread(void *arg){
+    bench_pin_cpu(cpu);
+
+    if (ConvertThreadToFiber() == -1) return NULL;
+
+    exit_t0 = bench_start();
+    FiberExit();
+    return NULL;    // Not reached
+}
+
+static void bench_exit(long threads){
+    pthread_t t;
+    uint64_t t1;
+
+    // FiberExit terminates the hosting thread, the sample spans from the
+    // call to the moment pthread_join observes the thread is gone.
+    for (long i = 0; i < threads; i++){
+        exit_t0 = 0;
+        pthread_create(&t, NULL, exit_thread, NULL);
+        pthread_join(t, NULL);
+        t1 = bench_stop();
+        if (exit_t0) samples_add(&s_exit, t1 - exit_t0);
+    }
+}
+
+
+// ---------------------------------------------------------------------
+// Baseline: ucontext
+// ---------------------------------------------------------------------
+
+static struct bench_samples s_ucontext;
+static ucontext_t uc_main, uc_pong;
+static volatile uint64_t uc_t0;
+static volatile int      uc_recording;
+
+static void uc_pong_fn(void){
+    uint64_t t1;
+
+    while (1){
+        t1 = bench_stop();
+        if (uc_recording) samples_add(&s_ucontext, t1 - uc_t0);
+
+        uc_t0 = bench_start();
+        swapcontext(&uc_pong, &uc_main);
+    }
+}
+
+static void bench_ucontext(void){
+    void *stack = malloc(BASELINE_STACK_SIZE);
+    uint64_t t1;
+
+    getcontext(&uc_pong);
+    uc_pong.uc_stack.ss_sp   = stack;
+    uc_pong.uc_stack.ss_size = BASELINE_STACK_SIZE;
+    uc_pong.uc_link          = NULL;
+    makecontext(&uc_pong, uc_pong_fn, 0);
+
+    for (long i = 0; i < warmup + iterations / 2; i++){
+        uc_recording = i >= warmup;
+
+        uc_t0 = bench_start();
+        swapcontext(&uc_main, &uc_pong);
+        t1 = bench_stop();
+
+        if (uc_recording) samples_add(&s_ucontext, t1 - uc_t0);
+    }
+}
+
+
+// ---------------------------------------------------------------------
+// Baseline: minimal switch saving only callee-saved registers
+// ---------------------------------------------------------------------
+
+static struct bench_samples s_asm;
+
+#if defined(__x86_64__)
+
+// void asm_switch(void **save_sp, void *load_sp)
+void asm_switch(void **save_sp, void *load_sp);
+__asm__(
+    ".text\n"
+    ".globl asm_switch\n"
+    ".type asm_switch, @function\n"
+    "asm_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq  %rsp, (%rdi)\n"
+    "    movq  %rsi, %rsp\n"
+    "    popq  %r15\n"
+    "    popq  %r14\n"
+    "    popq  %r13\n"
+    "    popq  %r12\n"
+    "    popq  %rbx\n"
+    "    popq  %rbp\n"
+    "    ret\n"
+    ".size asm_switch, .-asm_switch\n"
+);
+
+static void *asm_main_sp, *asm_pong_sp;
+static volatile uint64_t asm_t0;
+static volatile int      asm_recording;
+
+static void asm_pong_fn(void){
+    uint64_t t1;
+
+    while (1){
+        t1 = bench_stop();
+        if (asm_recording) samples_add(&s_asm, t1 - asm_t0);
+
+        asm_t0 = bench_start();
+        asm_switch(&asm_pong_sp, asm_main_sp);
+    }
+}
+
+static void bench_asm(void){
+    char *stack = malloc(BASELINE_STACK_SIZE);
+    uintptr_t top = ((uintptr_t) stack + BASELINE_STACK_SIZE) & ~(uintptr_t) 15;
+    void **sp = (void **)(top - 64);
+    uint64_t t1;
+
+    // Six callee-saved registers, the entry point as return address and
+    // a fake return address for asm_pong_fn, which never returns.
+    memset(sp, 0, 64);
+    sp[6] = (void *) asm_pong_fn;
+    asm_pong_sp = sp;
+
+    for (long i = 0; i < warmup + iterations / 2; i++){
+        asm_recording = i >= warmup;
+
+        asm_t0 = bench_start();
+        asm_switch(&asm_main_sp, asm_pong_sp);
+        t1 = bench_stop();
+
+        if (asm_recording) samples_add(&s_asm, t1 - asm_t0);
+    }
+}
+
+#else
+
+static void bench_asm(void){
+    samples_skip(&s_asm, "hand-written switch is only available on x86_64");
+}
+
+#endif
+
+
+int main(int argc, char **argv){
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    double ghz;
+    long threads;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:w:o:")) != -1){
+        switch (opt){
+            case 'c': cpu        = atoi(optarg); break;
+            case 'n': iterations = atol(optarg); break;
+            case 'w': warmup     = atol(optarg); break;
+            case 'o': out_path   = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu] [-n iterations] [-w warmup] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (bench_pin_cpu(cpu)){
+        perror("[bench] sched_setaffinity");
+        return 1;
+    }
+    ghz = bench_tsc_ghz();
+
+    // Thread creation dominates convert and exit, keep those runs short
+    threads = iterations / 100 > 0 ? iterations / 100 : 1;
+
+    samples_init(&s_convert,   "ConvertThreadToFiber", threads);
+    samples_init(&s_create,    "CreateFiber",          iterations);
+    samples_init(&s_switch,    "SwitchToFiber",        iterations);
+    samples_init(&s_exit,      "FiberExit",            threads);
+    samples_init(&s_fls_alloc, "FlsAlloc",             4096);
+    samples_init(&s_fls_set,   "FlsSetValue",          4096 * 8);
+    samples_init(&s_fls_get,   "FlsGetValue",          4096 * 8);
+    samples_init(&s_fls_free,  "FlsFree",              4096);
+    samples_init(&s_ucontext,  "baseline_swapcontext", iterations);
+    samples_init(&s_asm,       "baseline_asm_switch",  iterations);
+
+    s_switch.note = "one-way switch, half of the samples in each direction";
+    s_exit.note   = "includes hosting thread teardown and pthread_join wakeup";
+    s_asm.note    = "integer callee-saved registers only";
+
+    bench_convert(threads);
+
+    main_fid = ConvertThreadToFiber();
+    if (main_fid == -1){
+        const char *why = "ConvertThreadToFiber failed, is the module loaded?";
+        samples_skip(&s_convert,   why);
+        samples_skip(&s_create,    why);
+        samples_skip(&s_switch,    why);
+        samples_skip(&s_exit,      why);
+        samples_skip(&s_fls_alloc, why);
+        samples_skip(&s_fls_set,   why);
+        samples_skip(&s_fls_get,   why);
+        samples_skip(&s_fls_free,  why);
+    } else {
+        bench_fls();
+        bench_switch();
+        bench_create();
+        bench_exit(threads);
+    }
+
+    bench_ucontext();
+    bench_asm();
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    json_begin(out, "latency", cpu, ghz);
+    json_result(out, &s_convert,   ghz);
+    json_result(out, &s_create,    ghz);
+    json_result(out, &s_switch,    ghz);
+    json_result(out, &s_exit,      ghz);
+    json_result(out, &s_fls_alloc, ghz);
+    json_result(out, &s_fls_set,   ghz);
+    json_result(out, &s_fls_get,   ghz);
+    json_result(out, &s_fls_free,  ghz);
+    json_result(out, &s_ucontext,  ghz);
+    json_result(out, &s_asm,       ghz);
+    json_end(out);
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+#include "fibers_pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Cost per task of running n short tasks in a fiber created for each of
+// them, as callers of CreateFiber do, and in the worker fibers of a
+// fiber_pool, for several pool sizes. Each configuration runs in a child
+// process, so that it starts from an empty registry.
+//
+// Usage: bench_pool [-c cpu] [-n tasks] [-o out.json]
+
+static int  cpu = 0;
+static long ntasks = 10000;
+
+static pid_t main_fid;
+static long  sum;
+static struct fiber_pool *pool;
+
+static void task_fn(void *param){
+    sum += (long) param;
+}
+
+// What a task costs without a pool: the fiber is dropped afterwards
+static void create_fn(void *param){
+    task_fn(param);
+    for (;;) SwitchToFiber(main_fid);
+}
+
+static void stop_fn(void *param){
+    fiber_pool_stop(pool);
+}
+
+// Runs ntasks tasks, with a pool of fibers fibers if not 0, writes one
+// JSON object to res
+static int run_tasks(FILE *res, long fibers, double ghz){
+    struct fiber_pool_stats warm, stats;
+    uint64_t t0, t1;
+    long i;
+    pid_t fid;
+
+    bench_pin_cpu(cpu);
+    main_fid = ConvertThreadToFiber();
+    if (main_fid == -1) return 1;
+
+    if (!fibers){
+        t0 = bench_start();
+        for (i = 0; i < ntasks; i++){
+            fid = CreateFiber(create_fn, (void *) 1L);
+            if (fid == -1 || SwitchToFiber(fid) == -1) return 1;
+        }
+        t1 = bench_stop();
+
+        if (sum != ntasks) return 1;
+
+        fprintf(res, "{\"method\": \"CreateFiber\", \"tasks\": %ld, \"ns_per_task\": %.1f}",
+                ntasks, (t1 - t0) / ghz / ntasks);
+        return 0;
+    }
+
+    pool = fiber_pool_create(fibers, fibers, 0);
+    if (!pool) return 1;
+
+    // Worker fibers are created by the first run, not measured
+    if (fiber_pool_submit(pool, stop_fn, NULL) || fiber_pool_run(pool)) return 1;
+    if (fiber_pool_get_stats(pool, &warm)) return 1;
+
+    t0 = bench_start();
+    for (i = 0; i < ntasks; i++)
+        if (fiber_pool_submit(pool, task_fn, (void *) 1L)) return 1;
+    if (fiber_pool_submit(pool, stop_fn, NULL) || fiber_pool_run(pool)) return 1;
+    t1 = bench_stop();
+
+    if (sum != ntasks || fiber_pool_get_stats(pool, &stats)) return 1;
+
+    fprintf(res, "{\"method\": \"fiber_pool\", \"fibers\": %ld, \"tasks\": %ld, "
+                 "\"ns_per_task\": %.1f, \"dispatches\": %llu, \"utilization\": %.2f}",
+            fibers, ntasks, (t1 - t0) / ghz / ntasks, stats.dispatches - warm.dispatches,
+            stats.utilization);
+
+    return 0;
+}
+
+int main(int argc, char **argv){
+    long configs[] = { 0, 1, 16 };
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    char line[1024];
+    double ghz;
+    int opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "c:n:o:")) != -1){
+        switch (opt){
+            case 'c': cpu      = atoi(optarg); break;
+            case 'n': ntasks   = atol(optarg); break;
+            case 'o': out_path = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu] [-n tasks] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (ntasks < 1){
+        fprintf(stderr, "[bench] at least one task\n");
+        return 1;
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    ghz = bench_tsc_ghz();
+
+    fprintf(out, "{\n  \"benchmark\": \"pool\",\n  \"cpu\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"results\": [",
+            cpu, ghz);
+
+    for (int c = 0; c < (int)(sizeof(configs) / sizeof(configs[0])); c++){
+        int fds[2];
+        pid_t child;
+        FILE *in;
+
+        if (pipe(fds)) { perror("[bench] pipe"); return 1; }
+
+        fflush(out);
+        child = fork();
+        if (child == 0){
+            FILE *res = fdopen(fds[1], "w");
+            close(fds[0]);
+            exit(run_tasks(res, configs[c], ghz) ? 1 : (fclose(res), 0));
+        }
+
+        close(fds[1]);
+        in = fdopen(fds[0], "r");
+        if (fgets(line, sizeof(line), in)){
+            fprintf(out, "%s\n    %s", first ? "" : ",", line);
+            first = 0;
+        } else {
+            fprintf(stderr, "[bench] %ld fibers failed, is the module loaded?\n", configs[c]);
+        }
+        fclose(in);
+        waitpid(child, NULL, 0);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
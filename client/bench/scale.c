@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Scalability of the fibers registry with many converted threads.
+// For every (threads, fibers) pair of the sweep it measures:
+//  - aggregate CreateFiber/sec, all threads creating concurrently
+//  - aggregate SwitchToFiber/sec, each thread round-robin on its fibers
+//  - cost of resuming a fiber on a thread other than the last one
+//  - success/failure rates when every thread races for the same fid
+// Each configuration runs in a child process, so that it starts from an
+// empty registry and its leaked stacks are reclaimed.
+//
+// Usage: bench_scale [-t max_threads] [-f fibers,...] [-d ms] [-o out.json]
+
+#define REGISTRY_BUCKETS 64     // DECLARE_HASHTABLE(fibers, 6)
+#define MAX_FIBER_COUNTS 16
+#define MIGRATION_ROUNDS 8
+
+struct worker{
+
+    pthread_t thread;
+    int       id;
+    pid_t     home_fid;
+
+    pid_t    *fids;
+    long      nfids;
+
+    uint64_t  create_start, create_end;
+    long      switches;
+    uint64_t  local_cycles;     // Round trips on fibers this thread ran last
+    long      local_trips;
+    uint64_t  migrate_cycles;   // Round trips on fibers another thread ran
+    long      migrate_trips;
+    long      race_ok, race_failed;
+    int       error;
+};
+
+static struct worker     *workers;
+static int                nthreads;
+static long               fibers_per_thread;
+static long               duration_ms = 200;
+static int                ncpus;
+static pid_t              race_fid;
+static volatile int       stop;
+static pthread_barrier_t  barrier;
+
+static __thread struct worker *self;
+
+
+// Fibers run on whatever thread resumed them, so the fid to switch back
+// to must be read from the current thread every time, never cached.
+static __attribute__((noinline)) pid_t current_home(void){
+    __asm__ volatile("" ::: "memory");
+    return self->home_fid;
+}
+
+static void fiber_fn(void *param){
+    while (1) SwitchToFiber(current_home());
+}
+
+static void phase_switch(struct worker *w){
+    uint64_t t0;
+    long i = 0;
+
+    while (!stop){
+        t0 = bench_start();
+        SwitchToFiber(w->fids[i]);
+        w->local_cycles += bench_stop() - t0;
+        w->local_trips++;
+        w->switches += 2;
+
+        if (++i == w->nfids) i = 0;
+    }
+}
+
+static void phase_migrate(struct worker *w){
+    struct worker *owner;
+    uint64_t t0;
+
+    // In round r thread i resumes the fibers thread (i+r) ran in round r-1,
+    // rounds where that is thread i itself are skipped
+    for (int r = 1; r <= MIGRATION_ROUNDS; r++){
+        owner = &workers[(w->id + r) % nthreads];
+
+        for (long i = 0; owner != w && i < owner->nfids; i++){
+            t0 = bench_start();
+            SwitchToFiber(owner->fids[i]);
+            w->migrate_cycles += bench_stop() - t0;
+            w->migrate_trips++;
+        }
+        pthread_barrier_wait(&barrier);
+    }
+}
+
+static void phase_race(struct worker *w){
+    while (!stop){
+        if (SwitchToFiber(race_fid) == -1) w->race_failed++;
+        else                                w->race_ok++;
+    }
+}
+
+static void *worker_fn(void *arg){
+    struct worker *w = arg;
+
+    self = w;
+    bench_pin_cpu(w->id % ncpus);
+
+    w->home_fid = ConvertThreadToFiber();
+    if (w->home_fid == -1) w->error = 1;
+
+    pthread_barrier_wait(&barrier);
+
+    w->create_start = bench_now_ns();
+    for (long i = 0; i < w->nfids && !w->error; i++){
+        w->fids[i] = CreateFiber(fiber_fn, NULL);
+        if (w->fids[i] == -1) w->error = 1;
+    }
+    w->create_end = bench_now_ns();
+
+    pthread_barrier_wait(&barrier);     // all fibers created
+    pthread_barrier_wait(&barrier);     // main starts the clock
+    if (!w->error) phase_switch(w);
+
+    pthread_barrier_wait(&barrier);
+    if (!w->error && nthreads > 1) phase_migrate(w);
+    else for (int r = 1; r <= MIGRATION_ROUNDS; r++) pthread_barrier_wait(&barrier);
+
+    pthread_barrier_wait(&barrier);     // main starts the clock
+    if (!w->error) phase_race(w);
+
+    return NULL;
+}
+
+static void run_for(long ms){
+    stop = 0;
+    pthread_barrier_wait(&barrier);
+    usleep(ms * 1000);
+    stop = 1;
+}
+
+// Runs one configuration, writes one JSON object on out
+static int run_config(FILE *out, int threads, long fibers, double ghz){
+    uint64_t create_start = UINT64_MAX, create_end = 0;
+    uint64_t local_cycles = 0, migrate_cycles = 0;
+    long switches = 0, local_trips = 0, migrate_trips = 0;
+    long race_ok = 0, race_failed = 0;
+    long long race_stat_failed = -1;
+    struct fiber_stats rstats;
+    int error = 0;
+
+    nthreads          = threads;
+    fibers_per_thread = fibers / threads > 0 ? fibers / threads : 1;
+
+    workers = calloc(threads, sizeof(struct worker));
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+
+    // The main thread hosts the contended fiber
+    if (ConvertThreadToFiber() == -1 || (race_fid = CreateFiber(fiber_fn, NULL)) == -1){
+        fprintf(stderr, "[bench] cannot create fibers, is the module loaded?\n");
+        return 1;
+    }
+
+    for (int i = 0; i < threads; i++){
+        workers[i].id    = i;
+        workers[i].nfids = fibers_per_thread;
+        workers[i].fids  = calloc(fibers_per_thread, sizeof(pid_t));
+        pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+    }
+
+    pthread_barrier_wait(&barrier);     // converted
+    pthread_barrier_wait(&barrier);     // fibers created
+    run_for(duration_ms);               // switch
+
+    pthread_barrier_wait(&barrier);     // migrate
+    for (int r = 1; r <= MIGRATION_ROUNDS; r++) pthread_barrier_wait(&barrier);
+
+    run_for(duration_ms);               // race
+
+    for (int i = 0; i < threads; i++){
+        struct worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+        error |= w->error;
+
+        if (w->create_start < create_start) create_start = w->create_start;
+        if (w->create_end   > create_end)   create_end   = w->create_end;
+
+        switches       += w->switches;
+        local_cycles   += w->local_cycles;
+        local_trips    += w->local_trips;
+        migrate_cycles += w->migrate_cycles;
+        migrate_trips  += w->migrate_trips;
+        race_ok        += w->race_ok;
+        race_failed    += w->race_failed;
+    }
+
+    if (GetFiberStats(&rstats, 1, race_fid, race_fid, 0, NULL) == 1)
+        race_stat_failed = rstats.failed_activations;
+
+    fprintf(out,
+        "{\"threads\": %d, \"fibers\": %ld, "
+        "\"fibers_per_bucket\": %.2f, \"threads_per_bucket\": %.2f, "
+        "\"error\": %s, "
+        "\"creates_per_sec\": %.0f, "
+        "\"switches_per_sec\": %.0f, "
+        "\"local_round_trip_ns\": %.1f, "
+        "\"migrated_round_trip_ns\": %.1f, "
+        "\"race_attempts_per_sec\": %.0f, "
+        "\"race_failure_ratio\": %.4f, "
+        "\"race_failed_activations\": %lld}",
+        threads, fibers_per_thread * threads,
+        (double)(fibers_per_thread * threads + threads + 1) / REGISTRY_BUCKETS,
+        (double)(threads + 1) / REGISTRY_BUCKETS,
+        error ? "true" : "false",
+        (double)(fibers_per_thread * threads) * 1e9 / (create_end - create_start),
+        (double) switches * 1000.0 / duration_ms,
+        local_trips   ? local_cycles   / ghz / local_trips   : 0.0,
+        migrate_trips ? migrate_cycles / ghz / migrate_trips : 0.0,
+        (double)(race_ok + race_failed) * 1000.0 / duration_ms,
+        race_ok + race_failed ? (double) race_failed / (race_ok + race_failed) : 0.0,
+        race_stat_failed);
+
+    return error;
+}
+
+int main(int argc, char **argv){
+    long fiber_counts[MAX_FIBER_COUNTS] = {64, 1024, 16384};
+    int  nfiber_counts = 3;
+    int  max_threads;
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    char line[1024];
+    double ghz;
+    int opt, first = 1;
+
+    ncpus = max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "t:f:d:o:")) != -1){
+        switch (opt){
+            case 't': max_threads = atoi(optarg); break;
+            case 'd': duration_ms = atol(optarg); break;
+            case 'o': out_path    = optarg;       break;
+            case 'f':
+                nfiber_counts = 0;
+                for (char *tok = strtok(optarg, ","); tok && nfiber_counts < MAX_FIBER_COUNTS; tok = strtok(NULL, ","))
+                    fiber_counts[nfiber_counts++] = atol(tok);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-t max_threads] [-f fibers,...] [-d ms] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    ghz = bench_tsc_ghz();
+
+    fprintf(out, "{\n  \"benchmark\": \"scale\",\n  \"cpus\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"duration_ms\": %ld,\n  \"results\": [",
+            ncpus, ghz, duration_ms);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2){
+        for (int f = 0; f < nfiber_counts; f++){
+            int fds[2];
+            pid_t child;
+            FILE *in;
+
+            if (pipe(fds)) { perror("[bench] pipe"); return 1; }
+
+            fflush(out);
+            child = fork();
+            if (child == 0){
+                FILE *res = fdopen(fds[1], "w");
+                close(fds[0]);
+                exit(run_config(res, threads, fiber_counts[f], ghz) ? 1 : (fclose(res), 0));
+            }
+
+            close(fds[1]);
+            in = fdopen(fds[0], "r");
+            if (fgets(line, sizeof(line), in)){
+                fprintf(out, "%s\n    %s", first ? "" : ",", line);
+                first = 0;
+            }
+            fclose(in);
+            waitpid(child, NULL, 0);
+        }
+        if (threads < max_threads && threads * 2 > max_threads) threads = max_threads / 2;
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
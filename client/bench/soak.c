@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Soak test: worker threads hammer random interleavings of CreateFiber,
+// SwitchToFiber, FlsAlloc/FlsSetValue/FlsGetValue/FlsFree and FiberExit
+// for a configurable time. Fibers live in a shared pool, so any worker may
+// resume a fiber last run by another one. FiberExit terminates the hosting
+// thread, exited workers are replaced by new ones.
+//
+// Every interval the throughput, the process RSS and the kernel vmalloc and
+// unreclaimable slab usage are written as one JSON line. At the end the
+// growth rate of each memory metric after the warm-up is estimated by
+// least squares, and the run fails if any grows faster than the limit.
+//
+// Usage: soak [-t threads] [-d seconds] [-i interval_ms] [-w warmup_s]
+//             [-f max_fibers] [-l limit_kb_per_min] [-o out.jsonl]
+
+#define FLS_PER_FIBER 64
+
+struct fiber_data{
+
+    pid_t fid;
+    int   exit;             // Set before resuming the fiber to retire it
+    long  fls[FLS_PER_FIBER];
+    int   nfls;
+};
+
+struct worker{
+
+    pthread_t          thread;
+    pid_t              home_fid;
+    unsigned int       seed;
+    struct fiber_data *exiting;     // Fiber that terminated this worker
+    volatile int       done;
+};
+
+static int    nthreads    = 4;
+static long   duration_s  = 60;
+static long   interval_ms = 1000;
+static long   warmup_s    = -1;
+static long   max_fibers  = 1024;
+static double limit_kb_per_min = 64;
+
+static volatile int stop;
+static long         ops;            // Updated with __atomic builtins
+static long         respawns;
+
+// Idle fibers, any worker can take one and resume it
+static struct fiber_data **pool;
+static long                pool_len;
+static long                live_fibers;
+static pthread_mutex_t     pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct worker *self;
+
+
+static __attribute__((noinline)) pid_t current_home(void){
+    __asm__ volatile("" ::: "memory");
+    return self->home_fid;
+}
+
+static void count_op(void){
+    __atomic_add_fetch(&ops, 1, __ATOMIC_RELAXED);
+}
+
+// Random FLS traffic on whatever fiber is running
+static void fls_churn(struct fiber_data *d, unsigned int *seed){
+    long i;
+
+    switch (rand_r(seed) % 4){
+        case 0:
+            if (d->nfls < FLS_PER_FIBER && (i = FlsAlloc()) != -1){
+                d->fls[d->nfls++] = i;
+                count_op();
+            }
+            break;
+        case 1:
+            if (d->nfls > 0){
+                i = rand_r(seed) % d->nfls;
+                FlsFree(d->fls[i]);
+                d->fls[i] = d->fls[--d->nfls];
+                count_op();
+            }
+            break;
+        case 2:
+            if (d->nfls > 0){
+                FlsSetValue(d->fls[rand_r(seed) % d->nfls], rand_r(seed));
+                count_op();
+            }
+            break;
+        case 3:
+            if (d->nfls > 0){
+                FlsGetValue(d->fls[rand_r(seed) % d->nfls]);
+                count_op();
+            }
+            break;
+    }
+}
+
+static void fiber_fn(void *param){
+    struct fiber_data *d = param;
+    unsigned int seed = d->fid;
+
+    while (1){
+        if (d->exit){
+            count_op();
+            FiberExit();    // Terminates the hosting thread
+        }
+
+        for (int n = rand_r(&seed) % 4; n >= 0; n--) fls_churn(d, &seed);
+
+        SwitchToFiber(current_home());
+    }
+}
+
+static struct fiber_data *pool_take(unsigned int *seed){
+    struct fiber_data *d = NULL;
+    long i;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_len > 0){
+        i = rand_r(seed) % pool_len;
+        d = pool[i];
+        pool[i] = pool[--pool_len];
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return d;
+}
+
+static void pool_put(struct fiber_data *d){
+    pthread_mutex_lock(&pool_lock);
+    pool[pool_len++] = d;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void create_fiber(void){
+    struct fiber_data *d;
+
+    if (__atomic_add_fetch(&live_fibers, 1, __ATOMIC_RELAXED) > max_fibers){
+        __atomic_sub_fetch(&live_fibers, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    d = calloc(1, sizeof(struct fiber_data));
+    d->fid = CreateFiber(fiber_fn, d);
+    if (d->fid == -1){
+        __atomic_sub_fetch(&live_fibers, 1, __ATOMIC_RELAXED);
+        free(d);
+        return;
+    }
+    count_op();
+    pool_put(d);
+}
+
+static void *worker_fn(void *arg){
+    struct worker *w = arg;
+    struct fiber_data main_data = {0};
+    struct fiber_data *d;
+    int r;
+
+    self = w;
+
+    w->home_fid = ConvertThreadToFiber();
+    if (w->home_fid == -1){
+        w->done = 1;
+        return NULL;
+    }
+    main_data.fid = w->home_fid;
+
+    while (!stop){
+        r = rand_r(&w->seed) % 100;
+
+        if (r < 10){
+            create_fiber();
+        } else if (r < 70){
+            if ((d = pool_take(&w->seed))){
+                SwitchToFiber(d->fid);
+                count_op();
+                pool_put(d);
+            }
+        } else if (r < 99){
+            fls_churn(&main_data, &w->seed);
+        } else if ((d = pool_take(&w->seed))){
+            // Retire a fiber, and this worker with it
+            d->exit = 1;
+            w->exiting = d;
+            __atomic_sub_fetch(&live_fibers, 1, __ATOMIC_RELAXED);
+            w->done = 1;
+            SwitchToFiber(d->fid);
+        }
+    }
+
+    w->done = 1;
+    return NULL;
+}
+
+static void start_worker(struct worker *w){
+    w->exiting = NULL;
+    w->done    = 0;
+    pthread_create(&w->thread, NULL, worker_fn, w);
+}
+
+
+// Memory accounting
+
+struct mem_sample{
+    double t;
+    long   rss_kb;
+    long   vmalloc_kb;
+    long   slab_kb;
+};
+
+static long read_kb(const char *path, const char *key){
+    char line[256];
+    size_t klen = strlen(key);
+    long v = -1;
+    FILE *f = fopen(path, "r");
+
+    if (!f) return -1;
+    while (fgets(line, sizeof(line), f)){
+        if (!strncmp(line, key, klen)){
+            v = atol(line + klen);
+            break;
+        }
+    }
+    fclose(f);
+    return v;
+}
+
+// /proc/vmallocinfo is exact but root only, meminfo is the fallback
+static long read_vmalloc_kb(void){
+    char line[512];
+    long total = 0, size;
+    FILE *f = fopen("/proc/vmallocinfo", "r");
+
+    if (!f) return read_kb("/proc/meminfo", "VmallocUsed:");
+    while (fgets(line, sizeof(line), f)){
+        if (sscanf(line, "%*s %ld", &size) == 1) total += size;
+    }
+    fclose(f);
+    return total / 1024;
+}
+
+static void sample_memory(struct mem_sample *s, double t){
+    s->t          = t;
+    s->rss_kb     = read_kb("/proc/self/status", "VmRSS:");
+    s->vmalloc_kb = read_vmalloc_kb();
+    s->slab_kb    = read_kb("/proc/meminfo", "SUnreclaim:");
+}
+
+// Least squares slope of one metric over samples[from, n), in kB/min
+static double slope_kb_per_min(struct mem_sample *s, long from, long n, size_t field){
+    double st = 0, sv = 0, stt = 0, stv = 0, m = n - from;
+
+    if (m < 2) return 0;
+    for (long i = from; i < n; i++){
+        double v = *(long *)((char *)&s[i] + field);
+        st  += s[i].t;
+        sv  += v;
+        stt += s[i].t * s[i].t;
+        stv += s[i].t * v;
+    }
+    if (m * stt - st * st == 0) return 0;
+    return (m * stv - st * sv) / (m * stt - st * st) * 60.0;
+}
+
+
+int main(int argc, char **argv){
+    const char *out_path = NULL;
+    struct worker *workers;
+    struct mem_sample *samples;
+    long nsamples = 0, max_samples, from;
+    uint64_t start, now, last;
+    long last_ops = 0;
+    double rss_slope, vmalloc_slope, slab_slope;
+    FILE *out;
+    int opt, fail;
+
+    while ((opt = getopt(argc, argv, "t:d:i:w:f:l:o:")) != -1){
+        switch (opt){
+            case 't': nthreads         = atoi(optarg); break;
+            case 'd': duration_s       = atol(optarg); break;
+            case 'i': interval_ms      = atol(optarg); break;
+            case 'w': warmup_s         = atol(optarg); break;
+            case 'f': max_fibers       = atol(optarg); break;
+            case 'l': limit_kb_per_min = atof(optarg); break;
+            case 'o': out_path         = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-d seconds] [-i interval_ms] [-w warmup_s] "
+                                "[-f max_fibers] [-l limit_kb_per_min] [-o out.jsonl]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (warmup_s < 0) warmup_s = duration_s / 10;
+
+    out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out){
+        perror("[soak] output");
+        return 2;
+    }
+
+    if (ConvertThreadToFiber() == -1){
+        fprintf(stderr, "[soak] ConvertThreadToFiber failed, is the module loaded?\n");
+        return 2;
+    }
+
+    pool        = calloc(max_fibers, sizeof(struct fiber_data *));
+    workers     = calloc(nthreads, sizeof(struct worker));
+    max_samples = duration_s * 1000 / interval_ms + 2;
+    samples     = calloc(max_samples, sizeof(struct mem_sample));
+
+    for (int i = 0; i < nthreads; i++){
+        workers[i].seed = i + 1;
+        start_worker(&workers[i]);
+    }
+
+    start = last = bench_now_ns();
+    sample_memory(&samples[nsamples++], 0);
+
+    do {
+        usleep(1000);
+        now = bench_now_ns();
+
+        // Replace the workers that FiberExit terminated
+        for (int i = 0; i < nthreads; i++){
+            struct worker *w = &workers[i];
+
+            if (!w->done) continue;
+            pthread_join(w->thread, NULL);
+            free(w->exiting);
+            respawns++;
+            start_worker(w);
+        }
+
+        if (now - last >= (uint64_t) interval_ms * 1000000 && nsamples < max_samples){
+            struct mem_sample *s = &samples[nsamples++];
+            long cur_ops = __atomic_load_n(&ops, __ATOMIC_RELAXED);
+
+            sample_memory(s, (now - start) / 1e9);
+            fprintf(out,
+                "{\"t\": %.1f, \"ops_per_sec\": %.0f, \"live_fibers\": %ld, "
+                "\"respawned_threads\": %ld, \"rss_kb\": %ld, "
+                "\"vmalloc_kb\": %ld, \"slab_unreclaimable_kb\": %ld}\n",
+                s->t, (cur_ops - last_ops) * 1e9 / (now - last),
+                __atomic_load_n(&live_fibers, __ATOMIC_RELAXED), respawns,
+                s->rss_kb, s->vmalloc_kb, s->slab_kb);
+            fflush(out);
+
+            last_ops = cur_ops;
+            last     = now;
+        }
+    } while (now - start < (uint64_t) duration_s * 1000000000);
+
+    stop = 1;
+    for (int i = 0; i < nthreads; i++) pthread_join(workers[i].thread, NULL);
+
+    for (from = 0; from < nsamples && samples[from].t < warmup_s; from++);
+
+    rss_slope     = slope_kb_per_min(samples, from, nsamples, offsetof(struct mem_sample, rss_kb));
+    vmalloc_slope = slope_kb_per_min(samples, from, nsamples, offsetof(struct mem_sample, vmalloc_kb));
+    slab_slope    = slope_kb_per_min(samples, from, nsamples, offsetof(struct mem_sample, slab_kb));
+
+    fail = rss_slope     > limit_kb_per_min ||
+           vmalloc_slope > limit_kb_per_min ||
+           slab_slope    > limit_kb_per_min;
+
+    fprintf(out,
+        "{\"summary\": true, \"ops\": %ld, \"respawned_threads\": %ld, "
+        "\"rss_kb_per_min\": %.1f, \"vmalloc_kb_per_min\": %.1f, "
+        "\"slab_unreclaimable_kb_per_min\": %.1f, \"limit_kb_per_min\": %.1f, "
+        "\"result\": \"%s\"}\n",
+        ops, respawns, rss_slope, vmalloc_slope, slab_slope,
+        limit_kb_per_min, fail ? "fail" : "pass");
+    fclose(out);
+
+    return fail;
+}
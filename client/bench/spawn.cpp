@@ -0,0 +1,216 @@
+#include "bench.h"
+#include "fibers.hpp"
+
+#include <array>
+#include <functional>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Cost and heap allocations of starting fibers that run a capturing
+// lambda: through a std::function handed to CreateFiber, as C++ callers of
+// the C interface do, and through fibers::spawn(), with stacks from
+// posix_memalign() and from a stack arena. Every fiber is spawned, then run
+// to completion. Each configuration runs in a child process, so that it
+// starts from an empty registry.
+//
+// Usage: bench_spawn [-c cpu] [-n fibers] [-o out.json]
+
+// Allocations are counted by wrapping the glibc allocator
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void  __libc_free(void *p);
+}
+
+static long allocations;
+static int  counting;
+
+extern "C" void *malloc(size_t size){
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size){
+    allocations += counting;
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size){
+    allocations += counting;
+    return __libc_realloc(p, size);
+}
+
+extern "C" void *memalign(size_t align, size_t size){
+    allocations += counting;
+    return __libc_memalign(align, size);
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t size){
+    allocations += counting;
+    return __libc_memalign(align, size);
+}
+
+extern "C" int posix_memalign(void **p, size_t align, size_t size){
+    allocations += counting;
+    *p = __libc_memalign(align, size);
+    return *p ? 0 : ENOMEM;
+}
+
+extern "C" void free(void *p){
+    __libc_free(p);
+}
+
+
+#define MODE_FUNCTION   0
+#define MODE_SPAWN      1
+#define MODE_ARENA      2
+#define MODES           3
+
+static const char *mode_names[MODES] = { "std::function", "spawn", "spawn_arena" };
+
+static int   cpu = 0;
+static long  nfibers = 10000;
+
+static pid_t main_fid;
+static long  sum;
+
+// What a C++ caller of CreateFiber has to do to pass captures
+static void function_entry(void *param){
+    auto *fn = static_cast<std::function<void()> *>(param);
+
+    (*fn)();
+    delete fn;
+
+    for (;;) SwitchToFiber(main_fid);
+}
+
+// Spawns and runs nfibers fibers with the method of mode, writes one JSON
+// object to res
+static int run_mode(FILE *res, int mode, double ghz){
+    std::array<long, 6> payload = { 1, 2, 3, 4, 5, 6 };
+    std::vector<fibers::Fiber> spawned;
+    std::vector<pid_t> fids;
+    struct fiber_arena *arena = nullptr;
+    uint64_t t0, t1, t2;
+    long spawn_allocations;
+
+    bench_pin_cpu(cpu);
+    main_fid = ConvertThreadToFiber();
+    if (main_fid == -1) return 1;
+
+    spawned.reserve(nfibers);
+    fids.reserve(nfibers);
+    if (mode == MODE_ARENA && !(arena = fiber_arena_create(nfibers, 0, FIBER_ARENA_THP))) return 1;
+
+    auto work = [payload]{ for (long v : payload) sum += v; };
+
+    allocations = 0;
+    counting = 1;
+
+    t0 = bench_start();
+    for (long i = 0; i < nfibers; i++){
+        if (mode == MODE_FUNCTION){
+            fids.push_back(CreateFiber(function_entry, new std::function<void()>(work)));
+            if (fids.back() == -1) return 1;
+        } else {
+            spawned.push_back(fibers::spawn(work, arena));
+            if (!spawned.back()) return 1;
+        }
+    }
+    t1 = bench_stop();
+
+    spawn_allocations = allocations;
+
+    for (long i = 0; i < nfibers; i++){
+        if (mode == MODE_FUNCTION) SwitchToFiber(fids[i]);
+        else                       spawned[i].resume();
+    }
+    t2 = bench_stop();
+
+    counting = 0;
+
+    if (sum != 21 * nfibers) return 1;
+
+    fprintf(res, "{\"method\": \"%s\", \"fibers\": %ld, "
+                 "\"allocations_per_spawn\": %.2f, \"allocations_per_run\": %.2f, "
+                 "\"ns_per_spawn\": %.1f, \"ns_per_run\": %.1f}",
+            mode_names[mode], nfibers,
+            (double) spawn_allocations / nfibers,
+            (double) (allocations - spawn_allocations) / nfibers,
+            (t1 - t0) / ghz / nfibers, (t2 - t1) / ghz / nfibers);
+
+    return 0;
+}
+
+int main(int argc, char **argv){
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    char line[1024];
+    double ghz;
+    int opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "c:n:o:")) != -1){
+        switch (opt){
+            case 'c': cpu      = atoi(optarg); break;
+            case 'n': nfibers  = atol(optarg); break;
+            case 'o': out_path = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu] [-n fibers] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (nfibers < 1){
+        fprintf(stderr, "[bench] at least one fiber\n");
+        return 1;
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    ghz = bench_tsc_ghz();
+
+    fprintf(out, "{\n  \"benchmark\": \"spawn\",\n  \"cpu\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"results\": [",
+            cpu, ghz);
+
+    for (int m = 0; m < MODES; m++){
+        int fds[2];
+        pid_t child;
+        FILE *in;
+
+        if (pipe(fds)) { perror("[bench] pipe"); return 1; }
+
+        fflush(out);
+        child = fork();
+        if (child == 0){
+            FILE *res = fdopen(fds[1], "w");
+            close(fds[0]);
+            exit(run_mode(res, m, ghz) ? 1 : (fclose(res), 0));
+        }
+
+        close(fds[1]);
+        in = fdopen(fds[0], "r");
+        if (fgets(line, sizeof(line), in)){
+            fprintf(out, "%s\n    %s", first ? "" : ",", line);
+            first = 0;
+        } else {
+            fprintf(stderr, "[bench] %s failed, is the module loaded?\n", mode_names[m]);
+        }
+        fclose(in);
+        waitpid(child, NULL, 0);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
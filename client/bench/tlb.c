@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "fibers_iface.h"
+#include "fibers_stacks.h"
+
+#include <linux/perf_event.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Switch throughput and dTLB misses of a round robin over many fibers,
+// with stacks from CreateFiber and from stack arenas on base pages, THP
+// and hugetlbfs. Every fiber touches a few cache lines of its stack and
+// switches to the next one. Each configuration runs in a child process,
+// so that it starts from an empty registry.
+// dTLB misses are counted in userspace only, -1 where the PMU does not
+// have them (e.g. most VMs).
+//
+// Usage: bench_tlb [-c cpu] [-n fibers] [-l laps] [-o out.json]
+
+#define MODE_MALLOC     0
+#define MODE_BASE       1
+#define MODE_THP        2
+#define MODE_HUGETLB    3
+#define MODES           4
+
+static const char *mode_names[MODES] = { "CreateFiber", "arena_base", "arena_thp", "arena_hugetlb" };
+static const int   mode_flags[MODES] = { 0, FIBER_ARENA_BASE, FIBER_ARENA_THP, FIBER_ARENA_HUGETLB };
+
+static int   cpu = 0;
+static long  nfibers = 4096;
+static long  laps = 64;
+
+static pid_t *fids;
+static pid_t main_fid;
+static long  lap;
+
+// dTLB load and store misses of the calling thread, userspace only
+static int tlb_fd[2] = { -1, -1 };
+
+static int open_tlb_counter(int op){
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type           = PERF_TYPE_HW_CACHE;
+    attr.size           = sizeof(attr);
+    attr.config         = PERF_COUNT_HW_CACHE_DTLB | (op << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled       = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_tlb_counter(int fd){
+    long long value;
+
+    if (fd == -1 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
+
+static void tlb_counters(int on){
+    for (int i = 0; i < 2; i++)
+        if (tlb_fd[i] != -1)
+            ioctl(tlb_fd[i], on ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static void ring_fn(void *param){
+    long i = (long) param;
+    volatile char frame[256];
+
+    for (;;){
+        // The part of the stack a real fiber would use between switches
+        for (int b = 0; b < (int) sizeof(frame); b += 64) frame[b] = (char) i;
+
+        if (i == nfibers - 1 && ++lap == laps){
+            SwitchToFiber(main_fid);
+            continue;
+        }
+        SwitchToFiber(fids[(i + 1) % nfibers]);
+    }
+}
+
+// Runs the round robin with the stacks of mode, writes one JSON object to res
+static int run_mode(FILE *res, int mode, double ghz){
+    struct fiber_arena *arena = NULL;
+    void **params;
+    uint64_t t0, t1;
+    long long loads, stores;
+    long switches;
+    pid_t first;
+
+    bench_pin_cpu(cpu);
+    main_fid = ConvertThreadToFiber();
+    if (main_fid == -1) return 1;
+
+    fids   = calloc(nfibers, sizeof(pid_t));
+    params = calloc(nfibers, sizeof(void *));
+    if (!fids || !params) return 1;
+    for (long i = 0; i < nfibers; i++) params[i] = (void *) i;
+
+    if (mode == MODE_MALLOC){
+        for (long i = 0; i < nfibers; i++)
+            if ((fids[i] = CreateFiber(ring_fn, params[i])) == -1) return 1;
+    } else {
+        arena = fiber_arena_create(nfibers, 0, mode_flags[mode]);
+        if (!arena) return 1;
+        first = fiber_arena_create_fibers(arena, nfibers, ring_fn, params);
+        if (first == -1) return 1;
+        for (long i = 0; i < nfibers; i++) fids[i] = first + i;
+    }
+
+    tlb_fd[0] = open_tlb_counter(PERF_COUNT_HW_CACHE_OP_READ);
+    tlb_fd[1] = open_tlb_counter(PERF_COUNT_HW_CACHE_OP_WRITE);
+
+    // One lap to fault every stack in, then the measured laps
+    lap = laps - 1;
+    if (SwitchToFiber(fids[0]) == -1) return 1;
+
+    lap = 0;
+    tlb_counters(1);
+    t0 = bench_start();
+    SwitchToFiber(fids[0]);
+    t1 = bench_stop();
+    tlb_counters(0);
+
+    switches = laps * nfibers + 1;
+    loads  = read_tlb_counter(tlb_fd[0]);
+    stores = read_tlb_counter(tlb_fd[1]);
+
+    fprintf(res, "{\"stacks\": \"%s\", \"backing\": \"%s\", \"fibers\": %ld, "
+                 "\"switches\": %ld, \"ns_per_switch\": %.1f, "
+                 "\"switches_per_sec\": %.0f, "
+                 "\"dtlb_load_misses_per_switch\": %.3f, "
+                 "\"dtlb_store_misses_per_switch\": %.3f}",
+            mode_names[mode],
+            !arena ? "malloc" :
+            fiber_arena_backing(arena) == FIBER_ARENA_HUGETLB ? "hugetlb" :
+            fiber_arena_backing(arena) == FIBER_ARENA_THP ? "thp" : "base",
+            nfibers, switches, (t1 - t0) / ghz / switches,
+            switches / ((t1 - t0) / ghz) * 1e9,
+            loads  < 0 ? -1.0 : (double) loads  / switches,
+            stores < 0 ? -1.0 : (double) stores / switches);
+
+    return 0;
+}
+
+int main(int argc, char **argv){
+    const char *out_path = NULL;
+    FILE *out = stdout;
+    char line[1024];
+    double ghz;
+    int opt, first = 1;
+
+    while ((opt = getopt(argc, argv, "c:n:l:o:")) != -1){
+        switch (opt){
+            case 'c': cpu      = atoi(optarg); break;
+            case 'n': nfibers  = atol(optarg); break;
+            case 'l': laps     = atol(optarg); break;
+            case 'o': out_path = optarg;       break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu] [-n fibers] [-l laps] [-o out.json]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (nfibers < 2 || nfibers > FIBERS_BULK_MAX || laps < 1){
+        fprintf(stderr, "[bench] fibers must be in [2, %d], laps at least 1\n", FIBERS_BULK_MAX);
+        return 1;
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))){
+        perror("[bench] fopen");
+        return 1;
+    }
+
+    ghz = bench_tsc_ghz();
+
+    fprintf(out, "{\n  \"benchmark\": \"tlb\",\n  \"cpu\": %d,\n"
+                 "  \"tsc_ghz\": %.4f,\n  \"laps\": %ld,\n  \"results\": [",
+            cpu, ghz, laps);
+
+    for (int m = 0; m < MODES; m++){
+        int fds[2];
+        pid_t child;
+        FILE *in;
+
+        if (pipe(fds)) { perror("[bench] pipe"); return 1; }
+
+        fflush(out);
+        child = fork();
+        if (child == 0){
+            FILE *res = fdopen(fds[1], "w");
+            close(fds[0]);
+            exit(run_mode(res, m, ghz) ? 1 : (fclose(res), 0));
+        }
+
+        close(fds[1]);
+        in = fdopen(fds[0], "r");
+        if (fgets(line, sizeof(line), in)){
+            fprintf(out, "%s\n    %s", first ? "" : ",", line);
+            first = 0;
+        } else {
+            fprintf(stderr, "[bench] %s failed, is the module loaded?\n", mode_names[m]);
+        }
+        fclose(in);
+        waitpid(child, NULL, 0);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+    return 0;
+}
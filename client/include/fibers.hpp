@@ -0,0 +1,454 @@
+#pragma once
+
+#include "fibers_iface.h"
+#include "fibers_stacks.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// C++ layer over fibers_iface.h, header only.
+//
+// spawn() runs any callable in a new fiber without allocating for it: the
+// callable is moved to the top of the stack of the fiber, which runs right
+// below it. Stacks come from a stack arena (fibers_stacks.h) when given
+// one, so that spawning allocates nothing at all, or else from
+// posix_memalign() as CreateFiber does.
+//
+// A fiber finishes when its callable returns or calls fibers::exit(): the
+// callable is destroyed and the fiber switches back, for good, to the fiber
+// that spawned it. The module keeps the finished fiber until the process
+// exits, it must not be switched to again. An exception escaping the
+// callable terminates the process.
+//
+// FlsSlot<T> keeps a typed value per fiber in Fiber Local Storage, reading
+// it back from a per-thread cache.
+
+namespace fibers {
+
+// Stack of spawn() without an arena, the size CreateFiber uses
+inline constexpr std::size_t default_stack_size = 4096*2;
+
+namespace detail {
+
+inline constexpr unsigned long long frame_magic = 0x66696265722b2bULL;
+
+// Lives at the very top of the stack, the callable right below it. Stacks
+// are aligned to their size, so a fiber finds it from any of its frames.
+struct alignas(16) frame{
+
+    unsigned long long magic;
+    frame *self;
+
+    void *callable;
+    void (*run)(void *);
+    void (*destroy)(void *) noexcept;
+
+    pid_t link;                 // Spawning fiber, resumed when done
+    std::atomic<int> done;
+};
+
+// Stack sizes spawn() used so far, one bit per power of two
+inline std::atomic<unsigned long> stack_sizes{0};
+
+template <class Fn> void run(void *callable){
+    (*static_cast<Fn *>(callable))();
+}
+
+template <class Fn> void destroy(void *callable) noexcept{
+    static_cast<Fn *>(callable)->~Fn();
+}
+
+[[noreturn]] inline void finish(frame *fr) noexcept{
+
+    fr->destroy(fr->callable);
+    fr->done.store(1, std::memory_order_release);
+
+    // Waits for link if it is running on another thread
+    for (;;) SwitchToFiber(fr->link);
+}
+
+inline void entry(void *param) noexcept{
+
+    frame *fr = static_cast<frame *>(param);
+
+    fr->run(fr->callable);
+    finish(fr);
+}
+
+inline char *align_down(char *p, std::size_t align){
+    return reinterpret_cast<char *>(reinterpret_cast<std::uintptr_t>(p) & ~(align - 1));
+}
+
+} // namespace detail
+
+
+class Fiber;
+
+template <class F>
+Fiber spawn(F &&fn, struct fiber_arena *arena = nullptr);
+
+// Owns a spawned fiber and its stack. Destroying the handle destroys the
+// callable if the fiber did not finish and frees the stack, unless it
+// belongs to an arena: the fiber must not be running, nor be switched to
+// afterwards.
+class Fiber{
+
+public:
+
+    Fiber() noexcept = default;
+
+    Fiber(Fiber &&other) noexcept
+        : fid_(other.fid_), frame_(other.frame_), stack_(other.stack_){
+        other.fid_   = -1;
+        other.frame_ = nullptr;
+        other.stack_ = nullptr;
+    }
+
+    Fiber &operator=(Fiber &&other) noexcept{
+        if (this != &other){
+            reset();
+            std::swap(fid_, other.fid_);
+            std::swap(frame_, other.frame_);
+            std::swap(stack_, other.stack_);
+        }
+        return *this;
+    }
+
+    Fiber(const Fiber &) = delete;
+    Fiber &operator=(const Fiber &) = delete;
+
+    ~Fiber(){ reset(); }
+
+    // -1 for an empty handle
+    pid_t id() const noexcept { return fid_; }
+
+    explicit operator bool() const noexcept { return fid_ != -1; }
+
+    // The callable returned or called fibers::exit()
+    bool done() const noexcept{
+        return frame_ && frame_->done.load(std::memory_order_acquire);
+    }
+
+    // Switches to the fiber, returns once something switches back. -1 with
+    // errno set if it could not run, see SwitchToFiber.
+    int resume() noexcept{
+        if (!frame_ || done()){
+            errno = EINVAL;
+            return -1;
+        }
+        return SwitchToFiber(fid_);
+    }
+
+    void reset() noexcept{
+        if (frame_ && !done()) frame_->destroy(frame_->callable);
+        std::free(stack_);
+
+        fid_   = -1;
+        frame_ = nullptr;
+        stack_ = nullptr;
+    }
+
+private:
+
+    template <class F>
+    friend Fiber spawn(F &&fn, struct fiber_arena *arena);
+
+    Fiber(pid_t fid, detail::frame *fr, void *stack) noexcept
+        : fid_(fid), frame_(fr), stack_(stack) {}
+
+    pid_t fid_ = -1;
+    detail::frame *frame_ = nullptr;
+    void *stack_ = nullptr;     // NULL for stacks of an arena
+};
+
+
+// Runs fn() in a new fiber, moved or copied to the top of its stack, with
+// a stack of arena if not NULL. Must be called from a fiber: the fiber
+// does not run until resumed. Returns an empty handle with errno set on
+// error, EINVAL if fn takes more than half of the stack.
+template <class F>
+Fiber spawn(F &&fn, struct fiber_arena *arena){
+
+    using Fn = std::decay_t<F>;
+    static_assert(std::is_invocable_v<Fn &>, "spawn() needs a callable taking no arguments");
+
+    std::size_t size = arena ? fiber_arena_stack_size(arena) : default_stack_size;
+    void *owned = nullptr;
+    char *base, *top, *callable;
+    detail::frame *fr;
+    void *param;
+    pid_t fid;
+
+    if (arena){
+        base = static_cast<char *>(fiber_arena_alloc(arena, 1));
+        if (!base){
+            errno = ENOMEM;
+            return Fiber();
+        }
+    } else {
+        if ((errno = posix_memalign(&owned, size, size))) return Fiber();
+        base = static_cast<char *>(owned);
+    }
+
+    top = base + size;
+    fr = reinterpret_cast<detail::frame *>(top - sizeof(detail::frame));
+    callable = detail::align_down(reinterpret_cast<char *>(fr) - sizeof(Fn), alignof(Fn));
+
+    if (callable - base < static_cast<std::ptrdiff_t>(size / 2)){
+        std::free(owned);
+        errno = EINVAL;
+        return Fiber();
+    }
+
+    try {
+        ::new (static_cast<void *>(callable)) Fn(std::forward<F>(fn));
+    } catch (...) {
+        std::free(owned);
+        throw;
+    }
+
+    fr->magic    = detail::frame_magic;
+    fr->self     = fr;
+    fr->callable = callable;
+    fr->run      = &detail::run<Fn>;
+    fr->destroy  = &detail::destroy<Fn>;
+    fr->link     = GetCurrentFiber();
+    ::new (static_cast<void *>(&fr->done)) std::atomic<int>(0);
+
+    // The fiber starts right below the callable, a stride of the region
+    // CreateFibers would use for a single stack
+    param = fr;
+    fid = CreateFibers(1, &detail::entry, &param, base,
+                       detail::align_down(callable, 16) - base);
+    if (fid == -1){
+        detail::destroy<Fn>(callable);
+        std::free(owned);
+        return Fiber();
+    }
+
+    detail::stack_sizes.fetch_or(size, std::memory_order_relaxed);
+
+    return Fiber(fid, fr, owned);
+}
+
+// Switches to fid, -1 with errno set on error, see SwitchToFiber
+inline int switch_to(pid_t fid) noexcept{
+    return SwitchToFiber(fid);
+}
+
+inline pid_t this_fiber() noexcept{
+    return GetCurrentFiber();
+}
+
+// Called from a spawned fiber: destroys its callable and finishes it right
+// away. Objects living in the frames of the fiber are not destroyed.
+[[noreturn]] inline void exit() noexcept{
+
+    char here;
+    unsigned long sizes = detail::stack_sizes.load(std::memory_order_relaxed);
+
+    // The smallest size whose top holds a frame is the size of this stack,
+    // larger tops may lie past its end
+    for (unsigned long size = 4096; size <= FIBER_ARENA_HUGE_PAGE; size <<= 1){
+
+        if (!(sizes & size)) continue;
+
+        char *top = detail::align_down(&here, size) + size;
+        auto *fr = reinterpret_cast<detail::frame *>(top - sizeof(detail::frame));
+
+        if (fr->magic == detail::frame_magic && fr->self == fr) detail::finish(fr);
+    }
+
+    std::abort();   // Not a fiber from spawn()
+}
+
+
+namespace detail {
+
+// Cached FLS values, direct mapped by slot id. An entry is valid while its
+// epoch is the fibers_switch_epoch of the thread: it was filled by the
+// fiber running, since it last was switched to.
+struct fls_entry{
+
+    unsigned long epoch;
+    unsigned long id;
+    long long value;
+};
+
+inline constexpr unsigned fls_cache_lines = 64;
+
+inline thread_local fls_entry fls_cache[fls_cache_lines];
+
+inline std::atomic<unsigned long> fls_next_id{1};
+
+// Index of a slot in every fiber, two levels indexed by fid
+inline constexpr std::size_t fls_page_fids = 4096;
+inline constexpr std::size_t fls_pages = 1024;
+
+inline void barrier() noexcept{
+    asm volatile("" ::: "memory");
+}
+
+// Never inlined, like GetCurrentFiber: the fiber may have moved to another
+// thread since its caller computed the address of the cache.
+// Epochs are unique, so only this activation of the fiber fills entries
+// with the one loaded first, even if it is preempted and the entry then
+// belongs to another thread. Filled epoch last, checked last.
+[[gnu::noinline]] inline bool fls_lookup(unsigned long id, long long *value) noexcept{
+
+    unsigned long epoch = fibers_switch_epoch;
+    barrier();
+
+    const fls_entry &e = fls_cache[id % fls_cache_lines];
+
+    *value = e.value;
+    barrier();
+
+    return e.id == id && e.epoch == epoch;
+}
+
+// Invalid first, valid last: an entry half written before a migration
+// never matches
+[[gnu::noinline]] inline void fls_fill(unsigned long id, long long value) noexcept{
+
+    unsigned long epoch = fibers_switch_epoch;
+    fls_entry &e = fls_cache[id % fls_cache_lines];
+
+    e.epoch = 0;
+    barrier();
+    e.id    = id;
+    e.value = value;
+    barrier();
+    e.epoch = epoch;
+}
+
+} // namespace detail
+
+
+// A T per fiber, T{} in fibers that did not set it. T is trivially
+// copyable and at most 8 bytes, a pointer for larger values.
+//
+// A slot takes one FLS index in each fiber that uses it, allocated on its
+// first access; indices stay allocated when the slot is destroyed, a slot
+// usually lives as long as the process. Writes go through to the module.
+// Reads are served by a per-thread cache that SwitchToFiber invalidates:
+// once a fiber read or wrote the slot, its next reads until it switches
+// away are a call and a few loads, and the first one after it is switched
+// back to costs a FlsGetValue. A read preempted and resumed on another
+// thread misses the cache.
+template <class T>
+class FlsSlot{
+
+    static_assert(std::is_trivially_copyable_v<T>, "FLS values are copied bytewise");
+    static_assert(sizeof(T) <= sizeof(long long), "FLS values are 8 bytes at most");
+
+public:
+
+    FlsSlot() noexcept = default;
+
+    FlsSlot(const FlsSlot &) = delete;
+    FlsSlot &operator=(const FlsSlot &) = delete;
+
+    ~FlsSlot(){
+        for (auto &page : pages_) delete[] page.load(std::memory_order_relaxed);
+    }
+
+    // Value of the calling fiber, T{} on error
+    T get() const noexcept{
+
+        long long value;
+
+        if (detail::fls_lookup(id_, &value)) return decode(value);
+
+        return get_slow();
+    }
+
+    // Sets the value of the calling fiber, -1 with errno set on error
+    int set(const T &v) noexcept{
+
+        long long value = encode(v);
+        long index = index_of_current();
+
+        if (index == -1 || FlsSetValue(index, value) == -1) return -1;
+        detail::fls_fill(id_, value);
+
+        return 0;
+    }
+
+private:
+
+    static long long encode(const T &v) noexcept{
+        long long value = 0;
+        std::memcpy(&value, &v, sizeof(T));
+        return value;
+    }
+
+    static T decode(long long value) noexcept{
+        T v;
+        std::memcpy(&v, &value, sizeof(T));
+        return v;
+    }
+
+    T get_slow() const noexcept{
+
+        long index = index_of_current();
+        long long value;
+
+        if (index == -1) return T{};
+
+        value = FlsGetValue(index);
+        detail::fls_fill(id_, value);
+
+        return decode(value);
+    }
+
+    // FLS index of the slot in the calling fiber, allocated and zeroed on
+    // first use. Entries hold index + 1, only their own fiber writes them.
+    long index_of_current() const noexcept{
+
+        pid_t fid = GetCurrentFiber();
+        std::atomic<long> *page;
+        long index;
+
+        if (fid < 0 || static_cast<std::size_t>(fid) >= detail::fls_page_fids * detail::fls_pages){
+            errno = fid < 0 ? EPERM : ERANGE;
+            return -1;
+        }
+
+        auto &slot = pages_[fid / detail::fls_page_fids];
+        if (!(page = slot.load(std::memory_order_acquire))){
+
+            std::atomic<long> *fresh = new (std::nothrow) std::atomic<long>[detail::fls_page_fids]();
+            if (!fresh){
+                errno = ENOMEM;
+                return -1;
+            }
+            if (slot.compare_exchange_strong(page, fresh, std::memory_order_acq_rel)) page = fresh;
+            else delete[] fresh;
+        }
+
+        auto &entry = page[fid % detail::fls_page_fids];
+        if ((index = entry.load(std::memory_order_relaxed))) return index - 1;
+
+        if ((index = FlsAlloc()) == -1) return -1;
+        if (FlsSetValue(index, 0) == -1){
+            FlsFree(index);
+            return -1;
+        }
+        entry.store(index + 1, std::memory_order_relaxed);
+
+        return index;
+    }
+
+    const unsigned long id_ = detail::fls_next_id.fetch_add(1, std::memory_order_relaxed);
+    mutable std::atomic<std::atomic<long> *> pages_[detail::fls_pages] = {};
+};
+
+} // namespace fibers
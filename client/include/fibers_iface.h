@@ -1,7 +1,32 @@
+#pragma once
+
 #include <sys/types.h>
+#include <sys/ioctl.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The library comes in two flavours, selected at compile time for the
+// library and its users alike:
+//  - by default the hot calls (SwitchToFiber and the Fls* family) are
+//    inline ioctl wrappers defined in this header, nothing is ever
+//    printed and errors are reported by returning -1 with errno set;
+//  - with FIBERS_LOG defined every call is an out-of-line function that
+//    logs what it does on stdout, as the tests expect.
+// /dev/fibers is opened once per process by the first ConvertThreadToFiber.
+// errno is ESRCH when the process, thread or fiber is unknown to the
+// module, EBUSY when the target fiber is running on another thread, EEXIST
+// when the thread already is a fiber, EINVAL for bad arguments, ENOENT for
+// an FLS index that is not allocated, ENOSPC when FLS is full, ENOMEM and
+// EFAULT.
+//
+// A fiber may be resumed by any thread of the process, so code running in
+// a fiber must not keep thread-local addresses (errno included) across
+// SwitchToFiber.
+
 // Converts the current thread into a Fiber and allows from now on to 
 // create other Fibers and switch among them.
 pid_t ConvertThreadToFiber();
@@ -11,29 +36,27 @@ pid_t ConvertThreadToFiber();
 // @user_param: the void* pointer to data that will be passed to user_func 
 pid_t CreateFiber(void (*user_func)(void*), void *user_param );
 
-// Changes the current context of execution into the one of a given Fiber
-// @fiber_id: id of the Fiber that we want to schedule
-pid_t SwitchToFiber(pid_t fiber_id);
-
-
-// Allocates one Fiber Local Storage entry
-long FlsAlloc();
-
-// Frees a Fiber Local Storage entry
-// @index: index identifier of the entry to be freed
-int FlsFree(long index);
+// Same as CreateFiber, but the stack and the kernel bookkeeping of the
+// fiber are allocated on NUMA node @node (-1 for the node of the caller).
+// Pass the node of the threads that will run the fiber.
+pid_t CreateFiberOnNode(void (*user_func)(void*), void *user_param, int node);
 
-// Gets value of a Fiber Local Storage entry
-// @index: index identifier of the entry to be read
-long long FlsGetValue(long index);
-
-// Sets value of a Fiber Local Storage entry
-// @index: index identifier of the entry to be written
-// @value: value to be written
-int FlsSetValue(long index, long long value);
+// Creates n fibers (at most FIBERS_BULK_MAX) in a single call, fiber i
+// runs user_func(params[i]).
+// @params: n parameters, NULL passes NULL to every fiber
+// @stacks: region of n stacks of stride bytes each, NULL to have the
+//          library allocate n stacks of the default size in one block
+// Returns the fid of the first fiber, the others follow in order, or -1.
+pid_t CreateFibers(int n, void (*user_func)(void*), void **params,
+                   void *stacks, long stride);
 
+// Terminates the calling fiber, together with the thread hosting it
 int FiberExit();
 
+// Returns the fid of the fiber running on the calling thread, -1 if the
+// thread was never converted
+pid_t GetCurrentFiber();
+
 #ifndef FIBERS_DRIVER
 #define FIBERS_DRIVER
 
@@ -49,8 +72,27 @@ struct fiber_args{
     long user_fn;
     void *fn_params;
 
+    int   node;             // NUMA node of the threads expected to run the
+                            // fiber, -1 for the node of the caller
+
+};
+
+
+// Creation of many fibers in one call, see IOCTL_CreateFibers
+struct fibers_args{
+
+    long   user_fn;
+    void **fn_params;       // count parameters, one per fiber
+    void  *stack_region;    // Stack of fiber i starts at
+    long   stack_stride;    // stack_region + i * stack_stride
+    long   stack_size;
+    int    count;           // At most FIBERS_BULK_MAX
+    int    node;            // As in fiber_args
+
 };
 
+#define FIBERS_BULK_MAX 65536
+
 
 struct fls_args{
     
@@ -60,6 +102,202 @@ struct fls_args{
 };
 
 
+// Buckets of fiber_stats.run_hist, by length of the activation:
+// < 10us, < 100us, < 1ms, < 10ms, < 100ms and longer
+#define FIBER_RUN_BUCKETS 6
+
+// Fixed-layout record describing one fiber, filled by IOCTL_GetFiberStats.
+// Fields are only ever appended: userspace tells the module the size of the
+// record it was compiled with through fiber_stats_args.entry_size.
+struct fiber_stats{
+
+    int fid;
+    int parent;             // Pid of thread that created the fiber
+    int state;              // One of the FIBER_STATE_*
+    int last_cpu;           // -1 if the fiber has never run
+
+    unsigned long long activations;
+    unsigned long long failed_activations;
+    unsigned long long running_time;
+    unsigned long long generation;  // Process generation of last update
+
+    unsigned long long local_activations;   // Activations on a cpu of node
+    unsigned long long remote_activations;  // Activations on other nodes
+    int node;               // NUMA node holding the fiber's stack
+    int last_node;          // -1 if the fiber has never run
+
+    unsigned long long preemptions; // Time slices that expired on it
+
+    // Accounted to the fiber at each switch out of it
+    unsigned long long min_flt;
+    unsigned long long maj_flt;
+    unsigned long long nvcsw;       // Voluntary context switches
+    unsigned long long nivcsw;      // Involuntary context switches
+    unsigned long long instructions;// 0 unless FIBER_PERF_INSTRUCTIONS
+    unsigned long long cycles;      // 0 unless FIBER_PERF_CYCLES
+
+    // Wall-clock time, in ns, of the activations and of the time in between
+    unsigned long long max_run_ns;  // Longest activation
+    unsigned long long run_hist[FIBER_RUN_BUCKETS]; // Activations by length
+    unsigned long long parked_ns;   // Switched out, between activations
+    unsigned long long last_deactivation_ns; // CLOCK_MONOTONIC, 0 if the
+                                             // fiber never switched out
+
+    // Stack given to CreateFiber, both 0 for a thread converted to fiber
+    unsigned long long stack_size;
+    unsigned long long stack_hwm;   // Deepest use seen when switching out
+                                    // of the fiber, in bytes
+
+    int last_pid;           // Thread the fiber last ran on, 0 if none
+    int pinned;             // 1 if the fiber has an affinity mask
+    unsigned long long cpu_migrations;      // Resumed on another cpu, or
+    unsigned long long thread_migrations;   // thread, than the last time
+
+};
+
+#define FIBER_STATE_IDLE     0
+#define FIBER_STATE_RUNNING  1
+// Reported once the fiber has exited, by incremental polls only, with only
+// fid, parent and generation set
+#define FIBER_STATE_EXITED   2
+
+// Returned by IOCTL_SwitchToFiber to the resumed fiber instead of 0 when it
+// keeps being resumed on another node than the one holding its stack: the
+// caller should move the stack pages to the current node.
+#define FIBER_SWITCH_MIGRATE 1
+
+// Returned to the scheduler fiber of a thread instead of 0 when it gets
+// control back because the fiber it switched to was preempted.
+#define FIBER_SWITCH_PREEMPTED 2
+
+// IOCTL_SwitchToFiber fails with errno EXDEV when the fiber has an
+// affinity mask without the cpu of the calling thread.
+
+
+struct preempt_args{
+
+    unsigned long long slice_ns;    // Time slice of every fiber of the
+                                    // process, 0 disables preemption
+    int   sched_fid;                // Fiber that takes over the calling
+                                    // thread on expiry, -1 for the fiber
+                                    // the thread was converted into
+    int  *critical;                 // Optional per-thread counter, expiry
+                                    // is deferred while it is not 0
+
+};
+
+
+// Cpus a fiber may be resumed on, see IOCTL_SetFiberAffinity
+struct fiber_affinity_args{
+
+    int   fid;
+    int   size;                 // Bytes of mask, 0 lets the fiber run on
+                                // any cpu again
+    unsigned long *mask;        // Bit i set if cpu i is allowed, e.g. a
+                                // cpu_set_t
+
+};
+
+// Stack of the fiber running on the calling thread, see
+// IOCTL_GetFiberStack. stack_base is NULL for a thread converted to fiber.
+struct fiber_stack_args{
+
+    void *stack_base;
+    long  stack_size;
+
+};
+
+
+struct fiber_stats_args{
+
+    struct fiber_stats *buf;    // User buffer to be filled
+    long  entry_size;           // sizeof(struct fiber_stats) in userspace
+    long  capacity;             // Number of entries that fit in buf
+
+    int   fid_from;             // First fid of the range to report
+    int   fid_to;               // Last fid of the range, -1 for all
+
+    int   tgid;                 // Process to report, 0 for the caller.
+                                // Others need the right to ptrace it
+    int   reserved;
+
+    unsigned long long since_generation;   // Report only fibers updated
+                                           // after this generation
+
+    unsigned long long generation;  // OUT: current process generation
+    long  count;                    // OUT: entries written into buf
+    long  total;                    // OUT: entries matching the request
+
+};
+
+
+// Flight recorder event types
+#define FIBER_EVENT_CREATE   1  // from: running fiber, to: created fiber
+#define FIBER_EVENT_SWITCH   2
+#define FIBER_EVENT_PREEMPT  3  // Switch forced by a time slice expiry
+#define FIBER_EVENT_EXIT     4  // from: exiting fiber, to: -1
+#define FIBER_EVENT_FAILED   5  // to was already running on another thread
+
+struct fiber_event{
+
+    unsigned long long seq;     // Index of the event + 1, changes while
+                                // the event is being written
+    unsigned long long ts_ns;   // CLOCK_MONOTONIC
+    unsigned short type;        // FIBER_EVENT_*
+    unsigned short cpu;
+    int   pid;                  // Thread that caused the event
+    int   from;
+    int   to;
+
+};
+
+// Flight recorder of a process: a ring holding its last fiber events,
+// shared read-only through mmap() on /dev/fibers. Event i is stored in
+// events[i % capacity], and is valid while its seq reads i + 1 both before
+// and after copying it.
+struct fiber_recorder{
+
+    unsigned long long head;    // Events recorded so far
+    unsigned int capacity;      // Events in the ring, a power of two
+    unsigned int event_size;    // sizeof(struct fiber_event)
+    unsigned long long reserved[6];
+
+    struct fiber_event events[];
+
+};
+
+// Live counters of a process, in a page shared read-only through mmap()
+// on /dev/fibers and updated in place by the module. A copy of the gauges
+// (fibers, threads, fls_*) is consistent if seq was even before taking it
+// and is unchanged after; the monotonic counters are each updated
+// atomically, outside of seq.
+struct fiber_live_stats{
+
+    unsigned int seq;
+    unsigned int reserved;
+
+    unsigned long long fibers;      // Alive, converted threads included
+    unsigned long long threads;     // Threads converted to fiber
+    unsigned long long created;     // Fibers ever created or converted
+    unsigned long long exited;
+    unsigned long long switches;    // Successful activations
+    unsigned long long preemptions;
+    unsigned long long failed_activations;
+    unsigned long long fls_fibers;  // Fibers alive that set up FLS
+    unsigned long long fls_bytes;   // FLS memory of those fibers
+
+};
+
+// mmap() page offsets of the areas /dev/fibers shares with monitoring
+// processes, which may map those of any process they may ptrace.
+// tgid is the pid of the process in the initial pid namespace.
+#define FIBERS_MMAP_REGION_BITS 4
+#define FIBERS_MMAP_RECORDER    0
+#define FIBERS_MMAP_STATS       1     // One page
+#define FIBERS_MMAP_PGOFF(tgid, region) \
+    (((unsigned long)(tgid) << FIBERS_MMAP_REGION_BITS) | (region))
+
+
 #define DRIVER_NAME       "fibers"
 #define MAJOR_NUM         100
 #define IOCTL_ConvertThreadToFiber  _IO(MAJOR_NUM, 0)
@@ -73,7 +311,222 @@ struct fls_args{
 
 #define IOCTL_FiberExit             _IO(MAJOR_NUM, 7)
 
+#define IOCTL_GetFiberStats         _IOWR(MAJOR_NUM, 8, struct fiber_stats_args *)
+
+#define IOCTL_SetPreemption         _IOW(MAJOR_NUM, 9, struct preempt_args *)
+
+// Hardware counters accounted to fibers, ORed into the argument of
+// IOCTL_EnablePerfCounters. They need a PMU, unlike faults and context
+// switches which are always accounted.
+#define FIBER_PERF_INSTRUCTIONS 0x1
+#define FIBER_PERF_CYCLES       0x2
+
+#define IOCTL_EnablePerfCounters    _IOW(MAJOR_NUM, 10, long)
+
+#define IOCTL_EnableFlightRecorder  _IOW(MAJOR_NUM, 11, long)
+
+// Returns the fid of the first fiber created, the others follow in order
+#define IOCTL_CreateFibers          _IOW(MAJOR_NUM, 12, struct fibers_args *)
+
+// fork() support. ForkPrepare is called by the forking thread right before
+// fork() and returns a sequence number, which the child passes to
+// ForkChild on a descriptor of its own to inherit the fibers of its parent.
+#define IOCTL_ForkPrepare           _IO(MAJOR_NUM, 13)
+#define IOCTL_ForkChild             _IOW(MAJOR_NUM, 14, long)
+
+// Cache affinity. SetFiberAffinity restricts the cpus a fiber may be
+// resumed on, GetFiberLastCpu returns the cpu it last ran on, -1 if it
+// never ran, for userspace schedulers to place it where its cache is warm.
+#define IOCTL_SetFiberAffinity      _IOW(MAJOR_NUM, 15, struct fiber_affinity_args *)
+#define IOCTL_GetFiberLastCpu       _IOW(MAJOR_NUM, 16, long)
+
+// Stack the running fiber was created with, for FIBER_SWITCH_MIGRATE
+#define IOCTL_GetFiberStack         _IOR(MAJOR_NUM, 17, struct fiber_stack_args *)
+
 
 #endif
 
+// Copies in a single call the statistics of all fibers of this process
+// whose fid is in [fid_from, fid_to] (fid_to -1 means no upper bound) and
+// that were updated after since_generation (0 reports every live fiber).
+// Fibers that exited after since_generation are reported once more, with
+// state FIBER_STATE_EXITED. Only the last exits are kept: when some of
+// those after since_generation were dropped, the call fails with errno
+// ESTALE and the caller resyncs with a full poll.
+// @buf       : array of at least capacity records
+// @generation: if not NULL, receives the generation to pass as
+//              since_generation on the next incremental poll
+// Returns the number of records written, -1 on error.
+long GetFiberStats(struct fiber_stats *buf, long capacity, int fid_from,
+                   int fid_to, unsigned long long since_generation,
+                   unsigned long long *generation);
+
+// GetFiberStats of process tgid, for monitoring agents that may ptrace it.
+// Does not need the caller to use fibers.
+long GetProcessFiberStats(pid_t tgid, struct fiber_stats *buf, long capacity,
+                          int fid_from, int fid_to,
+                          unsigned long long since_generation,
+                          unsigned long long *generation);
+
+// File descriptor of /dev/fibers, shared by all threads
+extern int fibers_fd;
+
+// Fiber running on each thread, kept up to date by SwitchToFiber
+extern __thread pid_t fibers_current_fid;
+
+// Changed by every SwitchToFiber of the thread, and never the same on two
+// threads: a value cached while it is unchanged belongs to the fiber
+// running, see FlsSlot in fibers.hpp
+extern __thread unsigned long fibers_switch_epoch;
+extern unsigned long fibers_epoch_source;
+
+// Moves the stack of the calling fiber to the NUMA node it is running on,
+// called by SwitchToFiber when the module asks for it.
+void fibers_migrate_stack();
+
+// Sets the fiber running on the calling thread, called by SwitchToFiber
+// when the module switched fiber on its own.
+void fibers_set_current(pid_t fid);
+
+// Gives every fiber of the process a time slice of slice_ns (0 disables
+// preemption). When it expires, the module switches the thread to
+// sched_fid (-1 for the fiber the thread was converted into), whose
+// SwitchToFiber then returns; the preempted fiber resumes where it was
+// when switched to again. Expiry is deferred while *critical is not 0.
+// @critical: per-thread counter, may be NULL
+// The scheduler fiber must not need locks held by the preempted code.
+int SetPreemption(unsigned long long slice_ns, pid_t sched_fid, int *critical);
+
+// Accounts the FIBER_PERF_* hardware counters in flags to fibers, 0 turns
+// them off. Faults and context switches are always accounted.
+// Returns -1 if a counter is not available on the calling thread, e.g. in
+// a VM without a virtual PMU; the others are accounted anyway.
+int EnablePerfCounters(unsigned int flags);
+
+// Restricts the cpus fid may be resumed on to those set in mask, size bytes
+// long (e.g. a cpu_set_t and its size); a size of 0 lifts the restriction.
+// Switching to fid from a thread running on another cpu fails with errno
+// EXDEV, leaving the caller free to resume it from a thread of its own on
+// an allowed cpu. Takes effect at the next switch to fid.
+int SetFiberAffinity(pid_t fid, size_t size, const void *mask);
+
+// Cpu fid last ran on, -1 with errno ENODATA if it never ran: a scheduler
+// resuming it there finds its working set still in cache.
+int GetFiberLastCpu(pid_t fid);
+
+// Starts recording create, switch, preempt, exit and failed activation
+// events of this process in a ring of at least events entries (0 for the
+// default of 4096, at most 2^20), rounded up to a power of two. Once on,
+// recording stays on with the same ring until the process exits.
+int EnableFlightRecorder(unsigned long events);
+
+// Maps read-only the flight recorder of process tgid, which must have
+// turned it on and be traceable by the caller. Returns NULL on error.
+struct fiber_recorder *OpenFlightRecorder(pid_t tgid);
+
+void CloseFlightRecorder(struct fiber_recorder *r);
+
+// Copies into out, oldest first, up to n events recorded since *cursor
+// (start from 0) and moves *cursor past them. Events overwritten before
+// being read are skipped and added to *lost, if not NULL.
+// Returns the number of events copied.
+long ReadFlightRecorder(struct fiber_recorder *r, unsigned long long *cursor,
+                        struct fiber_event *out, long n,
+                        unsigned long long *lost);
+
+// Maps read-only the live counters of process tgid, which must have
+// converted a thread to fiber and be traceable by the caller. The module
+// keeps them up to date. Returns NULL on error.
+const struct fiber_live_stats *OpenLiveStats(pid_t tgid);
+
+void CloseLiveStats(const struct fiber_live_stats *s);
+
+// Takes a consistent copy of the gauges along with the counters, a few
+// loads
+void ReadLiveStats(const struct fiber_live_stats *s, struct fiber_live_stats *out);
+
+// Lets children created by fork() from a fiber keep using fibers: the
+// child goes on as the forking fiber and can switch to the other fibers
+// of the parent as they were at fork time, FLS included. Fibers running on
+// other threads at fork time are not inherited, nor are preemption, perf
+// counters and the flight recorder.
+// Only the first call registers the pthread_atfork() handlers.
+int EnableFork();
 
+#ifdef FIBERS_LOG
+
+// Changes the current context of execution into the one of a given Fiber
+// @fiber_id: id of the Fiber that we want to schedule
+pid_t SwitchToFiber(pid_t fiber_id);
+
+
+// Allocates one Fiber Local Storage entry
+long FlsAlloc();
+
+// Frees a Fiber Local Storage entry
+// @index: index identifier of the entry to be freed
+int FlsFree(long index);
+
+// Gets value of a Fiber Local Storage entry
+// @index: index identifier of the entry to be read
+long long FlsGetValue(long index);
+
+// Sets value of a Fiber Local Storage entry
+// @index: index identifier of the entry to be written
+// @value: value to be written
+int FlsSetValue(long index, long long value);
+
+#else
+
+static inline pid_t SwitchToFiber(pid_t fiber_id){
+    pid_t prev = fibers_current_fid;
+    int ret;
+
+    // Set before switching: when the ioctl returns we are running the
+    // resumed fiber, whose frame may come from another thread.
+    fibers_current_fid = fiber_id;
+    fibers_switch_epoch = __atomic_add_fetch(&fibers_epoch_source, 1, __ATOMIC_RELAXED);
+    ret = ioctl(fibers_fd, IOCTL_SwitchToFiber, (unsigned long) fiber_id);
+    if (ret == -1){
+        fibers_current_fid = prev;
+        return ret;
+    }
+
+    if (ret == FIBER_SWITCH_MIGRATE)   fibers_migrate_stack();
+    if (ret == FIBER_SWITCH_PREEMPTED) fibers_set_current(prev);
+
+    return 0;
+}
+
+static inline long FlsAlloc(){
+    return ioctl(fibers_fd, IOCTL_FlsAlloc, 0);
+}
+
+static inline int FlsFree(long index){
+    return ioctl(fibers_fd, IOCTL_FlsFree, index);
+}
+
+static inline long long FlsGetValue(long index){
+    struct fls_args flsargs;
+
+    flsargs.index = index;
+    if (ioctl(fibers_fd, IOCTL_FlsGetValue, (unsigned long) &flsargs) == -1)
+        return -1;
+
+    return flsargs.value;
+}
+
+static inline int FlsSetValue(long index, long long value){
+    struct fls_args flsargs;
+
+    flsargs.index = index;
+    flsargs.value = value;
+
+    return ioctl(fibers_fd, IOCTL_FlsSetValue, (unsigned long) &flsargs);
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
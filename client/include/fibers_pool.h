@@ -0,0 +1,73 @@
+#pragma once
+
+#include "fibers_iface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Executor built on a pool of long-lived worker fibers. Tasks are queued by
+// fiber_pool_submit() and run by the worker fibers, on the threads running
+// fiber_pool_run(). A worker fiber runs tasks as long as the queue is not
+// empty and then parks, idle, until a runner switches to it again: a task
+// costs a queue push and pop, plus one switch when it finds the workers
+// idle. Worker fibers are never destroyed, no fiber exits.
+//
+// A task may call fiber_pool_yield() to let queued tasks run; its fiber
+// stays busy meanwhile, and the pool grows up to its maximum to run them.
+
+struct fiber_pool;
+
+struct fiber_pool_stats{
+
+    long queue_len;                     // Tasks waiting for a fiber
+    long queue_max;                     // Deepest the queue has been
+    long fibers;                        // Worker fibers, busy or idle
+    long idle;                          // Parked, waiting for tasks
+    long yielded;                       // Waiting for a runner to resume them
+    int  runners;                       // Threads in fiber_pool_run()
+
+    unsigned long long submitted;
+    unsigned long long completed;
+    unsigned long long dispatches;      // Switches from a runner to a fiber
+
+    // Time runners spent in worker fibers and in fiber_pool_run()
+    unsigned long long busy_ns;
+    unsigned long long run_ns;
+    double utilization;                 // busy_ns / run_ns
+
+};
+
+// Creates a pool
+// @min_fibers: worker fibers created by the first runner
+// @max_fibers: at most this many worker fibers, 0 for no bound
+// @grow      : fibers created at once when a task finds none idle, 0 for 1
+struct fiber_pool *fiber_pool_create(long min_fibers, long max_fibers, long grow);
+
+// Frees a pool once every runner has returned. Its worker fibers stay in
+// the module, parked, and tasks still queued are dropped.
+void fiber_pool_destroy(struct fiber_pool *p);
+
+// Queues fn(param), from any thread. Returns -1 if the queue could not
+// grow.
+int fiber_pool_submit(struct fiber_pool *p, void (*fn)(void*), void *param);
+
+// Runs tasks on the calling thread, which must have been converted to
+// fiber, until fiber_pool_stop()
+int fiber_pool_run(struct fiber_pool *p);
+
+// Makes every runner return as soon as the fiber it runs switches back.
+// Tasks still queued stay queued, for the next fiber_pool_run().
+void fiber_pool_stop(struct fiber_pool *p);
+
+// Called by a task: lets the runner of this thread start queued tasks on
+// other fibers. The task resumes once the queue is empty, or once the pool
+// cannot grow and no fiber is idle.
+int fiber_pool_yield(struct fiber_pool *p);
+
+// Copies the metrics of the pool
+int fiber_pool_get_stats(struct fiber_pool *p, struct fiber_pool_stats *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "fibers_iface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Scheduler built on SwitchToFiber. Worker threads run fiber_sched_run(),
+// which repeatedly picks the most urgent runnable fiber and switches to it;
+// the fiber runs until it yields, parks or returns.
+//
+// Classes are strict: a fiber in a class is only picked when every class
+// before it is empty.
+//  - FIBER_SCHED_EDF orders fibers by absolute deadline, earliest first;
+//  - the priority classes are FIFO.
+// Against starvation, a fiber waiting in a priority class is treated as one
+// class more urgent for every aging period spent in the queue, up to the
+// EDF class.
+
+#define FIBER_SCHED_EDF      0
+#define FIBER_SCHED_HIGH     1
+#define FIBER_SCHED_NORMAL   2
+#define FIBER_SCHED_LOW      3
+
+#define FIBER_SCHED_CLASSES  4
+
+struct fiber_sched;
+
+// Per-class metrics, wait time goes from enqueue to dispatch.
+// Percentiles are upper bounds, within 25% of the exact value.
+struct fiber_sched_class_stats{
+
+    long queue_len;                     // Fibers currently queued
+
+    unsigned long long enqueued;
+    unsigned long long dispatched;
+    unsigned long long aged;            // Dispatched ahead of their class
+    unsigned long long missed_deadlines;// EDF only, dispatched too late
+
+    unsigned long long wait_ns_total;
+    unsigned long long wait_ns_max;
+    unsigned long long wait_ns_p50;
+    unsigned long long wait_ns_p99;
+    unsigned long long wait_ns_p999;
+
+};
+
+// Creates a scheduler
+// @aging_ns: queueing time after which a fiber is promoted by one class,
+//            0 disables aging
+struct fiber_sched *fiber_sched_create(unsigned long long aging_ns);
+
+// Frees a scheduler once every worker has returned
+void fiber_sched_destroy(struct fiber_sched *s);
+
+// Creates a fiber running fn(param) and makes it runnable. The fiber
+// leaves the scheduler when fn returns.
+// @cls     : one of the FIBER_SCHED_* classes
+// @deadline: absolute CLOCK_MONOTONIC time in ns, used by the EDF class
+// Must be called from a fiber, returns the fid or -1.
+pid_t fiber_sched_spawn(struct fiber_sched *s, void (*fn)(void*), void *param,
+                        int cls, unsigned long long deadline);
+
+// Moves a fiber to another class, a queued fiber keeps its waiting time
+int fiber_sched_set_priority(struct fiber_sched *s, pid_t fid, int cls);
+
+// Changes the deadline of a fiber, used while it is in the EDF class
+int fiber_sched_set_deadline(struct fiber_sched *s, pid_t fid,
+                             unsigned long long deadline);
+
+// Preempts fibers that run for longer than slice_ns without switching
+// back, 0 (the default) lets them run until they do. Takes effect at the
+// next fiber_sched_run(), and applies to every fiber of the process while
+// a worker is running. Preempted fibers go back to the end of their queue.
+int fiber_sched_set_time_slice(struct fiber_sched *s, unsigned long long slice_ns);
+
+// Runs the scheduler on the calling thread, which must have been converted
+// to fiber. Returns when every spawned fiber has returned or after
+// fiber_sched_stop().
+int fiber_sched_run(struct fiber_sched *s);
+
+// Makes every worker return as soon as its current fiber switches back
+void fiber_sched_stop(struct fiber_sched *s);
+
+// Called by a scheduled fiber: goes back to the end of its queue
+int fiber_sched_yield(struct fiber_sched *s);
+
+// Called by a scheduled fiber: stops running until fiber_sched_wake()
+int fiber_sched_park(struct fiber_sched *s);
+
+// Makes a parked fiber runnable again. Waking a fiber that is parking is
+// not lost, it will not sleep.
+int fiber_sched_wake(struct fiber_sched *s, pid_t fid);
+
+// Copies the metrics of class cls
+int fiber_sched_get_stats(struct fiber_sched *s, int cls,
+                          struct fiber_sched_class_stats *out);
+
+// CLOCK_MONOTONIC now, in ns, to compute deadlines
+unsigned long long fiber_sched_now();
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "fibers_iface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stack arenas: fiber stacks carved out of large mappings backed by huge
+// pages. Switching among many fibers touches the top of every stack; with
+// base pages each of them costs a TLB entry, in an arena a 2 MiB page holds
+// the tops of 2 MiB / stack_size fibers.
+//
+// The arena is aligned to the huge page size and stacks are aligned to
+// their own size, a power of two, so no stack straddles two huge pages and
+// neighbouring fibers share the pages holding their tops. Stacks are only
+// given back when the whole arena is destroyed.
+
+#define FIBER_ARENA_HUGE_PAGE   (2L << 20)
+
+// Backing of an arena, flags of fiber_arena_create
+#define FIBER_ARENA_BASE        0x0     // Base pages, THP explicitly off
+#define FIBER_ARENA_THP         0x1     // madvise(MADV_HUGEPAGE)
+#define FIBER_ARENA_HUGETLB     0x2     // MAP_HUGETLB, needs reserved huge
+                                        // pages, falls back to THP
+
+struct fiber_arena;
+
+// Maps an arena for at least stacks stacks of stack_size bytes, 0 for the
+// size CreateFiber uses. stack_size must be a power of two between 4 KiB
+// and FIBER_ARENA_HUGE_PAGE. Returns NULL with errno set on error.
+struct fiber_arena *fiber_arena_create(long stacks, long stack_size, int flags);
+
+// Takes n contiguous stacks, safe from several threads. Returns the lowest
+// address, stack i starting at it + i * fiber_arena_stack_size(), or NULL
+// when the arena has less than n stacks left.
+void *fiber_arena_alloc(struct fiber_arena *a, long n);
+
+long fiber_arena_stack_size(struct fiber_arena *a);
+
+// FIBER_ARENA_* backing the arena actually got
+int  fiber_arena_backing(struct fiber_arena *a);
+
+// CreateFibers on n stacks of the arena, returns the fid of the first one
+pid_t fiber_arena_create_fibers(struct fiber_arena *a, int n,
+                                void (*user_func)(void*), void **params);
+
+// Unmaps the arena, none of its fibers may run afterwards
+void fiber_arena_destroy(struct fiber_arena *a);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,9 @@
 #pragma once
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void print_test_outcome(int ret, char* test_name);
 
 int FlsAlloc_test_01();
@@ -18,3 +22,38 @@ void Fls_Alloc_Free_Test();
 int flsAllocSetGetFree();
 
 int flsAlloc_Until_err();
+
+int getFiberStats_test_01();
+
+int numaStats_test_01();
+
+int sched_test_01();
+int sched_test_02();
+int sched_test_03();
+
+int perfCounters_test_01();
+
+int runLength_test_01();
+
+int flightRecorder_test_01();
+
+int liveStats_test_01();
+
+int createFibers_test_01();
+
+int fork_test_01();
+
+int arenaStacks_test_01();
+
+int stackHwm_test_01();
+
+int fiberAffinity_test_01();
+
+int fiberPool_test_01();
+
+int cxxFiber_test_01();
+int cxxFlsSlot_test_01();
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,62 +1,174 @@
-
-
 #include "fibers_iface.h"
 
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
 
 
-#define STACK_SIZE 4096*2
+// Stacks are aligned to their size, so that a fiber can find the base of
+// its own stack from any address on it.
+#define STACK_SIZE (4096*2)
+#define PAGE_SIZE  4096
 
-#define log(fmt,...) printf( fmt , ##__VA_ARGS__)
+#ifdef FIBERS_LOG
+# define log(fmt,...) printf( fmt , ##__VA_ARGS__)
+#else
+# define log(fmt,...) do {} while (0)
+#endif
 
 
 // This is the file descriptor needed to issue ioctls,
 // It isn't efficient to reopen it f.e. ioctl and it is 
-// also usefull to hook cleanup functions on its release
-int fd;
+// also usefull to hook cleanup functions on its release.
+// Opened once by the first thread converted to fiber.
+int fibers_fd = -1;
+
+static pthread_once_t fibers_fd_once = PTHREAD_ONCE_INIT;
+
+__thread pid_t fibers_current_fid = -1;
+
+__thread unsigned long fibers_switch_epoch;
+unsigned long fibers_epoch_source;
+
+static void new_switch_epoch(){
+    fibers_switch_epoch = __atomic_add_fetch(&fibers_epoch_source, 1, __ATOMIC_RELAXED);
+}
+
+
+static void open_fibers_fd(){
+    fibers_fd = open("/dev/"DRIVER_NAME, O_RDONLY | O_CLOEXEC);
+    log("[Fibers Interface] opened %s, fd %d.\n","/dev/"DRIVER_NAME,fibers_fd);
+}
 
 int FiberExit(){
     log("Called FiberExit\n");
-    return ioctl(fd, IOCTL_FiberExit, 0);
+    return ioctl(fibers_fd, IOCTL_FiberExit, 0);
+}
+
+// Never inlined: a fiber may have migrated to another thread since its
+// caller last computed the address of the thread-local variable
+__attribute__((noinline)) pid_t GetCurrentFiber(){
+    return fibers_current_fid;
+}
+
+__attribute__((noinline)) void fibers_set_current(pid_t fid){
+    fibers_current_fid = fid;
+    new_switch_epoch();
 }
 
 pid_t ConvertThreadToFiber(){
     int ret;
 
+    pthread_once(&fibers_fd_once, open_fibers_fd);
+    if (fibers_fd == -1) return -1;     // errno set by open
     
-    fd = open("/dev/"DRIVER_NAME,0,O_RDONLY);
-    log("[Fibers Interface] opened %s, fd %d.\n","/dev/"DRIVER_NAME,fd);
-    
-    ret = ioctl(fd,IOCTL_ConvertThreadToFiber,0);
+    ret = ioctl(fibers_fd,IOCTL_ConvertThreadToFiber,0);
     log("[Fibers Interface] ret:%d.\n",ret);
 
     if (ret ==-1 ) log("[Fibers Interface] ConvertThreadToFiber error");
+    else {
+        fibers_current_fid = ret;
+        new_switch_epoch();
+    }
 
     return ret;
 }
 
 
 pid_t CreateFiber(void (*user_function)(void*),  void * param){
+    return CreateFiberOnNode(user_function, param, -1);
+}
+
+// Stacks placed on a node are carved out of chunks mapped for that node
+// alone: the policy is set once per chunk, and the heap is not split into
+// a VMA of its own around every stack.
+#define NODE_CHUNK_STACKS 256
+#define NODE_CHUNK_NODES  (8*(int)sizeof(unsigned long))
+
+struct node_chunk{
+    char *next;     // First free stack
+    char *end;
+};
+
+static struct node_chunk node_chunks[NODE_CHUNK_NODES];
+static pthread_mutex_t node_chunks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *node_stack(int node){
+    struct node_chunk *c = &node_chunks[node];
+    size_t len = (size_t) NODE_CHUNK_STACKS * STACK_SIZE;
+    unsigned long nodemask = 1UL << node;
+    char *p, *base, *stack = NULL;
+
+    pthread_mutex_lock(&node_chunks_lock);
+
+    if (c->next == c->end){
+        p = mmap(NULL, len + STACK_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) goto out;
+
+        // Stacks are aligned to their size, give back the head and tail
+        base = (char *)(((uintptr_t) p + STACK_SIZE - 1) & ~((uintptr_t) STACK_SIZE - 1));
+        if (base > p) munmap(p, base - p);
+        munmap(base + len, (p + len + STACK_SIZE) - (base + len));
+
+        // Best effort: without NUMA support mbind fails and nothing changes
+        if (syscall(SYS_mbind, base, len, MPOL_PREFERRED,
+                    &nodemask, 8*sizeof(nodemask), 0))
+            log("[Fibers Interface] Could not bind stacks to node %d\n", node);
+
+        // Whatever was left of the previous chunk is in use, never unmapped
+        c->next = base;
+        c->end  = base + len;
+    }
+
+    stack = c->next;
+    c->next += STACK_SIZE;
+
+out:
+    pthread_mutex_unlock(&node_chunks_lock);
+    return stack;
+}
+
+pid_t CreateFiberOnNode(void (*user_function)(void*),  void * param, int node){
     
 
     struct fiber_args fargs;   
     fargs.user_fn   = (long) user_function;
     fargs.fn_params = param;
     fargs.stack_size = STACK_SIZE;
+    fargs.node      = node;
+
+    if (node < -1 || node >= NODE_CHUNK_NODES){
+        errno = EINVAL;
+        return -1;
+    }
     
     // @TODO ADD LIST OF MALLOCed MEM AREAS FOR CLEANUP PURPOSES
     // Otherwise processes with a lot of fibers will end up spraying 
     // the heap.
     //
-    // Set stack_base at a 16-memory-aligned address and zero it.
-    if (posix_memalign(&(fargs.stack_base), 16, STACK_SIZE)){
+    // Set stack_base at a STACK_SIZE-aligned address and zero it.
+    if (node >= 0){
+        fargs.stack_base = node_stack(node);
+        if (!fargs.stack_base){
+            log("[Fibers Interface] Could not map stacks on node %d!\n", node);
+            return -1;
+        }
+    } else if (posix_memalign(&(fargs.stack_base), STACK_SIZE, STACK_SIZE)){
         log("[Fibers Interface] Could not get a memory-aligned stack base!\n");
         return -1;
     }
+
+    // Zeroing the stack faults it in on the preferred node
     bzero(fargs.stack_base, STACK_SIZE);
     
     // @TODO handle fiber return with pthread exit
@@ -64,15 +176,13 @@ pid_t CreateFiber(void (*user_function)(void*),  void * param){
     
     
     memcpy((void *) fargs.stack_base+STACK_SIZE-8, &fiberExit_ptr, sizeof(void *));
-    printf("bp=%ld,\tfn=%ld,\tequal?=%d\n", *(unsigned long *)(fargs.stack_base+STACK_SIZE-8), FiberExit, ((unsigned long *) * (unsigned long *)(fargs.stack_base+STACK_SIZE-8))== (unsigned long *)FiberExit);
-    
     
         
     log("[Fibers Interface] CreateFiber ioctl_param %ld, user_fn %ld\n",
            (long unsigned)&fargs,
            fargs.user_fn); 
 
-    int ret = ioctl(fd,IOCTL_CreateFiber, (long unsigned ) &fargs );
+    int ret = ioctl(fibers_fd,IOCTL_CreateFiber, (long unsigned ) &fargs );
     if (ret ==-1 ) log("[Fibers Interface] CreateFiber ioctl error\n");
     else           log("[Fibers Interface] CreateFiber Ok.\n");
     
@@ -80,32 +190,367 @@ pid_t CreateFiber(void (*user_function)(void*),  void * param){
 
 }
 
-pid_t SwitchToFiber(pid_t fiber_id){
-    log("[Fibers Interface] SwitchToFiber %d\n", fiber_id); 
+pid_t CreateFibers(int n, void (*user_func)(void*), void **params,
+                   void *stacks, long stride){
 
-    int ret = ioctl(fd,IOCTL_SwitchToFiber,(long unsigned int)fiber_id);
-    if (ret ==-1 ) log("[Fibers Interface] SwitchToFiber ioctl error\n");
-    else           log("[Fibers Interface] Ok.\n");
+    struct fibers_args bargs;
+    void **zeroes = NULL;
+    void *fiberExit_ptr = (void *) FiberExit;
+    int ret;
+
+    if (n <= 0 || n > FIBERS_BULK_MAX || (stacks && (stride < 64 || stride % 16))){
+        errno = EINVAL;
+        return -1;
+    }
+
+    // One aligned block, every stack keeps the alignment of CreateFiber
+    if (!stacks){
+        stride = STACK_SIZE;
+        if (posix_memalign(&stacks, STACK_SIZE, (size_t) n * STACK_SIZE)){
+            log("[Fibers Interface] Could not allocate %d stacks\n", n);
+            return -1;
+        }
+        bzero(stacks, (size_t) n * STACK_SIZE);
+    }
+
+    if (!params){
+        zeroes = calloc(n, sizeof(void *));
+        if (!zeroes) return -1;
+        params = zeroes;
+    }
+
+    // Fibers returning from user_func land in FiberExit
+    for (int i = 0; i < n; i++)
+        memcpy((char *) stacks + (long) i*stride + stride-8, &fiberExit_ptr, sizeof(void *));
+
+    bargs.user_fn      = (long) user_func;
+    bargs.fn_params    = params;
+    bargs.stack_region = stacks;
+    bargs.stack_stride = stride;
+    bargs.stack_size   = stride;
+    bargs.count        = n;
+    bargs.node         = -1;
+
+    ret = ioctl(fibers_fd, IOCTL_CreateFibers, (long unsigned) &bargs);
+    if (ret ==-1 ) log("[Fibers Interface] CreateFibers ioctl error\n");
+    else           log("[Fibers Interface] CreateFibers Ok, fids %d to %d.\n", ret, ret + n - 1);
+
+    free(zeroes);
     return ret;
 }
 
+int SetPreemption(unsigned long long slice_ns, pid_t sched_fid, int *critical){
+
+    struct preempt_args pargs;
+
+    pargs.slice_ns  = slice_ns;
+    pargs.sched_fid = sched_fid;
+    pargs.critical  = critical;
+
+    int ret = ioctl(fibers_fd, IOCTL_SetPreemption, (long unsigned) &pargs);
+
+    if (ret ==-1 ) log("[Fibers Interface] SetPreemption ioctl error\n");
+    else           log("[Fibers Interface] Time slice %llu ns, scheduler fiber %d\n", slice_ns, sched_fid);
+
+    return ret;
+}
+
+int EnablePerfCounters(unsigned int flags){
+
+    int ret = ioctl(fibers_fd, IOCTL_EnablePerfCounters, (long unsigned) flags);
+
+    if (ret ==-1 ) log("[Fibers Interface] EnablePerfCounters ioctl error\n");
+    else           log("[Fibers Interface] Perf counters %x enabled\n", flags);
+
+    return ret;
+}
+
+int SetFiberAffinity(pid_t fid, size_t size, const void *mask){
+
+    struct fiber_affinity_args args;
+    int ret;
+
+    args.fid  = fid;
+    args.size = (int) size;
+    args.mask = (unsigned long *) mask;
+
+    ret = ioctl(fibers_fd, IOCTL_SetFiberAffinity, &args);
+
+    if (ret ==-1 ) log("[Fibers Interface] SetFiberAffinity ioctl error\n");
+    else           log("[Fibers Interface] Affinity of fiber %d set\n", fid);
+
+    return ret;
+}
+
+int GetFiberLastCpu(pid_t fid){
+    return ioctl(fibers_fd, IOCTL_GetFiberLastCpu, (long unsigned) fid);
+}
+
+int EnableFlightRecorder(unsigned long events){
+
+    int ret = ioctl(fibers_fd, IOCTL_EnableFlightRecorder, events);
+
+    if (ret ==-1 ) log("[Fibers Interface] EnableFlightRecorder ioctl error\n");
+    else           log("[Fibers Interface] Flight recorder on\n");
+
+    return ret;
+}
+
+// Image taken for the fork in progress by this thread, -1 if none
+static __thread long fork_seq = -1;
+
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+static void fork_prepare(){
+    fork_seq = -1;
+    if (fibers_fd == -1 || fibers_current_fid == -1) return;
+
+    fork_seq = ioctl(fibers_fd, IOCTL_ForkPrepare, 0);
+    if (fork_seq == -1) log("[Fibers Interface] ForkPrepare ioctl error\n");
+}
+
+// The child gets a file of its own in place of the one it shares with the
+// parent, then adopts the image
+static void fork_child(){
+    int fd;
+
+    if (fork_seq == -1) return;
+
+    fd = open("/dev/"DRIVER_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return;
+    dup2(fd, fibers_fd);
+    fcntl(fibers_fd, F_SETFD, FD_CLOEXEC);
+    close(fd);
+
+    if (ioctl(fibers_fd, IOCTL_ForkChild, fork_seq) == -1)
+        log("[Fibers Interface] ForkChild ioctl error\n");
+}
+
+static void register_fork_handlers(){
+    pthread_atfork(fork_prepare, NULL, fork_child);
+}
+
+int EnableFork(){
+    return pthread_once(&fork_once, register_fork_handlers) ? -1 : 0;
+}
+
+static size_t recorder_size(unsigned int capacity){
+    size_t size = sizeof(struct fiber_recorder) + capacity * sizeof(struct fiber_event);
+    long page = sysconf(_SC_PAGESIZE);
+
+    return (size + page - 1) / page * page;
+}
+
+struct fiber_recorder *OpenFlightRecorder(pid_t tgid){
+
+    struct fiber_recorder *r;
+    unsigned int capacity;
+    off_t offset;
+
+    pthread_once(&fibers_fd_once, open_fibers_fd);
+    if (fibers_fd == -1) return NULL;
+
+    // Map the header to learn the size of the ring, then all of it
+    offset = FIBERS_MMAP_PGOFF(tgid, FIBERS_MMAP_RECORDER) * sysconf(_SC_PAGESIZE);
+
+    r = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fibers_fd, offset);
+    if (r == MAP_FAILED) return NULL;
+    capacity = r->capacity;
+    munmap(r, sysconf(_SC_PAGESIZE));
+
+    r = mmap(NULL, recorder_size(capacity), PROT_READ, MAP_SHARED, fibers_fd, offset);
+    if (r == MAP_FAILED) return NULL;
+
+    return r;
+}
+
+void CloseFlightRecorder(struct fiber_recorder *r){
+    munmap(r, recorder_size(r->capacity));
+}
+
+long ReadFlightRecorder(struct fiber_recorder *r, unsigned long long *cursor,
+                        struct fiber_event *out, long n,
+                        unsigned long long *lost){
+
+    unsigned long long head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+    unsigned long long i, seq;
+    struct fiber_event *e;
+    long count = 0;
+
+    // Older events have been overwritten
+    if (head - *cursor > r->capacity){
+        if (lost) *lost += head - r->capacity - *cursor;
+        *cursor = head - r->capacity;
+    }
+
+    for (i = *cursor; i < head && count < n; i++){
+        e = &(r->events[i & (r->capacity - 1)]);
+
+        seq = __atomic_load_n(&(e->seq), __ATOMIC_ACQUIRE);
+
+        // Already overwritten by a later lap
+        if (seq > i + 1){
+            if (lost) (*lost)++;
+            continue;
+        }
+
+        // Claimed but not written yet, left to the next call
+        if (seq != i + 1) break;
+
+        out[count] = *e;
+
+        // Overwritten while being copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(e->seq), __ATOMIC_RELAXED) != i + 1){
+            if (lost) (*lost)++;
+            continue;
+        }
+
+        count++;
+    }
+
+    *cursor = i;
+    return count;
+}
+
+const struct fiber_live_stats *OpenLiveStats(pid_t tgid){
+
+    void *s;
+
+    pthread_once(&fibers_fd_once, open_fibers_fd);
+    if (fibers_fd == -1) return NULL;
+
+    s = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fibers_fd,
+             FIBERS_MMAP_PGOFF(tgid, FIBERS_MMAP_STATS) * sysconf(_SC_PAGESIZE));
+
+    return s == MAP_FAILED ? NULL : s;
+}
+
+void CloseLiveStats(const struct fiber_live_stats *s){
+    munmap((void *) s, sysconf(_SC_PAGESIZE));
+}
+
+void ReadLiveStats(const struct fiber_live_stats *s, struct fiber_live_stats *out){
+
+    unsigned int seq;
+
+    do {
+        // Odd while the module is updating the page
+        while ((seq = __atomic_load_n(&(s->seq), __ATOMIC_ACQUIRE)) & 1)
+            __builtin_ia32_pause();
+
+        *out = *s;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&(s->seq), __ATOMIC_RELAXED) != seq);
+}
+
+// Pages handed to each move_pages call
+#define MIGRATE_BATCH 64
+
+void fibers_migrate_stack(){
+    struct fiber_stack_args stack;
+    void *pages[MIGRATE_BATCH];
+    int nodes[MIGRATE_BATCH];
+    int status[MIGRATE_BATCH];
+    unsigned cpu, node;
+    char *base, *end;
+    long n;
+
+    // Stacks come from CreateFiber, CreateFibers, arenas or callers of
+    // their own, only the module knows where this one lies
+    if (ioctl(fibers_fd, IOCTL_GetFiberStack, (unsigned long) &stack) == -1 ||
+        !stack.stack_base)
+        return;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL)) return;
+
+    base = (char *)((uintptr_t) stack.stack_base & ~((uintptr_t) PAGE_SIZE - 1));
+    end  = (char *) stack.stack_base + stack.stack_size;
+
+    while (base < end){
+        for (n = 0; n < MIGRATE_BATCH && base < end; n++, base += PAGE_SIZE){
+            pages[n] = base;
+            nodes[n] = node;
+        }
+
+        // Pages shared with other allocations stay where they are
+        if (syscall(SYS_move_pages, 0, n, pages, nodes, status, MPOL_MF_MOVE)){
+            log("[Fibers Interface] Could not move stack %p to node %u\n", stack.stack_base, node);
+            return;
+        }
+    }
+
+    log("[Fibers Interface] Moved stack %p (%ld bytes) to node %u\n", stack.stack_base, stack.stack_size, node);
+}
+
+long GetFiberStats(struct fiber_stats *buf, long capacity, int fid_from,
+                   int fid_to, unsigned long long since_generation,
+                   unsigned long long *generation){
+    return GetProcessFiberStats(0, buf, capacity, fid_from, fid_to,
+                                since_generation, generation);
+}
+
+long GetProcessFiberStats(pid_t tgid, struct fiber_stats *buf, long capacity,
+                          int fid_from, int fid_to,
+                          unsigned long long since_generation,
+                          unsigned long long *generation){
+
+    struct fiber_stats_args sargs;
+
+    pthread_once(&fibers_fd_once, open_fibers_fd);
+    if (fibers_fd == -1) return -1;
+
+    sargs.buf              = buf;
+    sargs.entry_size       = sizeof(struct fiber_stats);
+    sargs.capacity         = capacity;
+    sargs.fid_from         = fid_from;
+    sargs.fid_to           = fid_to;
+    sargs.tgid             = tgid;
+    sargs.reserved         = 0;
+    sargs.since_generation = since_generation;
+
+    long ret = ioctl(fibers_fd, IOCTL_GetFiberStats, (long unsigned) &sargs);
+
+    if (ret ==-1 ) log("[Fibers Interface] GetFiberStats ioctl error\n");
+    else if (generation) *generation = sargs.generation;
 
-/* ORIGINAL FUNCTION
-long FlsAlloc(){
-    log("[Fibers Interface] FlsAlloc\n");
-    
-    long ret = ioctl(fd, IOCTL_FlsAlloc, 0);
-    
-    if (ret ==-1 ) log("[Fibers Interface] FlsAlloc ioctl\n");
-    else           log("[Fibers Interface] Ok.\n");
-    
     return ret;
 }
-*/
+
+
+// Out-of-line, logging versions of the hot calls. The default build uses
+// the inline wrappers in fibers_iface.h instead.
+#ifdef FIBERS_LOG
+
+pid_t SwitchToFiber(pid_t fiber_id){
+    pid_t prev = fibers_current_fid;
+
+    log("[Fibers Interface] SwitchToFiber %d\n", fiber_id); 
+
+    fibers_current_fid = fiber_id;
+    new_switch_epoch();
+    int ret = ioctl(fibers_fd,IOCTL_SwitchToFiber,(long unsigned int)fiber_id);
+    if (ret ==-1 ){
+        fibers_current_fid = prev;
+        log("[Fibers Interface] SwitchToFiber ioctl error\n");
+        return ret;
+    }
+    else           log("[Fibers Interface] Ok.\n");
+
+    if (ret == FIBER_SWITCH_MIGRATE)   fibers_migrate_stack();
+    if (ret == FIBER_SWITCH_PREEMPTED){
+        fibers_set_current(prev);
+        log("[Fibers Interface] Fiber %d was preempted\n", fiber_id);
+    }
+
+    return 0;
+}
+
 
 long FlsAlloc(){
     
-    long ret = ioctl(fd, IOCTL_FlsAlloc, 0);
+    long ret = ioctl(fibers_fd, IOCTL_FlsAlloc, 0);
     
     if (ret ==-1 ) log("[Fibers Interface] FlsAlloc ioctl error\n");
     
@@ -115,7 +560,7 @@ long FlsAlloc(){
 int FlsFree(long index){
     log("[Fibers Interface] FlsFree %ld\n", index);
     
-    int ret = ioctl(fd, IOCTL_FlsFree, index);
+    int ret = ioctl(fibers_fd, IOCTL_FlsFree, index);
     
     if (ret ==-1 ) log("[Fibers Interface] FlsFree ioctl error\n");
     else           log("[Fibers Interface] Ok.\n");
@@ -131,7 +576,7 @@ long long FlsGetValue(long index){
     flsargs.value = index;
     
     // TODO Add wrapper for index,_user ret address
-    long ret = ioctl(fd, IOCTL_FlsGetValue,(long long unsigned) &flsargs);
+    long ret = ioctl(fibers_fd, IOCTL_FlsGetValue,(long long unsigned) &flsargs);
     
     
     if (ret ==-1 ){
@@ -153,10 +598,12 @@ int FlsSetValue(long index, long long value){
     flsargs.index = index;
     flsargs.value = value;
     
-    int ret = ioctl(fd, IOCTL_FlsSetValue, (long long unsigned) &flsargs );
+    int ret = ioctl(fibers_fd, IOCTL_FlsSetValue, (long long unsigned) &flsargs );
     
     if (ret ==-1 ) log("[Fibers Interface] FlsSetValue ioctl error\n");
     else           log("[Fibers Interface] Ok.\n");
     
     return ret;
 }
+
+#endif
@@ -0,0 +1,399 @@
+#include "fibers_pool.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+
+// What a worker fiber asks its runner to do with it after switching back
+#define ACTION_IDLE     0
+#define ACTION_YIELD    1
+
+struct pool_task{
+
+    void (*fn)(void*);
+    void *param;
+};
+
+struct pool_fiber{
+
+    pid_t fid;
+    struct fiber_pool *p;
+
+    pid_t runner;               // Runner that last switched to it
+    int   action;
+
+    struct pool_fiber *next;    // Idle stack or yielded FIFO
+    struct pool_fiber *all;     // Every fiber of the pool
+};
+
+struct fiber_pool{
+
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       // Signalled on submit and on stop
+
+    long min_fibers;
+    long max_fibers;            // 0 if unbounded
+    long grow;
+    long creating;              // Fibers being created, lock released
+    int  full;                  // Creating a fiber failed, no more growth
+    int  stopping;
+
+    // Ring of queued tasks, cap is a power of two
+    struct pool_task *queue;
+    long head;
+    long cap;
+
+    // Idle fibers are reused last parked first, its stack is the warmest
+    struct pool_fiber *idle;
+    struct pool_fiber *yielded_head;
+    struct pool_fiber *yielded_tail;
+    struct pool_fiber *all;
+
+    // run_ns of the runners that returned, start times of the others
+    unsigned long long run_ns_done;
+    unsigned long long run_started;
+
+    struct fiber_pool_stats stats;
+};
+
+// State of the pool loop running on a thread
+struct pool_runner{
+
+    struct fiber_pool *p;
+    pid_t              fid;
+
+    struct pool_fiber *current;
+};
+
+static __thread struct pool_runner *current_runner;
+
+
+static unsigned long long now_ns(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Never inlined: worker fibers move between threads, see fibers_iface.h
+__attribute__((noinline)) static struct pool_runner *get_current_runner(){
+    return current_runner;
+}
+
+
+// Queue and fiber lists, called with the lock held
+
+static int push_task(struct fiber_pool *p, void (*fn)(void*), void *param){
+    struct pool_task *queue;
+    long len = p->stats.queue_len, cap;
+
+    if (len == p->cap){
+        cap = p->cap ? p->cap*2 : 64;
+        queue = realloc(p->queue, cap * sizeof(*queue));
+        if (!queue) return -1;
+
+        // Unwrap the tasks that were past the end of the old ring
+        if (p->head + len > p->cap)
+            memcpy(queue + p->cap, queue, (p->head + len - p->cap) * sizeof(*queue));
+
+        p->queue = queue;
+        p->cap = cap;
+    }
+
+    p->queue[(p->head + len) & (p->cap - 1)] = (struct pool_task){ fn, param };
+    p->stats.queue_len++;
+    if (p->stats.queue_len > p->stats.queue_max) p->stats.queue_max = p->stats.queue_len;
+
+    return 0;
+}
+
+static int pop_task(struct fiber_pool *p, struct pool_task *t){
+    if (!p->stats.queue_len) return 0;
+
+    *t = p->queue[p->head];
+    p->head = (p->head + 1) & (p->cap - 1);
+    p->stats.queue_len--;
+
+    return 1;
+}
+
+static void push_idle(struct fiber_pool *p, struct pool_fiber *f){
+    f->next = p->idle;
+    p->idle = f;
+    p->stats.idle++;
+}
+
+static struct pool_fiber *pop_idle(struct fiber_pool *p){
+    struct pool_fiber *f = p->idle;
+
+    if (f){
+        p->idle = f->next;
+        p->stats.idle--;
+    }
+    return f;
+}
+
+static void push_yielded(struct fiber_pool *p, struct pool_fiber *f){
+    f->next = NULL;
+    if (p->yielded_tail) p->yielded_tail->next = f;
+    else                 p->yielded_head = f;
+    p->yielded_tail = f;
+    p->stats.yielded++;
+}
+
+static struct pool_fiber *pop_yielded(struct fiber_pool *p){
+    struct pool_fiber *f = p->yielded_head;
+
+    if (f){
+        p->yielded_head = f->next;
+        if (!p->yielded_head) p->yielded_tail = NULL;
+        p->stats.yielded--;
+    }
+    return f;
+}
+
+static int can_grow(struct fiber_pool *p){
+    if (p->full) return 0;
+    return !p->max_fibers || p->stats.fibers + p->creating < p->max_fibers;
+}
+
+
+// Runs tasks while there are any, parks in between
+static void pool_fiber_main(void *param){
+    struct pool_fiber *f = param;
+    struct fiber_pool *p = f->p;
+    struct pool_task t;
+
+    pthread_mutex_lock(&(p->lock));
+
+    for (;;){
+        if (p->stopping || !pop_task(p, &t)){
+            f->action = ACTION_IDLE;
+            pthread_mutex_unlock(&(p->lock));
+
+            // Resumed by whichever runner picks it up next
+            SwitchToFiber(f->runner);
+
+            pthread_mutex_lock(&(p->lock));
+            continue;
+        }
+
+        pthread_mutex_unlock(&(p->lock));
+        t.fn(t.param);
+        pthread_mutex_lock(&(p->lock));
+
+        p->stats.completed++;
+    }
+}
+
+// Creates up to n worker fibers and parks them, called with the lock held,
+// which is released meanwhile. Returns the number of fibers created. If
+// none could be, the pool stays at the size it has.
+static long add_fibers(struct fiber_pool *p, long n){
+    struct pool_fiber *created = NULL, *f;
+    long i;
+
+    if (p->max_fibers && n > p->max_fibers - p->stats.fibers - p->creating)
+        n = p->max_fibers - p->stats.fibers - p->creating;
+
+    p->creating += n;
+    pthread_mutex_unlock(&(p->lock));
+
+    for (i = 0; i < n; i++){
+        f = calloc(1, sizeof(struct pool_fiber));
+        if (!f) break;
+
+        f->p = p;
+        f->fid = CreateFiber(pool_fiber_main, f);
+        if (f->fid == -1){
+            free(f);
+            break;
+        }
+
+        f->all = created;
+        created = f;
+    }
+
+    pthread_mutex_lock(&(p->lock));
+    p->creating -= n;
+
+    while ((f = created)){
+        created = f->all;
+        f->all = p->all;
+        p->all = f;
+        push_idle(p, f);
+        p->stats.fibers++;
+    }
+
+    if (!i) p->full = 1;
+
+    return i;
+}
+
+
+struct fiber_pool *fiber_pool_create(long min_fibers, long max_fibers, long grow){
+    struct fiber_pool *p;
+
+    if (min_fibers < 0 || max_fibers < 0 || grow < 0 || (max_fibers && min_fibers > max_fibers)){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(struct fiber_pool));
+    if (!p) return NULL;
+
+    pthread_mutex_init(&(p->lock), NULL);
+    pthread_cond_init(&(p->work), NULL);
+    p->min_fibers = min_fibers;
+    p->max_fibers = max_fibers;
+    p->grow       = grow ? grow : 1;
+
+    return p;
+}
+
+void fiber_pool_destroy(struct fiber_pool *p){
+    struct pool_fiber *f;
+
+    while ((f = p->all)){
+        p->all = f->all;
+        free(f);
+    }
+    free(p->queue);
+    pthread_cond_destroy(&(p->work));
+    pthread_mutex_destroy(&(p->lock));
+    free(p);
+}
+
+int fiber_pool_submit(struct fiber_pool *p, void (*fn)(void*), void *param){
+    int ret;
+
+    pthread_mutex_lock(&(p->lock));
+
+    ret = push_task(p, fn, param);
+    if (ret){
+        errno = ENOMEM;
+    } else {
+        p->stats.submitted++;
+        pthread_cond_signal(&(p->work));
+    }
+
+    pthread_mutex_unlock(&(p->lock));
+    return ret;
+}
+
+int fiber_pool_run(struct fiber_pool *p){
+    struct pool_runner r;
+    struct pool_fiber *f;
+    unsigned long long start, t0;
+    long missing;
+    int ret = 0;
+
+    r.p       = p;
+    r.fid     = GetCurrentFiber();
+    r.current = NULL;
+
+    if (r.fid == -1){
+        errno = EINVAL;
+        return -1;
+    }
+    current_runner = &r;
+
+    start = now_ns();
+
+    pthread_mutex_lock(&(p->lock));
+
+    p->stats.runners++;
+    p->run_started += start;
+
+    while (!p->stopping){
+
+        missing = p->min_fibers - p->stats.fibers - p->creating;
+        if (missing > 0 && !p->full){
+            if (!add_fibers(p, missing) && !p->stats.fibers && !p->creating){
+                ret = -1;   // errno set by CreateFiber
+                break;
+            }
+            continue;
+        }
+
+        // New tasks first, yielded ones wait for the queue to empty or
+        // for the pool to be full
+        f = NULL;
+        if (p->stats.queue_len){
+            if (!p->idle && can_grow(p) && add_fibers(p, p->grow)) continue;
+            f = pop_idle(p);
+        }
+        if (!f) f = pop_yielded(p);
+
+        if (!f){
+            pthread_cond_wait(&(p->work), &(p->lock));
+            continue;
+        }
+
+        f->runner = r.fid;
+        f->action = ACTION_YIELD;       // If f switches back on its own
+        r.current = f;
+        p->stats.dispatches++;
+
+        pthread_mutex_unlock(&(p->lock));
+
+        // Parked fibers have already been saved by the module, this only
+        // fails if someone switched to f behind our back: retry it later
+        t0 = now_ns();
+        SwitchToFiber(f->fid);
+        t0 = now_ns() - t0;
+
+        pthread_mutex_lock(&(p->lock));
+
+        p->stats.busy_ns += t0;
+        r.current = NULL;
+
+        if (f->action == ACTION_IDLE) push_idle(p, f);
+        else                          push_yielded(p, f);
+    }
+
+    // The last runner out lets the pool run again
+    if (--p->stats.runners == 0) p->stopping = 0;
+    p->run_started -= start;
+    p->run_ns_done += now_ns() - start;
+
+    pthread_mutex_unlock(&(p->lock));
+
+    current_runner = NULL;
+    return ret;
+}
+
+void fiber_pool_stop(struct fiber_pool *p){
+    pthread_mutex_lock(&(p->lock));
+    p->stopping = 1;
+    pthread_cond_broadcast(&(p->work));
+    pthread_mutex_unlock(&(p->lock));
+}
+
+int fiber_pool_yield(struct fiber_pool *p){
+    struct pool_runner *r = get_current_runner();
+
+    if (!r || r->p != p || !r->current || r->current->fid != GetCurrentFiber()){
+        errno = EINVAL;     // Not a task run by this pool
+        return -1;
+    }
+
+    // r belongs to the previous thread once this returns
+    r->current->action = ACTION_YIELD;
+    return SwitchToFiber(r->fid);
+}
+
+int fiber_pool_get_stats(struct fiber_pool *p, struct fiber_pool_stats *out){
+    unsigned long long now = now_ns();
+
+    pthread_mutex_lock(&(p->lock));
+
+    *out = p->stats;
+    out->run_ns = p->run_ns_done + p->stats.runners * now - p->run_started;
+    out->utilization = out->run_ns ? (double) out->busy_ns / out->run_ns : 0.0;
+
+    pthread_mutex_unlock(&(p->lock));
+    return 0;
+}
@@ -0,0 +1,589 @@
+#include "fibers_sched.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+
+#define WAIT_BUCKETS 256
+
+// What a fiber asks its worker to do with it after switching back
+#define ACTION_REQUEUE  0
+#define ACTION_PARK     1
+#define ACTION_DONE     2
+
+#define STATE_QUEUED    0
+#define STATE_RUNNING   1
+#define STATE_PARKED    2
+
+struct sched_entity{
+
+    pid_t fid;
+    int   cls;
+    int   state;
+    int   wake_pending;         // Woken while running or parking
+
+    unsigned long long deadline;
+    unsigned long long enqueued_at;
+
+    struct sched_entity *prev;  // FIFO classes
+    struct sched_entity *next;
+    long heap_idx;              // EDF class
+
+    void (*fn)(void*);
+    void *param;
+};
+
+struct sched_class{
+
+    // Only one of the two is used, depending on the class
+    struct sched_entity  *head;
+    struct sched_entity  *tail;
+    struct sched_entity **heap;
+    long heap_cap;
+
+    struct fiber_sched_class_stats stats;
+    unsigned long long wait_hist[WAIT_BUCKETS];
+};
+
+struct fiber_sched{
+
+    pthread_mutex_t lock;
+    pthread_cond_t  runnable;   // Signalled on enqueue and on termination
+
+    unsigned long long aging_ns;
+    unsigned long long slice_ns;    // 0 if fibers are never preempted
+    int workers;
+    int stopping;
+    long live;                  // Spawned fibers that did not return yet
+
+    struct sched_class classes[FIBER_SCHED_CLASSES];
+
+    struct sched_entity **by_fid;
+    long by_fid_len;
+};
+
+// State of the scheduler loop running on a thread
+struct sched_worker{
+
+    struct fiber_sched  *s;
+    pid_t                sched_fid;
+
+    struct sched_entity *current;
+    int                  action;
+};
+
+static __thread struct sched_worker *current_worker;
+
+// Not 0 while the thread holds the scheduler lock, the module does not
+// preempt a fiber in that state. No switch happens in between, so the
+// thread-local is safe to use here.
+static __thread int sched_critical;
+
+static void sched_lock(struct fiber_sched *s){
+    sched_critical++;
+    pthread_mutex_lock(&(s->lock));
+}
+
+static void sched_unlock(struct fiber_sched *s){
+    pthread_mutex_unlock(&(s->lock));
+    sched_critical--;
+}
+
+
+unsigned long long fiber_sched_now(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Never inlined: scheduled fibers move between threads, see fibers_iface.h
+__attribute__((noinline)) static struct sched_worker *get_current_worker(){
+    return current_worker;
+}
+
+
+// Wait-time histogram, 4 linear sub-buckets per power of two
+
+static int wait_bucket(unsigned long long ns){
+    int msb;
+
+    if (ns < 4) return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb-1)*4 + ((ns >> (msb-2)) & 3);
+}
+
+static unsigned long long wait_bucket_limit(int b){
+    int msb;
+
+    if (b < 4) return b;
+    msb = b/4 + 1;
+    return ((4ULL + b%4 + 1) << (msb-2)) - 1;
+}
+
+static unsigned long long wait_percentile(struct sched_class *c, double p){
+    unsigned long long n = c->stats.dispatched;
+    unsigned long long seen = 0, rank;
+
+    if (!n) return 0;
+    rank = (unsigned long long)(p * n);
+    if (rank >= n) rank = n-1;
+
+    for (int b = 0; b < WAIT_BUCKETS; b++){
+        seen += c->wait_hist[b];
+        if (seen > rank) return wait_bucket_limit(b);
+    }
+    return c->stats.wait_ns_max;
+}
+
+
+// EDF heap, ordered by deadline
+
+static void heap_swap(struct sched_entity **heap, long a, long b){
+    struct sched_entity *tmp = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    heap[a]->heap_idx = a;
+    heap[b]->heap_idx = b;
+}
+
+static void heap_up(struct sched_entity **heap, long i){
+    while (i > 0 && heap[(i-1)/2]->deadline > heap[i]->deadline){
+        heap_swap(heap, i, (i-1)/2);
+        i = (i-1)/2;
+    }
+}
+
+static void heap_down(struct sched_entity **heap, long len, long i){
+    long min;
+
+    for (;;){
+        min = i;
+        if (2*i+1 < len && heap[2*i+1]->deadline < heap[min]->deadline) min = 2*i+1;
+        if (2*i+2 < len && heap[2*i+2]->deadline < heap[min]->deadline) min = 2*i+2;
+        if (min == i) return;
+        heap_swap(heap, i, min);
+        i = min;
+    }
+}
+
+
+// Queues, called with the lock held
+
+static int enqueue(struct fiber_sched *s, struct sched_entity *e, int new_wait){
+    struct sched_class *c = &(s->classes[e->cls]);
+    struct sched_entity **heap;
+
+    if (e->cls == FIBER_SCHED_EDF){
+        if (c->stats.queue_len == c->heap_cap){
+            heap = realloc(c->heap, (c->heap_cap*2 + 16) * sizeof(*heap));
+            if (!heap) return -1;
+            c->heap = heap;
+            c->heap_cap = c->heap_cap*2 + 16;
+        }
+        e->heap_idx = c->stats.queue_len;
+        c->heap[e->heap_idx] = e;
+        heap_up(c->heap, e->heap_idx);
+    } else {
+        e->next = NULL;
+        e->prev = c->tail;
+        if (c->tail) c->tail->next = e;
+        else         c->head = e;
+        c->tail = e;
+    }
+
+    c->stats.queue_len++;
+    e->state = STATE_QUEUED;
+    if (new_wait){
+        c->stats.enqueued++;
+        e->enqueued_at = fiber_sched_now();
+    }
+
+    pthread_cond_signal(&(s->runnable));
+    return 0;
+}
+
+static void dequeue(struct fiber_sched *s, struct sched_entity *e){
+    struct sched_class *c = &(s->classes[e->cls]);
+    long i = e->heap_idx, last = c->stats.queue_len - 1;
+
+    if (e->cls == FIBER_SCHED_EDF){
+        // Move the last entry into the hole and restore the heap order
+        if (i != last){
+            c->heap[i] = c->heap[last];
+            c->heap[i]->heap_idx = i;
+            heap_down(c->heap, last, i);
+            heap_up(c->heap, i);
+        }
+    } else {
+        if (e->prev) e->prev->next = e->next;
+        else         c->head = e->next;
+        if (e->next) e->next->prev = e->prev;
+        else         c->tail = e->prev;
+    }
+
+    c->stats.queue_len--;
+}
+
+// Picks the most urgent fiber. The head of each priority class is the
+// fiber that waited longest in it, aging promotes it by one class per
+// aging_ns waited. An aged fiber that reaches the EDF class competes with
+// a deadline equal to the time of its promotion.
+static struct sched_entity *pick_next(struct fiber_sched *s, unsigned long long now){
+    struct sched_entity *best = NULL, *e;
+    unsigned long long best_key = 0, key, steps;
+    int best_eff = FIBER_SCHED_CLASSES, eff;
+
+    if (s->classes[FIBER_SCHED_EDF].stats.queue_len){
+        best = s->classes[FIBER_SCHED_EDF].heap[0];
+        best_eff = FIBER_SCHED_EDF;
+        best_key = best->deadline;
+    }
+
+    for (int cls = FIBER_SCHED_EDF+1; cls < FIBER_SCHED_CLASSES; cls++){
+        e = s->classes[cls].head;
+        if (!e) continue;
+
+        eff = cls;
+        key = e->enqueued_at;
+        if (s->aging_ns && now > e->enqueued_at){
+            steps = (now - e->enqueued_at) / s->aging_ns;
+            if (steps >= (unsigned long long) cls){
+                eff = FIBER_SCHED_EDF;
+                key = e->enqueued_at + cls * s->aging_ns;
+            } else {
+                eff = cls - steps;
+            }
+        }
+
+        // Without aging classes are strict, and the first one wins
+        if (eff < best_eff || (eff == best_eff && key < best_key)){
+            best = e;
+            best_eff = eff;
+            best_key = key;
+        }
+    }
+
+    if (!best) return NULL;
+
+    dequeue(s, best);
+
+    struct sched_class *c = &(s->classes[best->cls]);
+    unsigned long long wait = now > best->enqueued_at ? now - best->enqueued_at : 0;
+
+    c->stats.dispatched++;
+    if (best_eff < best->cls) c->stats.aged++;
+    if (best->cls == FIBER_SCHED_EDF && now > best->deadline) c->stats.missed_deadlines++;
+    c->stats.wait_ns_total += wait;
+    if (wait > c->stats.wait_ns_max) c->stats.wait_ns_max = wait;
+    c->wait_hist[wait_bucket(wait)]++;
+
+    best->state = STATE_RUNNING;
+    return best;
+}
+
+static struct sched_entity *get_entity(struct fiber_sched *s, pid_t fid){
+    if (fid < 0 || fid >= s->by_fid_len) return NULL;
+    return s->by_fid[fid];
+}
+
+
+struct fiber_sched *fiber_sched_create(unsigned long long aging_ns){
+    struct fiber_sched *s = calloc(1, sizeof(struct fiber_sched));
+
+    if (!s) return NULL;
+
+    pthread_mutex_init(&(s->lock), NULL);
+    pthread_cond_init(&(s->runnable), NULL);
+    s->aging_ns = aging_ns;
+
+    return s;
+}
+
+void fiber_sched_destroy(struct fiber_sched *s){
+    for (long i = 0; i < s->by_fid_len; i++) free(s->by_fid[i]);
+    free(s->by_fid);
+    free(s->classes[FIBER_SCHED_EDF].heap);
+    pthread_cond_destroy(&(s->runnable));
+    pthread_mutex_destroy(&(s->lock));
+    free(s);
+}
+
+
+// Switches to the scheduler of the current thread, which carries out action
+static int switch_out(int action){
+    struct sched_worker *w;
+
+    // Not preempted from here on, the worker resets the counter
+    sched_critical++;
+
+    w = get_current_worker();
+    if (!w || w->current == NULL || w->current->fid != GetCurrentFiber()){
+        sched_critical--;
+        errno = EINVAL;     // Not a fiber run by a scheduler
+        return -1;
+    }
+
+    w->action = action;
+    // w belongs to the previous thread once this returns
+    return SwitchToFiber(w->sched_fid);
+}
+
+static void sched_trampoline(void *param){
+    struct sched_entity *e = param;
+
+    e->fn(e->param);
+
+    // The scheduler drops the fiber, which is never resumed
+    switch_out(ACTION_DONE);
+}
+
+pid_t fiber_sched_spawn(struct fiber_sched *s, void (*fn)(void*), void *param,
+                        int cls, unsigned long long deadline){
+    struct sched_entity *e, **by_fid;
+    long len;
+    pid_t fid;
+
+    if (cls < 0 || cls >= FIBER_SCHED_CLASSES){
+        errno = EINVAL;
+        return -1;
+    }
+
+    e = calloc(1, sizeof(struct sched_entity));
+    if (!e) return -1;
+
+    e->fn       = fn;
+    e->param    = param;
+    e->cls      = cls;
+    e->deadline = deadline;
+
+    fid = CreateFiber(sched_trampoline, e);
+    if (fid == -1){
+        free(e);
+        return -1;
+    }
+    e->fid = fid;
+
+    sched_lock(s);
+
+    if (fid >= s->by_fid_len){
+        len = s->by_fid_len*2 > fid ? s->by_fid_len*2 : fid + 64;
+        by_fid = realloc(s->by_fid, len * sizeof(*by_fid));
+        if (!by_fid) goto error;
+        memset(by_fid + s->by_fid_len, 0, (len - s->by_fid_len) * sizeof(*by_fid));
+        s->by_fid = by_fid;
+        s->by_fid_len = len;
+    }
+
+    if (enqueue(s, e, 1)) goto error;
+    s->by_fid[fid] = e;
+    s->live++;
+
+    sched_unlock(s);
+    return fid;
+
+error:
+    // The fiber stays in the module, but it is never scheduled
+    sched_unlock(s);
+    free(e);
+    errno = ENOMEM;
+    return -1;
+}
+
+int fiber_sched_set_priority(struct fiber_sched *s, pid_t fid, int cls){
+    struct sched_entity *e;
+    int ret = 0;
+
+    if (cls < 0 || cls >= FIBER_SCHED_CLASSES){
+        errno = EINVAL;
+        return -1;
+    }
+
+    sched_lock(s);
+
+    e = get_entity(s, fid);
+    if (!e){
+        errno = ESRCH;
+        ret = -1;
+    } else if (e->state == STATE_QUEUED){
+        dequeue(s, e);
+        e->cls = cls;
+        ret = enqueue(s, e, 0);
+    } else {
+        e->cls = cls;
+    }
+
+    sched_unlock(s);
+    return ret;
+}
+
+int fiber_sched_set_deadline(struct fiber_sched *s, pid_t fid,
+                             unsigned long long deadline){
+    struct sched_class *c = &(s->classes[FIBER_SCHED_EDF]);
+    struct sched_entity *e;
+    int ret = 0;
+
+    sched_lock(s);
+
+    e = get_entity(s, fid);
+    if (!e){
+        errno = ESRCH;
+        ret = -1;
+    } else {
+        e->deadline = deadline;
+        if (e->state == STATE_QUEUED && e->cls == FIBER_SCHED_EDF){
+            heap_up(c->heap, e->heap_idx);
+            heap_down(c->heap, c->stats.queue_len, e->heap_idx);
+        }
+    }
+
+    sched_unlock(s);
+    return ret;
+}
+
+int fiber_sched_set_time_slice(struct fiber_sched *s, unsigned long long slice_ns){
+    sched_lock(s);
+    s->slice_ns = slice_ns;
+    sched_unlock(s);
+    return 0;
+}
+
+int fiber_sched_run(struct fiber_sched *s){
+    struct sched_worker w;
+    struct sched_entity *e;
+
+    w.s         = s;
+    w.sched_fid = GetCurrentFiber();
+    w.current   = NULL;
+
+    if (w.sched_fid == -1){
+        errno = EINVAL;
+        return -1;
+    }
+    current_worker = &w;
+
+    sched_lock(s);
+
+    // Preempted fibers come back to this loop. The time slice is per
+    // process, the last worker out turns it off.
+    if (s->slice_ns){
+        if (SetPreemption(s->slice_ns, w.sched_fid, &sched_critical)){
+            sched_unlock(s);
+            current_worker = NULL;
+            return -1;
+        }
+        s->workers++;
+    }
+
+    while (!s->stopping && s->live){
+
+        e = pick_next(s, fiber_sched_now());
+        if (!e){
+            pthread_cond_wait(&(s->runnable), &(s->lock));
+            continue;
+        }
+
+        w.current = e;
+        w.action  = ACTION_REQUEUE;     // If e switches back on its own
+
+        sched_unlock(s);
+
+        // Queued fibers have already been saved by the module, this only
+        // fails if someone switched to e behind our back: retry it later
+        SwitchToFiber(e->fid);
+
+        // Left raised by switch_out, if e came back through it
+        sched_critical = 0;
+
+        sched_lock(s);
+
+        w.current = NULL;
+
+        switch (w.action){
+            case ACTION_REQUEUE:
+                enqueue(s, e, 1);
+                break;
+
+            case ACTION_PARK:
+                if (e->wake_pending){
+                    e->wake_pending = 0;
+                    enqueue(s, e, 1);
+                } else {
+                    e->state = STATE_PARKED;
+                }
+                break;
+
+            case ACTION_DONE:
+                s->by_fid[e->fid] = NULL;
+                free(e);
+                if (--s->live == 0) pthread_cond_broadcast(&(s->runnable));
+                break;
+        }
+    }
+
+    if (s->slice_ns && --s->workers == 0) SetPreemption(0, -1, NULL);
+
+    sched_unlock(s);
+
+    current_worker = NULL;
+    return 0;
+}
+
+void fiber_sched_stop(struct fiber_sched *s){
+    sched_lock(s);
+    s->stopping = 1;
+    pthread_cond_broadcast(&(s->runnable));
+    sched_unlock(s);
+}
+
+int fiber_sched_yield(struct fiber_sched *s){
+    return switch_out(ACTION_REQUEUE);
+}
+
+int fiber_sched_park(struct fiber_sched *s){
+    return switch_out(ACTION_PARK);
+}
+
+int fiber_sched_wake(struct fiber_sched *s, pid_t fid){
+    struct sched_entity *e;
+    int ret = 0;
+
+    sched_lock(s);
+
+    e = get_entity(s, fid);
+    if (!e){
+        errno = ESRCH;
+        ret = -1;
+    } else if (e->state == STATE_PARKED){
+        ret = enqueue(s, e, 1);
+    } else if (e->state == STATE_RUNNING){
+        e->wake_pending = 1;
+    }
+
+    sched_unlock(s);
+    return ret;
+}
+
+int fiber_sched_get_stats(struct fiber_sched *s, int cls,
+                          struct fiber_sched_class_stats *out){
+    struct sched_class *c;
+
+    if (cls < 0 || cls >= FIBER_SCHED_CLASSES){
+        errno = EINVAL;
+        return -1;
+    }
+    c = &(s->classes[cls]);
+
+    sched_lock(s);
+
+    *out = c->stats;
+    out->wait_ns_p50  = wait_percentile(c, 0.50);
+    out->wait_ns_p99  = wait_percentile(c, 0.99);
+    out->wait_ns_p999 = wait_percentile(c, 0.999);
+
+    sched_unlock(s);
+    return 0;
+}
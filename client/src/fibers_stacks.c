@@ -0,0 +1,135 @@
+#include "fibers_stacks.h"
+
+#include <sys/mman.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+
+
+// Default stack of CreateFiber, see fibers_iface.c
+#define DEFAULT_STACK_SIZE (4096*2)
+
+struct fiber_arena{
+
+    char *base;                 // Huge page aligned
+    size_t len;
+
+    long stack_size;
+    long stacks;
+    long next;                  // First free stack, updated atomically
+
+    int backing;
+
+};
+
+// Anonymous mapping of len bytes aligned to the huge page size, with THP
+// on or off as asked
+static void *map_aligned(size_t len, int thp){
+
+    size_t slack = FIBER_ARENA_HUGE_PAGE;
+    char *p, *aligned;
+
+    p = mmap(NULL, len + slack, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    aligned = (char *) (((uintptr_t) p + slack - 1) & ~((uintptr_t) slack - 1));
+
+    // Give back the unaligned head and tail
+    if (aligned > p) munmap(p, aligned - p);
+    if (aligned + len < p + len + slack)
+        munmap(aligned + len, (p + len + slack) - (aligned + len));
+
+    // Best effort, without THP support the arena simply uses base pages
+    madvise(aligned, len, thp ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+
+    return aligned;
+}
+
+struct fiber_arena *fiber_arena_create(long stacks, long stack_size, int flags){
+
+    struct fiber_arena *a;
+    size_t len;
+
+    if (!stack_size) stack_size = DEFAULT_STACK_SIZE;
+
+    if (stacks <= 0 || stack_size < 4096 || stack_size > FIBER_ARENA_HUGE_PAGE ||
+        (stack_size & (stack_size - 1)) || stacks > LONG_MAX / stack_size){
+        errno = EINVAL;
+        return NULL;
+    }
+
+    a = calloc(1, sizeof(struct fiber_arena));
+    if (!a) return NULL;
+
+    len = (size_t) stacks * stack_size;
+    len = (len + FIBER_ARENA_HUGE_PAGE - 1) & ~((size_t) FIBER_ARENA_HUGE_PAGE - 1);
+
+    a->base = MAP_FAILED;
+    if (flags & FIBER_ARENA_HUGETLB){
+        // Huge page aligned by construction
+        a->base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (a->base != MAP_FAILED) a->backing = FIBER_ARENA_HUGETLB;
+    }
+
+    if (a->base == MAP_FAILED){
+        int thp = !!(flags & (FIBER_ARENA_THP | FIBER_ARENA_HUGETLB));
+
+        a->base = map_aligned(len, thp);
+        if (!a->base){
+            free(a);
+            return NULL;
+        }
+        a->backing = thp ? FIBER_ARENA_THP : FIBER_ARENA_BASE;
+    }
+
+    a->len = len;
+    a->stack_size = stack_size;
+    a->stacks = len / stack_size;
+    a->next = 0;
+
+    return a;
+}
+
+void *fiber_arena_alloc(struct fiber_arena *a, long n){
+
+    long first = __atomic_load_n(&(a->next), __ATOMIC_RELAXED);
+
+    do {
+        if (n <= 0 || n > a->stacks - first) return NULL;
+    } while (!__atomic_compare_exchange_n(&(a->next), &first, first + n, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return a->base + first * a->stack_size;
+}
+
+long fiber_arena_stack_size(struct fiber_arena *a){
+    return a->stack_size;
+}
+
+int fiber_arena_backing(struct fiber_arena *a){
+    return a->backing;
+}
+
+pid_t fiber_arena_create_fibers(struct fiber_arena *a, int n,
+                                void (*user_func)(void*), void **params){
+
+    void *stacks = fiber_arena_alloc(a, n);
+
+    if (!stacks){
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return CreateFibers(n, user_func, params, stacks, a->stack_size);
+}
+
+void fiber_arena_destroy(struct fiber_arena *a){
+
+    if (!a) return;
+
+    munmap(a->base, a->len);
+    free(a);
+}
@@ -72,6 +72,74 @@ int main(){
 
     print_test_outcome(ret, "FlsAllocSetGetFree");
     printf("\n");
+
+    ret = getFiberStats_test_01();
+    print_test_outcome(ret, "GetFiberStats_test_01");
+    printf("\n");
+
+    ret = numaStats_test_01();
+    print_test_outcome(ret, "NumaStats_test_01");
+    printf("\n");
+
+    ret = sched_test_01();
+    print_test_outcome(ret, "Sched_test_01");
+    printf("\n");
+
+    ret = sched_test_02();
+    print_test_outcome(ret, "Sched_test_02");
+    printf("\n");
+
+    ret = sched_test_03();
+    print_test_outcome(ret, "Sched_test_03");
+    printf("\n");
+
+    ret = perfCounters_test_01();
+    print_test_outcome(ret, "PerfCounters_test_01");
+    printf("\n");
+
+    ret = runLength_test_01();
+    print_test_outcome(ret, "RunLength_test_01");
+    printf("\n");
+
+    ret = flightRecorder_test_01();
+    print_test_outcome(ret, "FlightRecorder_test_01");
+    printf("\n");
+
+    ret = liveStats_test_01();
+    print_test_outcome(ret, "LiveStats_test_01");
+    printf("\n");
+
+    ret = createFibers_test_01();
+    print_test_outcome(ret, "CreateFibers_test_01");
+    printf("\n");
+
+    ret = fork_test_01();
+    print_test_outcome(ret, "Fork_test_01");
+    printf("\n");
+
+    ret = arenaStacks_test_01();
+    print_test_outcome(ret, "ArenaStacks_test_01");
+    printf("\n");
+
+    ret = stackHwm_test_01();
+    print_test_outcome(ret, "StackHwm_test_01");
+    printf("\n");
+
+    ret = fiberAffinity_test_01();
+    print_test_outcome(ret, "FiberAffinity_test_01");
+    printf("\n");
+
+    ret = cxxFiber_test_01();
+    print_test_outcome(ret, "CxxFiber_test_01");
+    printf("\n");
+
+    ret = cxxFlsSlot_test_01();
+    print_test_outcome(ret, "CxxFlsSlot_test_01");
+    printf("\n");
+
+    ret = fiberPool_test_01();
+    print_test_outcome(ret, "FiberPool_test_01");
+    printf("\n");
     
     
     // Create another fiber fiber0
@@ -1,8 +1,16 @@
 #include "fibers_iface.h"
 #include "tests.h"
+#include "fibers_sched.h"
+#include "fibers_pool.h"
+#include "fibers_stacks.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <errno.h>
 
 #define SUCCESS     0
 #define ERROR       -1
@@ -218,3 +226,608 @@ int flsAlloc_Until_err(){
     
     return 0;
 }
+
+// Checks that the calling fiber is reported as running, and that an
+// incremental poll with no fiber updates in between reports nothing
+int getFiberStats_test_01(){
+
+    struct fiber_stats stats[64];
+    unsigned long long generation;
+    long count;
+    int running = 0;
+
+    count = GetFiberStats(stats, 64, 0, -1, 0, &generation);
+    printf("GetFiberStats reported %ld fibers at generation %llu\n", count, generation);
+    if(count <= 0) return ERROR;
+
+    for(int i=0; i<count; i++){
+        if(stats[i].state == FIBER_STATE_RUNNING) running++;
+    }
+    if(running != 1) return ERROR;
+
+    // What a monitoring agent gets from the outside
+    if(GetProcessFiberStats(getpid(), stats, 64, 0, -1, 0, NULL) != count) return ERROR;
+
+    count = GetFiberStats(stats, 64, 0, -1, generation, NULL);
+    printf("Incremental GetFiberStats reported %ld fibers\n", count);
+    if(count != 0) return ERROR;
+
+    return SUCCESS;
+}
+
+// Never scheduled, only created to look at where it was placed
+static void numa_fiber_fn(void *param){
+    FiberExit();
+}
+
+// Checks the NUMA placement reported for the current fiber and for fibers
+// created on a given node. Also passes on single-node machines, where
+// everything lives on node 0.
+int numaStats_test_01(){
+
+    struct fiber_stats stats;
+    pid_t self = GetCurrentFiber();
+    pid_t fid;
+    int node;
+
+    if(GetFiberStats(&stats, 1, self, self, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d lives on node %d, local activations %llu, remote %llu\n",
+           self, stats.node, stats.local_activations, stats.remote_activations);
+    if(stats.node < 0 || stats.last_node != stats.node) return ERROR;
+    node = stats.node;
+
+    fid = CreateFiberOnNode(numa_fiber_fn, NULL, node);
+    if(fid == -1) return ERROR;
+    if(GetFiberStats(&stats, 1, fid, fid, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d created on node %d\n", fid, stats.node);
+    if(stats.node != node || stats.last_node != -1) return ERROR;
+
+    // No machine we run on has that many nodes
+    if(CreateFiberOnNode(numa_fiber_fn, NULL, 62) != -1) return ERROR;
+
+    return SUCCESS;
+}
+
+static struct fiber_sched *sched;
+static char sched_order[16];
+static int  sched_ran;
+static pid_t sched_parked;
+
+static void sched_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+}
+
+// Runs twice, around a yield
+static void sched_yield_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    fiber_sched_yield(sched);
+    sched_order[sched_ran++] = (char)(long) param;
+}
+
+// Parks until sched_wake_fn wakes it up
+static void sched_park_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    fiber_sched_park(sched);
+    sched_order[sched_ran++] = (char)(long) param;
+}
+
+static void sched_wake_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    fiber_sched_wake(sched, sched_parked);
+}
+
+// Checks that classes are strict, EDF goes by deadline and that yield,
+// park and wake put fibers back where they belong
+int sched_test_01(){
+
+    struct fiber_sched_class_stats stats;
+    unsigned long long now = fiber_sched_now();
+
+    sched = fiber_sched_create(0);
+    if(!sched) return ERROR;
+    sched_ran = 0;
+
+    fiber_sched_spawn(sched, sched_wake_fn,  (void *)'w', FIBER_SCHED_LOW,    0);
+    fiber_sched_spawn(sched, sched_yield_fn, (void *)'n', FIBER_SCHED_NORMAL, 0);
+    fiber_sched_spawn(sched, sched_fn,       (void *)'N', FIBER_SCHED_NORMAL, 0);
+    sched_parked =
+    fiber_sched_spawn(sched, sched_park_fn,  (void *)'h', FIBER_SCHED_HIGH,   0);
+    fiber_sched_spawn(sched, sched_fn,       (void *)'2', FIBER_SCHED_EDF,    now+2000);
+    fiber_sched_spawn(sched, sched_fn,       (void *)'1', FIBER_SCHED_EDF,    now+1000);
+
+    if(fiber_sched_run(sched)) return ERROR;
+
+    sched_order[sched_ran] = 0;
+    printf("Scheduled in order %s\n", sched_order);
+    if(strcmp(sched_order, "12hnNnwh")) return ERROR;
+
+    if(fiber_sched_get_stats(sched, FIBER_SCHED_NORMAL, &stats)) return ERROR;
+    printf("NORMAL class: %llu dispatched, p99 wait %llu ns\n", stats.dispatched, stats.wait_ns_p99);
+    if(stats.dispatched != 3 || stats.queue_len != 0) return ERROR;
+
+    fiber_sched_destroy(sched);
+    return SUCCESS;
+}
+
+// With aging, a LOW fiber that waited long enough overtakes a HIGH one
+int sched_test_02(){
+
+    struct fiber_sched_class_stats stats;
+
+    sched = fiber_sched_create(1);
+    if(!sched) return ERROR;
+    sched_ran = 0;
+
+    fiber_sched_spawn(sched, sched_fn, (void *)'l', FIBER_SCHED_LOW,  0);
+    usleep(1000);
+    fiber_sched_spawn(sched, sched_fn, (void *)'h', FIBER_SCHED_HIGH, 0);
+
+    if(fiber_sched_run(sched)) return ERROR;
+
+    sched_order[sched_ran] = 0;
+    printf("Scheduled in order %s\n", sched_order);
+    if(strcmp(sched_order, "lh")) return ERROR;
+
+    if(fiber_sched_get_stats(sched, FIBER_SCHED_LOW, &stats)) return ERROR;
+    if(stats.aged != 1) return ERROR;
+
+    fiber_sched_destroy(sched);
+    return SUCCESS;
+}
+
+static volatile int sched_spin_stop;
+static pid_t sched_spinner;
+
+// Never switches back on its own
+static void sched_spin_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    while(!sched_spin_stop);
+    sched_order[sched_ran++] = (char)(long) param;
+}
+
+static void sched_stop_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    sched_spin_stop = 1;
+}
+
+// A fiber spinning forever is preempted and the one queued behind it gets
+// to stop it
+int sched_test_03(){
+
+    struct fiber_stats stats;
+
+    sched = fiber_sched_create(0);
+    if(!sched) return ERROR;
+    fiber_sched_set_time_slice(sched, 1000000);
+    sched_ran = 0;
+    sched_spin_stop = 0;
+
+    sched_spinner =
+    fiber_sched_spawn(sched, sched_spin_fn, (void *)'s', FIBER_SCHED_NORMAL, 0);
+    fiber_sched_spawn(sched, sched_stop_fn, (void *)'x', FIBER_SCHED_NORMAL, 0);
+
+    if(fiber_sched_run(sched)) return ERROR;
+
+    sched_order[sched_ran] = 0;
+    printf("Scheduled in order %s\n", sched_order);
+    if(strcmp(sched_order, "sxs")) return ERROR;
+
+    if(GetFiberStats(&stats, 1, sched_spinner, sched_spinner, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d was preempted %llu times\n", sched_spinner, stats.preemptions);
+    if(stats.preemptions < 1) return ERROR;
+
+    fiber_sched_destroy(sched);
+    return SUCCESS;
+}
+
+static pid_t counters_back;
+
+// Faults in fresh pages, then goes back
+static void counters_fn(void *param){
+    long pages = (long) param;
+    char *mem = mmap(NULL, pages*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+    if(mem != MAP_FAILED)
+        for(long i=0; i<pages; i++) mem[i*4096] = 1;
+
+    SwitchToFiber(counters_back);
+}
+
+// Checks that page faults are charged to the fiber that caused them, and
+// instructions if the machine has a PMU
+int perfCounters_test_01(){
+
+    struct fiber_stats stats;
+    int pmu;
+    pid_t fid;
+
+    pmu = EnablePerfCounters(FIBER_PERF_INSTRUCTIONS) == 0;
+    printf("Hardware counters %savailable\n", pmu ? "" : "not ");
+
+    counters_back = GetCurrentFiber();
+    fid = CreateFiber(counters_fn, (void *) 64);
+    if(fid == -1) return ERROR;
+    if(SwitchToFiber(fid) == -1) return ERROR;
+
+    if(GetFiberStats(&stats, 1, fid, fid, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d: %llu minor faults, %llu instructions\n", fid, stats.min_flt, stats.instructions);
+
+    EnablePerfCounters(0);
+
+    if(stats.min_flt < 64) return ERROR;
+    if(pmu && stats.instructions == 0) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t run_back;
+
+// Keeps the thread for about 2ms, then goes back
+static void run_fn(void *param){
+    struct timespec ts = {0, 2000000};
+
+    nanosleep(&ts, NULL);
+    SwitchToFiber(run_back);
+}
+
+// Checks that the activation of a fiber lands in a run-length bucket of
+// at least 1ms, and that the time its creator spent switched out is parked time
+int runLength_test_01(){
+
+    struct fiber_stats stats;
+    pid_t fid;
+
+    run_back = GetCurrentFiber();
+    fid = CreateFiber(run_fn, NULL);
+    if(fid == -1) return ERROR;
+    if(SwitchToFiber(fid) == -1) return ERROR;
+
+    if(GetFiberStats(&stats, 1, fid, fid, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d: longest run %llu ns, last switched out at %llu\n", fid, stats.max_run_ns, stats.last_deactivation_ns);
+    if(stats.max_run_ns < 2000000) return ERROR;
+    if(stats.run_hist[0] + stats.run_hist[1] + stats.run_hist[2] != 0) return ERROR;
+    if(stats.last_deactivation_ns == 0) return ERROR;
+
+    if(GetFiberStats(&stats, 1, run_back, run_back, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d: parked for %llu ns\n", run_back, stats.parked_ns);
+    if(stats.parked_ns < 2000000) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t recorder_back;
+
+static void recorder_fn(void *param){
+    SwitchToFiber(recorder_back);
+}
+
+// Checks that the life of a fiber can be followed in the flight recorder,
+// mapped as a monitoring process would
+int flightRecorder_test_01(){
+
+    struct fiber_recorder *r;
+    struct fiber_event events[64];
+    unsigned long long cursor = 0, lost = 0;
+    int created = 0, in = 0, out = 0;
+    long n, i;
+    pid_t fid;
+
+    if(EnableFlightRecorder(0) == -1) return ERROR;
+
+    recorder_back = GetCurrentFiber();
+    fid = CreateFiber(recorder_fn, NULL);
+    if(fid == -1) return ERROR;
+    if(SwitchToFiber(fid) == -1) return ERROR;
+
+    r = OpenFlightRecorder(getpid());
+    if(r == NULL) return ERROR;
+
+    while((n = ReadFlightRecorder(r, &cursor, events, 64, &lost)) > 0){
+        for(i=0; i<n; i++){
+            if(events[i].type == FIBER_EVENT_CREATE && events[i].to == fid) created++;
+            if(events[i].type == FIBER_EVENT_SWITCH && events[i].to == fid) in++;
+            if(events[i].type == FIBER_EVENT_SWITCH && events[i].from == fid) out++;
+        }
+    }
+
+    printf("Read %llu events, %llu lost, fiber %d created %d, in %d, out %d\n", cursor, lost, fid, created, in, out);
+    CloseFlightRecorder(r);
+
+    if(created != 1 || in != 1 || out != 1) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t live_back;
+
+static void live_fn(void *param){
+    SwitchToFiber(live_back);
+}
+
+// Checks that the shared counters follow a create and two switches
+int liveStats_test_01(){
+
+    const struct fiber_live_stats *live;
+    struct fiber_live_stats before, after;
+    pid_t fid;
+
+    live = OpenLiveStats(getpid());
+    if(live == NULL) return ERROR;
+
+    ReadLiveStats(live, &before);
+
+    live_back = GetCurrentFiber();
+    fid = CreateFiber(live_fn, NULL);
+    if(fid == -1) return ERROR;
+    if(SwitchToFiber(fid) == -1) return ERROR;
+
+    ReadLiveStats(live, &after);
+    CloseLiveStats(live);
+
+    printf("Fibers %llu -> %llu, switches %llu -> %llu\n", before.fibers, after.fibers, before.switches, after.switches);
+
+    if(after.created - before.created != 1) return ERROR;
+    if(after.fibers - before.fibers != 1) return ERROR;
+    if(after.switches - before.switches != 2) return ERROR;
+
+    return SUCCESS;
+}
+
+#define BULK_FIBERS 16
+
+static pid_t bulk_back;
+static long  bulk_sum;
+
+static void bulk_fn(void *param){
+    bulk_sum += (long) param;
+    SwitchToFiber(bulk_back);
+}
+
+// Creates fibers in one call and runs each of them once
+int createFibers_test_01(){
+
+    void *params[BULK_FIBERS];
+    pid_t first;
+    long i;
+
+    for(i=0; i<BULK_FIBERS; i++) params[i] = (void *) (i + 1);
+
+    bulk_back = GetCurrentFiber();
+    bulk_sum = 0;
+
+    first = CreateFibers(BULK_FIBERS, bulk_fn, params, NULL, 0);
+    if(first == -1) return ERROR;
+
+    for(i=0; i<BULK_FIBERS; i++)
+        if(SwitchToFiber(first + i) == -1) return ERROR;
+
+    printf("Fibers %d to %d ran, sum of their parameters %ld\n", first, first + BULK_FIBERS - 1, bulk_sum);
+    if(bulk_sum != BULK_FIBERS * (BULK_FIBERS + 1) / 2) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t fork_back;
+static long  fork_runs;
+
+static void fork_fn(void *param){
+    fork_runs += (long) param;
+    SwitchToFiber(fork_back);
+}
+
+// The child of a fork() finds the FLS of the forking fiber and runs a fiber
+// created by the parent, which the parent can still run on its own
+int fork_test_01(){
+
+    pid_t fid, child;
+    long index;
+    int status;
+
+    if(EnableFork() == -1) return ERROR;
+
+    index = FlsAlloc();
+    if(index == -1 || FlsSetValue(index, 42) == -1) return ERROR;
+
+    fork_back = GetCurrentFiber();
+    fork_runs = 0;
+    fid = CreateFiber(fork_fn, (void *) 1);
+    if(fid == -1) return ERROR;
+
+    child = fork();
+    if(child == -1) return ERROR;
+
+    if(child == 0){
+        if(FlsGetValue(index) != 42) _exit(1);
+        if(SwitchToFiber(fid) == -1 || fork_runs != 1) _exit(2);
+        _exit(0);
+    }
+
+    if(waitpid(child, &status, 0) == -1) return ERROR;
+    printf("Child %d exited with status %d\n", child, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) return ERROR;
+
+    if(SwitchToFiber(fid) == -1 || fork_runs != 1) return ERROR;
+    FlsFree(index);
+
+    return SUCCESS;
+}
+
+static pid_t arena_back;
+static long arena_sum;
+
+static void arena_fn(void *param){
+    arena_sum += (long) param;
+    SwitchToFiber(arena_back);
+}
+
+// Fibers on the stacks of a THP arena: all of them run, and the stacks
+// they got are the consecutive stacks of the arena
+int arenaStacks_test_01(){
+
+    struct fiber_arena *arena;
+    void *params[64];
+    pid_t first;
+    char *next;
+    long i, expected = 0;
+
+    arena = fiber_arena_create(64, 0, FIBER_ARENA_THP);
+    if(!arena) return ERROR;
+    printf("Arena backed by %s\n", fiber_arena_backing(arena) == FIBER_ARENA_THP ? "THP" : "base pages");
+
+    for(i = 0; i < 64; i++){
+        params[i] = (void *) (i + 1);
+        expected += i + 1;
+    }
+
+    arena_back = GetCurrentFiber();
+    arena_sum = 0;
+    first = fiber_arena_create_fibers(arena, 64, arena_fn, params);
+    if(first == -1) return ERROR;
+
+    for(i = 0; i < 64; i++)
+        if(SwitchToFiber(first + i) == -1) return ERROR;
+
+    if(arena_sum != expected) return ERROR;
+
+    // The arena is rounded up to a huge page, the next stacks follow on
+    next = fiber_arena_alloc(arena, 1);
+    if(!next || ((unsigned long) next & (fiber_arena_stack_size(arena) - 1))) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t stack_back;
+
+// Switches out with about 4 KiB of its stack in use
+static void stack_fn(void *param){
+    volatile char frame[4096];
+
+    frame[0] = 1;
+    SwitchToFiber(stack_back);
+    frame[sizeof(frame) - 1] = frame[0];
+}
+
+// Checks that the high-water mark of a fiber covers the frame live when it
+// switched out, and fits in its stack
+int stackHwm_test_01(){
+
+    struct fiber_stats stats;
+    pid_t fid;
+
+    stack_back = GetCurrentFiber();
+    fid = CreateFiber(stack_fn, NULL);
+    if(fid == -1) return ERROR;
+    if(SwitchToFiber(fid) == -1) return ERROR;
+
+    if(GetFiberStats(&stats, 1, fid, fid, 0, NULL) != 1) return ERROR;
+    printf("Fiber %d: %llu of %llu bytes of stack used\n", fid, stats.stack_hwm, stats.stack_size);
+    if(stats.stack_hwm < 4096 || stats.stack_hwm > stats.stack_size) return ERROR;
+
+    return SUCCESS;
+}
+
+static pid_t affinity_back;
+
+static void affinity_fn(void *param){
+    for(;;) SwitchToFiber(affinity_back);
+}
+
+// Pins the thread to one cpu, then checks that a fiber pinned to another
+// cpu is refused while one pinned to the thread's cpu runs, and that the
+// last cpu and thread of the fiber are reported
+int fiberAffinity_test_01(){
+
+    struct fiber_stats stats;
+    unsigned long saved[16], mask[16];
+    int cpu, other, ret = ERROR;
+    pid_t fid;
+
+    if(syscall(SYS_sched_getaffinity, 0, sizeof(saved), saved) <= 0) return ERROR;
+
+    // First and second cpu the thread may run on, other is -1 if none
+    for(cpu = 0; !(saved[cpu / 64] & (1UL << (cpu % 64))); cpu++);
+    for(other = cpu + 1; other < 1024 && !(saved[other / 64] & (1UL << (other % 64))); other++);
+    if(other == 1024) other = -1;
+
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / 64] |= 1UL << (cpu % 64);
+    if(syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask)) return ERROR;
+
+    affinity_back = GetCurrentFiber();
+    fid = CreateFiber(affinity_fn, NULL);
+    if(fid == -1) goto out;
+    if(GetFiberLastCpu(fid) != -1) goto out;
+
+    if(other != -1){
+        unsigned long elsewhere[16] = {0};
+
+        elsewhere[other / 64] |= 1UL << (other % 64);
+        if(SetFiberAffinity(fid, sizeof(elsewhere), elsewhere) == -1) goto out;
+        if(SwitchToFiber(fid) != -1 || errno != EXDEV) goto out;
+        printf("Fiber %d pinned to cpu %d, refused on cpu %d\n", fid, other, cpu);
+    }
+
+    if(SetFiberAffinity(fid, sizeof(mask), mask) == -1) goto out;
+    if(SwitchToFiber(fid) == -1) goto out;
+    if(SetFiberAffinity(fid, 0, NULL) == -1) goto out;
+    if(SwitchToFiber(fid) == -1) goto out;
+
+    if(GetFiberLastCpu(fid) != cpu) goto out;
+    if(GetFiberStats(&stats, 1, fid, fid, 0, NULL) != 1) goto out;
+    printf("Fiber %d: last ran on cpu %d by thread %d, %llu cpu migrations\n", fid, stats.last_cpu, stats.last_pid, stats.cpu_migrations);
+    if(stats.last_pid != syscall(SYS_gettid) || stats.pinned || stats.cpu_migrations) goto out;
+
+    ret = SUCCESS;
+out:
+    syscall(SYS_sched_setaffinity, 0, sizeof(saved), saved);
+    return ret;
+}
+
+static struct fiber_pool *pool;
+
+static void pool_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+}
+
+static void pool_stop_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    fiber_pool_stop(pool);
+}
+
+// Yields, then queues the task that stops the pool
+static void pool_yield_fn(void *param){
+    sched_order[sched_ran++] = (char)(long) param;
+    fiber_pool_yield(pool);
+    sched_order[sched_ran++] = 'Y';
+    fiber_pool_submit(pool, pool_stop_fn, (void *)'s');
+}
+
+// Worker fibers run queued tasks one after the other, a yielding task
+// makes the pool grow and resumes once the queue is empty
+int fiberPool_test_01(){
+
+    struct fiber_pool_stats stats;
+
+    pool = fiber_pool_create(1, 2, 1);
+    if(!pool) return ERROR;
+    sched_ran = 0;
+
+    fiber_pool_submit(pool, pool_yield_fn, (void *)'y');
+    fiber_pool_submit(pool, pool_fn,       (void *)'a');
+    fiber_pool_submit(pool, pool_fn,       (void *)'b');
+
+    if(fiber_pool_run(pool)) return ERROR;
+
+    sched_order[sched_ran] = 0;
+    printf("Pool ran in order %s\n", sched_order);
+    if(strcmp(sched_order, "yabYs")) return ERROR;
+
+    if(fiber_pool_get_stats(pool, &stats)) return ERROR;
+    printf("Pool: %llu tasks on %ld fibers with %llu dispatches, queue max %ld, utilization %.2f\n",
+           stats.completed, stats.fibers, stats.dispatches, stats.queue_max, stats.utilization);
+    if(stats.submitted != 4 || stats.completed != 4 || stats.fibers != 2 || stats.idle != 2) return ERROR;
+    if(stats.dispatches != 3 || stats.queue_max != 3 || stats.queue_len != 0) return ERROR;
+
+    fiber_pool_destroy(pool);
+    return SUCCESS;
+}
@@ -0,0 +1,95 @@
+#include "fibers.hpp"
+#include "tests.h"
+
+#include <stdio.h>
+#include <string_view>
+
+#define SUCCESS     0
+#define ERROR       -1
+
+
+// Counts the destructions of the copies a callable owns
+struct tracked{
+
+    static int alive;
+
+    tracked() { alive++; }
+    tracked(const tracked &) { alive++; }
+    ~tracked() { alive--; }
+};
+
+int tracked::alive = 0;
+
+// Spawned fibers run their callable in place, capture included, and
+// destroy it when it returns, when it calls fibers::exit() and when the
+// handle goes away before it finishes
+int cxxFiber_test_01(){
+
+    pid_t back = fibers::this_fiber();
+    long steps = 0;
+
+    {
+        tracked t;
+        fibers::Fiber f = fibers::spawn([t, back, &steps]{
+            steps++;
+            fibers::switch_to(back);
+            steps++;
+        });
+        if(!f) return ERROR;
+
+        fibers::Fiber g = std::move(f);
+        if(f || !g || g.resume() == -1 || steps != 1 || g.done()) return ERROR;
+        if(g.resume() == -1 || steps != 2 || !g.done()) return ERROR;
+        printf("Fiber %d done after %ld steps, %d copies alive\n", g.id(), steps, tracked::alive);
+        if(tracked::alive != 1) return ERROR;
+    }
+
+    {
+        tracked t;
+        fibers::Fiber f = fibers::spawn([t, &steps]{
+            steps++;
+            fibers::exit();
+        });
+        if(f.resume() == -1 || steps != 3 || !f.done() || tracked::alive != 1) return ERROR;
+
+        fibers::Fiber idle = fibers::spawn([t]{});
+        if(tracked::alive != 2) return ERROR;
+    }
+
+    printf("%d copies alive at the end\n", tracked::alive);
+    if(tracked::alive != 0) return ERROR;
+
+    return SUCCESS;
+}
+
+// Each fiber sees its own value of a slot, T{} until it sets one, also
+// when reads are served by the cache of the thread between switches
+int cxxFlsSlot_test_01(){
+
+    static fibers::FlsSlot<double> ratio;
+    static fibers::FlsSlot<const char *> name;
+
+    pid_t back = fibers::this_fiber();
+    const char *seen = "unset";
+    double other = -1;
+
+    if(name.set("main") == -1 || ratio.set(0.5) == -1) return ERROR;
+    if(name.get() != std::string_view("main") || ratio.get() != 0.5) return ERROR;
+
+    fibers::Fiber f = fibers::spawn([&]{
+        other = ratio.get();
+        if(name.set("spawned") == -1) return;
+        fibers::switch_to(back);
+        seen = name.get();
+    });
+    if(f.resume() == -1) return ERROR;
+
+    printf("Spawned fiber read %f, main reads %s and %f\n", other, name.get(), ratio.get());
+    if(other != 0.0 || name.get() != std::string_view("main") || ratio.get() != 0.5) return ERROR;
+
+    if(f.resume() == -1 || !f.done()) return ERROR;
+    printf("Spawned fiber read back %s\n", seen);
+    if(seen != std::string_view("spawned") || name.get() != std::string_view("main")) return ERROR;
+
+    return SUCCESS;
+}
@@ -0,0 +1,46 @@
+#!/bin/bash
+#
+# Measures the latency of `ps aux` (one readdir + lookups per /proc/<pid>)
+# with the fibers module loaded and unloaded.
+#
+# Usage: ./ps_latency.sh [iterations]
+# Run from module/ after `make`, needs sudo to insmod/rmmod main.ko
+
+ITERATIONS=${1:-200}
+MODULE=main.ko
+
+run(){
+	local label=$1
+	local samples=()
+
+	# Warm up dentry and inode caches
+	for i in $(seq 10); do ps aux > /dev/null; done
+
+	for i in $(seq $ITERATIONS); do
+		local start=$(date +%s%N)
+		ps aux > /dev/null
+		local end=$(date +%s%N)
+		samples+=($(( (end - start) / 1000 )))
+	done
+
+	printf "%s\n" "${samples[@]}" | sort -n | awk -v label="$label" '
+		{ v[NR] = $1; sum += $1 }
+		END {
+			printf "%-10s n=%d mean=%dus p50=%dus p99=%dus max=%dus\n",
+				label, NR, sum / NR, v[int(NR * 0.50)],
+				v[int(NR * 0.99)], v[NR]
+		}'
+}
+
+if [[ ! -f $MODULE ]]; then
+	echo "$MODULE not found, build the module first"
+	exit 1
+fi
+
+echo "Processes in /proc: $(ls -d /proc/[0-9]* | wc -l)"
+
+sudo rmmod main 2> /dev/null
+run "unloaded"
+
+sudo insmod $MODULE
+run "loaded"
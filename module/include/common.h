@@ -13,13 +13,13 @@
 #define ERROR  -1
 
 
-#define DEBUG                // Undefine to decrease verbosity
-
-#ifdef DEBUG
+// Debug traces, defined by the default build and compiled out by
+// `make PERF=1`, see build/Makefile
+#ifdef FIBERS_DEBUG
 # define dbg(fmt,...) \
     printk(KERN_INFO "\e[1;33mFIBERS - dbg\e[0m: " fmt , ##__VA_ARGS__)
 #else
-# define dbg(fmt)
+# define dbg(fmt,...) do {} while (0)
 #endif
 
 
@@ -2,6 +2,7 @@
 #define FIBERS_FIBERSH
 
 #include "common.h"
+#include "fibers_driver.h"
 
 #include <linux/slab.h>
 #include <linux/rwlock_types.h>
@@ -14,6 +15,14 @@
 #include <linux/bitops.h>
 #include <linux/time.h>
 #include <linux/hashtable.h>
+#include <linux/topology.h>
+#include <linux/hrtimer.h>
+
+struct proc_dir_entry;
+struct perf_event;
+struct latency_percpu;
+struct fork_image;
+struct fxregs_state;
 
 
 pid_t kernelConvertThreadToFiber    (pid_t tgid, \
@@ -24,11 +33,29 @@ pid_t kernelCreateFiber             (long user_fn,      \
                                     pid_t tgid,         \
                                     pid_t pid,          \
                                     void *stack_base,   \
-                                    size_t stack_size);
-
-pid_t kernelSwitchToFiber           (pid_t tgid, \
+                                    size_t stack_size,  \
+                                    int node,           \
+                                    u64 start_ns);
+
+// Creates count fibers in one go, fiber i runs user_fn(params[i]) on the
+// stack at stack_region + i * stack_stride. Returns the first fid, the
+// others follow.
+pid_t kernelCreateFibers            (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    int count,            \
+                                    long user_fn,         \
+                                    void **params,        \
+                                    void *stack_region,   \
+                                    long stack_stride,    \
+                                    size_t stack_size,    \
+                                    int node);
+
+// CreateFiber and SwitchToFiber account the call in the latency
+// histograms of the process when start_ns is not 0, see latency_start()
+long kernelSwitchToFiber            (pid_t tgid, \
                                     pid_t pid,   \
-                                    pid_t fid);
+                                    pid_t fid,   \
+                                    u64 start_ns);
 
 
 long kernelFlsAlloc                 (pid_t tgid, \
@@ -38,9 +65,10 @@ int kernelFlsFree                   (pid_t tgid,          \
                                     pid_t pid,            \
                                     long index);
 
-long long kernelFlsGetValue         (pid_t tgid,          \
+int kernelFlsGetValue               (pid_t tgid,          \
                                     pid_t pid,            \
-                                    long index);
+                                    long index,           \
+                                    long long *value);
 
 int kernelFlsSetValue               (pid_t tgid,          \
                                     pid_t pid,            \
@@ -50,12 +78,82 @@ int kernelFlsSetValue               (pid_t tgid,          \
 int kernelFiberExit                 (pid_t tgid,          \
                                     pid_t pid);
 
+long kernelGetFiberStats            (pid_t tgid,          \
+                                    int fid_from,         \
+                                    int fid_to,           \
+                                    u64 since_generation, \
+                                    struct fiber_stats *out, \
+                                    long capacity,        \
+                                    long *total,          \
+                                    u64 *generation);
+
+int kernelSetPreemption             (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    u64 slice_ns,         \
+                                    pid_t sched_fid,      \
+                                    int __user *critical);
+
+int kernelEnablePerfCounters        (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    unsigned int flags);
+
+int kernelEnableFlightRecorder      (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    unsigned long events);
+
+int kernelSetFiberAffinity          (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    pid_t fid,            \
+                                    const unsigned long __user *mask, \
+                                    int size);
+
+int kernelGetFiberLastCpu           (pid_t tgid,          \
+                                    pid_t fid);
+
+int kernelGetFiberStack             (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    struct fiber_stack_args *stack);
+
+// fork() support, see fork.h
+long kernelForkPrepare              (pid_t tgid,          \
+                                    pid_t pid);
+
+pid_t kernelForkChild               (pid_t tgid,          \
+                                    pid_t pid,            \
+                                    u64 seq);
+
+// Shared by kernelConvertThreadToFiber and kernelForkChild
+struct process *process_get_or_create(pid_t tgid);
+struct thread  *thread_create       (struct process *p, pid_t pid, int node);
+
+// Stops the timer and counters of t and drops it from p->threads, the
+// memory goes after a grace period
+void            thread_release      (struct process *p, struct thread *t);
+
+// A fiber and its fiber_info on node, no fpu state yet. NULL if out of
+// memory.
+struct fiber   *fiber_alloc         (int node);
+
+// A copy of src on node, with fpu state and FLS of its own
+struct fiber   *fiber_dup           (const struct fiber *src, int node);
+
+// Frees what fiber_alloc and the switches set up, not the FLS
+void            fiber_release       (struct fiber *f);
+
+// fiber_release for a fiber that was in p->fibers, once the RCU readers
+// that may still walk into it are done
+void            fiber_release_rcu   (struct fiber *f);
+
 void kernelProcCleanup (pid_t tgid);
+int  kernelModInit     (void);
 void kernelModCleanup  (void);
 
 
 #define FLS_SIZE 4096
 
+// Hardware counters, indexed by the bit of their FIBER_PERF_* flag
+#define FIBER_PERF_COUNTERS 2
+
 // To keep track of free slots in FLS
 struct fls_free_ll{
 
@@ -64,22 +162,100 @@ struct fls_free_ll{
     struct fls_free_ll * next;
 };
 
+// Metrics and bookkeeping of a fiber that SwitchToFiber does not need,
+// only updated on a switch while the fiber_stats key is on (instrument.h).
+// Allocated along with the fiber, see fiber_alloc().
+struct fiber_info{
+
+    char            name[16];     // fid as a string, /proc entry name
+
+    pid_t           parent;       // Pid of thread that created the fiber
+    void           *entry_point;
+
+    struct proc_dir_entry *proc_entry;  // /proc/fibers/<tgid>/<fid>
+
+    // Floating point control words of the creator, a fiber starts with
+    // them on its first activation
+    u32             mxcsr;
+    u16             fcw;
+
+    atomic_long_t   failed_activations; // Needs to be atomic if fibers
+                                        // are not thread-specific
+
+    unsigned long   total_running_time;
+    unsigned long   last_activation_time;
+
+    u64             generation;   // Process generation of the last update,
+                                  // used for incremental stats polling
+
+    unsigned long   preemptions;
+    unsigned long   cpu_migrations;
+    unsigned long   thread_migrations;
+
+    struct cpumask *affinity_buf; // Backs fiber->affinity once it was set,
+                                  // freed along with the fiber
+
+    // Task counters accumulated while the fiber was running
+    unsigned long   min_flt;
+    unsigned long   maj_flt;
+    unsigned long   nvcsw;
+    unsigned long   nivcsw;
+    u64             perf[FIBER_PERF_COUNTERS];
+
+    // Activation lengths and time spent switched out, ktime_get_ns()
+    u64             switch_in_ns;
+    u64             switch_out_ns;  // 0 until the fiber first switches out
+    u64             max_run_ns;
+    unsigned long   run_hist[FIBER_RUN_BUCKETS];
+    u64             parked_ns;
+
+    unsigned long   stack_hwm;    // Bytes of stack in use at the deepest
+                                  // switch out, see fiber_account_stack
+
+};
+
 // Mantains the cpu context associated with the workflow of this fiber.
+// Fields read or written by every SwitchToFiber come first, in as few
+// cache lines as possible; the rest lives in struct fiber_info.
 struct fiber{
 
     atomic_t        active_pid;   // 0 if there is no active thread, ensure
                                   // mutual exclusion from SwitchToFiber
 
-    struct pt_regs  pt_regs;      // These two fields will store the state
-    struct fpu      fpu;          // of the CPU of this fiber
+    // These attributes are needed to add struct fiber into an hashtable
+    pid_t             fid;   // key for hashtable
+    struct hlist_node fnext; // Needed to be added into an hastable
+
+    struct fxregs_state *fxregs;  // Fpu state, allocated on the first
+                                  // switch that needs it
+    struct fiber_info   *info;
+
+    unsigned long   activations;  // Successful activation is guarded
+                                  // don't need atomic
+
+    int             preempted;    // Saved by a time slice expiry: all of
+                                  // pt_regs is live, ax included
+
+    int             last_cpu;     // Where the fiber last ran, -1 and 0 if
+    pid_t           last_pid;     // it never did
+    struct cpumask *affinity;     // Cpus it may be resumed on, NULL for any
+
+    // NUMA locality, only accounted on multi-node machines
+    int             node;         // Node holding the stack and this struct
+    int             last_node;    // Node on which the fiber last ran
+    int             remote_node;  // Node of the current streak of remote
+    unsigned int    remote_streak;// activations, see numa_migrate_after
+    unsigned long   local_activations;
+    unsigned long   remote_activations;
+
+    u64 fork_seq;                 // Images of the process up to this seq
+                                  // already have its state, 0 for none
 
     void           *stack_base;   // Base of allocated stack, to be freed
     unsigned long   stack_size;   // Size of the allocated stack
 
-
-    // These attributes are needed to add struct fiber into an hashtable
-    pid_t             fid;   // key for hashtable
-    struct hlist_node fnext; // Needed to be added into an hastable
+    struct pt_regs  pt_regs;      // Cpu registers of the fiber while it
+                                  // is not running
 
 
     // FLS-related fields
@@ -95,22 +271,20 @@ struct fiber{
 
     int used_fls;
 
-    // Metrics
-    char           name[50];
-
-    pid_t           parent;       // Pid of thread that created the fiber
-
-    unsigned long   activations;  // Successful activation is guarded
-                                  // don't need atomic
+    struct rcu_head rcu;          // See fiber_release_rcu
 
-    atomic_long_t   failed_activations; // Needs to be atomic if fibers
-                                        // are not thread-specific
+};
 
-    unsigned long   total_running_time;
-    unsigned long   last_activation_time;
+// Exits a process keeps for incremental GetFiberStats polls, older ones
+// are dropped and pollers that missed them have to resync
+#define FIBER_TOMBSTONES 256
 
-    void * entry_point;
+// Left behind by a fiber that exited, for incremental GetFiberStats polls
+struct fiber_tombstone{
 
+    pid_t fid;
+    pid_t parent;
+    u64   generation;             // Generation of the exit
 };
 
 // Mantains the responsibility of fibers for each process
@@ -126,10 +300,43 @@ struct process{
     atomic_t last_fid;      // Needed to generate a new fiber id on
                                   // each subsequent CreateFiber().
 
+    atomic64_t generation;        // Bumped on every fiber update, lets
+                                  // monitoring agents poll incrementally.
+
+    u64 slice_ns;                 // Preemption time slice, 0 if disabled
+
+    unsigned int perf_flags;      // FIBER_PERF_* counters to account
+
+    struct latency_percpu __percpu *latency;  // ioctl latency histograms
+
+    struct fiber_recorder *recorder;    // Flight recorder, NULL if off
+
+    spinlock_t fibers_lock;       // Serializes updates of fibers, lookups
+                                  // only need RCU
+
+    // Ring of the last FIBER_TOMBSTONES exits, allocated on the first
+    // one, under fibers_lock
+    struct fiber_tombstone *exited;
+    unsigned long exited_count;         // Exits recorded in the ring
+    u64 exited_horizon;                 // Generation of the newest exit
+                                        // no longer in the ring
+
+    struct fiber_live_stats *live_stats;    // Shared page, may be NULL
+    spinlock_t live_lock;                   // Serializes its writers
+
+    // fork() support, see fork.h
+    u64 fork_seq;                       // Seq of the last image taken
+    struct fork_image *fork_from;       // Image inherited, NULL if none
+    unsigned long *fork_pending;        // Its fibers not set up yet
+
+
+    struct proc_dir_entry *proc_dir;    // /proc/fibers/<tgid>
 
     // These attributes are needed to add struct process into an hashtable
     pid_t tgid;               // key for hashtable
     struct hlist_node pnext;  // Needed to be added into an hastable
+
+    struct rcu_head rcu;      // Monitoring processes look it up under RCU
 };
 
 // Mantain thread activated fiber
@@ -137,12 +344,38 @@ struct thread{
 
     pid_t active_fid;
 
+    // Preemption
+    pid_t home_fid;               // Fiber the thread was converted into
+    pid_t sched_fid;              // Takes over when a time slice expires
+    int __user *critical;         // Defers expiry while not 0, may be NULL
+    struct task_struct *task;     // Referenced until cleanup
+    struct hrtimer slice_timer;
+    ktime_t slice_end;            // 0 when no time slice is running
+    atomic_t preempt_pending;     // Expiry queued on the task
+
+    // Task counters when the running fiber was switched in
+    unsigned long last_min_flt;
+    unsigned long last_maj_flt;
+    unsigned long last_nvcsw;
+    unsigned long last_nivcsw;
+
+    // Hardware counters of the task, created on its first switch after
+    // the process opts in
+    struct perf_event *perf[FIBER_PERF_COUNTERS];
+    u64 perf_last[FIBER_PERF_COUNTERS];
+    unsigned int perf_failed;     // FIBER_PERF_* the task has no PMU for
+
     // These attributes are needed to add struct process into an hashtable
     pid_t pid;                // key for hashtable
     struct hlist_node tnext;  // Needed to be added into an hastable
+    struct rcu_head rcu;      // Deferred free, the task works may still look t up
 };
 
 
+// Global registry of the processes using fibers, defined in registry.c
+extern DECLARE_HASHTABLE(processes,6);
+extern spinlock_t processes_lock;
+
 // get_x_by_id are auxiliary functions
 // If no matching entry is found, they return NULL
 inline struct process * get_process_by_id(pid_t tgid);
@@ -13,8 +13,27 @@ struct fiber_args{
     long user_fn;
     void *fn_params;
 
+    int   node;             // NUMA node of the threads expected to run the
+                            // fiber, -1 for the node of the caller
+
+};
+
+
+// Creation of many fibers in one call, see IOCTL_CreateFibers
+struct fibers_args{
+
+    long   user_fn;
+    void **fn_params;       // count parameters, one per fiber
+    void  *stack_region;    // Stack of fiber i starts at
+    long   stack_stride;    // stack_region + i * stack_stride
+    long   stack_size;
+    int    count;           // At most FIBERS_BULK_MAX
+    int    node;            // As in fiber_args
+
 };
 
+#define FIBERS_BULK_MAX 65536
+
 
 struct fls_args{
     
@@ -24,6 +43,202 @@ struct fls_args{
 };
 
 
+// Buckets of fiber_stats.run_hist, by length of the activation:
+// < 10us, < 100us, < 1ms, < 10ms, < 100ms and longer
+#define FIBER_RUN_BUCKETS 6
+
+// Fixed-layout record describing one fiber, filled by IOCTL_GetFiberStats.
+// Fields are only ever appended: userspace tells the module the size of the
+// record it was compiled with through fiber_stats_args.entry_size.
+struct fiber_stats{
+
+    int fid;
+    int parent;             // Pid of thread that created the fiber
+    int state;              // One of the FIBER_STATE_*
+    int last_cpu;           // -1 if the fiber has never run
+
+    unsigned long long activations;
+    unsigned long long failed_activations;
+    unsigned long long running_time;
+    unsigned long long generation;  // Process generation of last update
+
+    unsigned long long local_activations;   // Activations on a cpu of node
+    unsigned long long remote_activations;  // Activations on other nodes
+    int node;               // NUMA node holding the fiber's stack
+    int last_node;          // -1 if the fiber has never run
+
+    unsigned long long preemptions; // Time slices that expired on it
+
+    // Accounted to the fiber at each switch out of it
+    unsigned long long min_flt;
+    unsigned long long maj_flt;
+    unsigned long long nvcsw;       // Voluntary context switches
+    unsigned long long nivcsw;      // Involuntary context switches
+    unsigned long long instructions;// 0 unless FIBER_PERF_INSTRUCTIONS
+    unsigned long long cycles;      // 0 unless FIBER_PERF_CYCLES
+
+    // Wall-clock time, in ns, of the activations and of the time in between
+    unsigned long long max_run_ns;  // Longest activation
+    unsigned long long run_hist[FIBER_RUN_BUCKETS]; // Activations by length
+    unsigned long long parked_ns;   // Switched out, between activations
+    unsigned long long last_deactivation_ns; // CLOCK_MONOTONIC, 0 if the
+                                             // fiber never switched out
+
+    // Stack given to CreateFiber, both 0 for a thread converted to fiber
+    unsigned long long stack_size;
+    unsigned long long stack_hwm;   // Deepest use seen when switching out
+                                    // of the fiber, in bytes
+
+    int last_pid;           // Thread the fiber last ran on, 0 if none
+    int pinned;             // 1 if the fiber has an affinity mask
+    unsigned long long cpu_migrations;      // Resumed on another cpu, or
+    unsigned long long thread_migrations;   // thread, than the last time
+
+};
+
+#define FIBER_STATE_IDLE     0
+#define FIBER_STATE_RUNNING  1
+// Reported once the fiber has exited, by incremental polls only, with only
+// fid, parent and generation set
+#define FIBER_STATE_EXITED   2
+
+// Returned by IOCTL_SwitchToFiber to the resumed fiber instead of 0 when it
+// keeps being resumed on another node than the one holding its stack: the
+// caller should move the stack pages to the current node.
+#define FIBER_SWITCH_MIGRATE 1
+
+// Returned to the scheduler fiber of a thread instead of 0 when it gets
+// control back because the fiber it switched to was preempted.
+#define FIBER_SWITCH_PREEMPTED 2
+
+// IOCTL_SwitchToFiber fails with errno EXDEV when the fiber has an
+// affinity mask without the cpu of the calling thread.
+
+
+struct preempt_args{
+
+    unsigned long long slice_ns;    // Time slice of every fiber of the
+                                    // process, 0 disables preemption
+    int   sched_fid;                // Fiber that takes over the calling
+                                    // thread on expiry, -1 for the fiber
+                                    // the thread was converted into
+    int  *critical;                 // Optional per-thread counter, expiry
+                                    // is deferred while it is not 0
+
+};
+
+
+// Cpus a fiber may be resumed on, see IOCTL_SetFiberAffinity
+struct fiber_affinity_args{
+
+    int   fid;
+    int   size;                 // Bytes of mask, 0 lets the fiber run on
+                                // any cpu again
+    unsigned long *mask;        // Bit i set if cpu i is allowed, e.g. a
+                                // cpu_set_t
+
+};
+
+// Stack of the fiber running on the calling thread, see
+// IOCTL_GetFiberStack. stack_base is NULL for a thread converted to fiber.
+struct fiber_stack_args{
+
+    void *stack_base;
+    long  stack_size;
+
+};
+
+
+struct fiber_stats_args{
+
+    struct fiber_stats *buf;    // User buffer to be filled
+    long  entry_size;           // sizeof(struct fiber_stats) in userspace
+    long  capacity;             // Number of entries that fit in buf
+
+    int   fid_from;             // First fid of the range to report
+    int   fid_to;               // Last fid of the range, -1 for all
+
+    int   tgid;                 // Process to report, 0 for the caller.
+                                // Others need the right to ptrace it
+    int   reserved;
+
+    unsigned long long since_generation;   // Report only fibers updated
+                                           // after this generation
+
+    unsigned long long generation;  // OUT: current process generation
+    long  count;                    // OUT: entries written into buf
+    long  total;                    // OUT: entries matching the request
+
+};
+
+
+// Flight recorder event types
+#define FIBER_EVENT_CREATE   1  // from: running fiber, to: created fiber
+#define FIBER_EVENT_SWITCH   2
+#define FIBER_EVENT_PREEMPT  3  // Switch forced by a time slice expiry
+#define FIBER_EVENT_EXIT     4  // from: exiting fiber, to: -1
+#define FIBER_EVENT_FAILED   5  // to was already running on another thread
+
+struct fiber_event{
+
+    unsigned long long seq;     // Index of the event + 1, changes while
+                                // the event is being written
+    unsigned long long ts_ns;   // CLOCK_MONOTONIC
+    unsigned short type;        // FIBER_EVENT_*
+    unsigned short cpu;
+    int   pid;                  // Thread that caused the event
+    int   from;
+    int   to;
+
+};
+
+// Flight recorder of a process: a ring holding its last fiber events,
+// shared read-only through mmap() on /dev/fibers. Event i is stored in
+// events[i % capacity], and is valid while its seq reads i + 1 both before
+// and after copying it.
+struct fiber_recorder{
+
+    unsigned long long head;    // Events recorded so far
+    unsigned int capacity;      // Events in the ring, a power of two
+    unsigned int event_size;    // sizeof(struct fiber_event)
+    unsigned long long reserved[6];
+
+    struct fiber_event events[];
+
+};
+
+// Live counters of a process, in a page shared read-only through mmap()
+// on /dev/fibers and updated in place by the module. A copy of the gauges
+// (fibers, threads, fls_*) is consistent if seq was even before taking it
+// and is unchanged after; the monotonic counters are each updated
+// atomically, outside of seq.
+struct fiber_live_stats{
+
+    unsigned int seq;
+    unsigned int reserved;
+
+    unsigned long long fibers;      // Alive, converted threads included
+    unsigned long long threads;     // Threads converted to fiber
+    unsigned long long created;     // Fibers ever created or converted
+    unsigned long long exited;
+    unsigned long long switches;    // Successful activations
+    unsigned long long preemptions;
+    unsigned long long failed_activations;
+    unsigned long long fls_fibers;  // Fibers alive that set up FLS
+    unsigned long long fls_bytes;   // FLS memory of those fibers
+
+};
+
+// mmap() page offsets of the areas /dev/fibers shares with monitoring
+// processes, which may map those of any process they may ptrace.
+// tgid is the pid of the process in the initial pid namespace.
+#define FIBERS_MMAP_REGION_BITS 4
+#define FIBERS_MMAP_RECORDER    0
+#define FIBERS_MMAP_STATS       1     // One page
+#define FIBERS_MMAP_PGOFF(tgid, region) \
+    (((unsigned long)(tgid) << FIBERS_MMAP_REGION_BITS) | (region))
+
+
 #define DRIVER_NAME       "fibers"
 #define MAJOR_NUM         100
 #define IOCTL_ConvertThreadToFiber  _IO(MAJOR_NUM, 0)
@@ -37,6 +252,38 @@ struct fls_args{
 
 #define IOCTL_FiberExit             _IO(MAJOR_NUM, 7)
 
+#define IOCTL_GetFiberStats         _IOWR(MAJOR_NUM, 8, struct fiber_stats_args *)
+
+#define IOCTL_SetPreemption         _IOW(MAJOR_NUM, 9, struct preempt_args *)
+
+// Hardware counters accounted to fibers, ORed into the argument of
+// IOCTL_EnablePerfCounters. They need a PMU, unlike faults and context
+// switches which are always accounted.
+#define FIBER_PERF_INSTRUCTIONS 0x1
+#define FIBER_PERF_CYCLES       0x2
+
+#define IOCTL_EnablePerfCounters    _IOW(MAJOR_NUM, 10, long)
+
+#define IOCTL_EnableFlightRecorder  _IOW(MAJOR_NUM, 11, long)
+
+// Returns the fid of the first fiber created, the others follow in order
+#define IOCTL_CreateFibers          _IOW(MAJOR_NUM, 12, struct fibers_args *)
+
+// fork() support. ForkPrepare is called by the forking thread right before
+// fork() and returns a sequence number, which the child passes to
+// ForkChild on a descriptor of its own to inherit the fibers of its parent.
+#define IOCTL_ForkPrepare           _IO(MAJOR_NUM, 13)
+#define IOCTL_ForkChild             _IOW(MAJOR_NUM, 14, long)
+
+// Cache affinity. SetFiberAffinity restricts the cpus a fiber may be
+// resumed on, GetFiberLastCpu returns the cpu it last ran on, -1 if it
+// never ran, for userspace schedulers to place it where its cache is warm.
+#define IOCTL_SetFiberAffinity      _IOW(MAJOR_NUM, 15, struct fiber_affinity_args *)
+#define IOCTL_GetFiberLastCpu       _IOW(MAJOR_NUM, 16, long)
+
+// Stack the running fiber was created with, for FIBER_SWITCH_MIGRATE
+#define IOCTL_GetFiberStack         _IOR(MAJOR_NUM, 17, struct fiber_stack_args *)
+
 
 #endif
 
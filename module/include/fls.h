@@ -0,0 +1,34 @@
+#ifndef FIBERS_FLS
+#define FIBERS_FLS
+
+#include "fibers.h"
+
+// Fiber Local Storage allocator.
+// Used slots are tracked in fls_used_bmp. Free slots are reached through
+// the free_ll linked list, whose nodes point to the beginning of free
+// areas; fls_pointed_bmp marks the slots pointed by a node.
+// These functions do not depend on the calling task, so they are also
+// built in userspace (see module/userspace).
+
+// Returns the index of a newly allocated slot, ERROR if the FLS is full.
+// The FLS is set up on first use.
+long fls_alloc          (struct fiber *f);
+
+// Returns ERROR if index was not allocated
+int  fls_free           (struct fiber *f, long index);
+
+// Non-zero if index is in range and currently allocated
+int  fls_is_allocated   (struct fiber *f, long index);
+
+// Releases all the FLS memory of f
+void fls_destroy        (struct fiber *f);
+
+// Gives dst, a copy of src, FLS of its own with the same contents.
+// Returns ERROR if out of memory, dst has no FLS then.
+int  fls_clone          (struct fiber *dst, const struct fiber *src);
+
+// Memory set up by the first fls_alloc of a fiber
+#define FLS_FOOTPRINT (sizeof(long long) * FLS_SIZE + \
+                       2 * BITS_TO_LONGS(FLS_SIZE) * sizeof(unsigned long))
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef FIBERS_FORK
+#define FIBERS_FORK
+
+#include "fibers.h"
+
+// fork() support. Right before forking, the process takes an image of its
+// registry (kernelForkPrepare) and the child adopts it (kernelForkChild).
+// Taking an image copies nothing but the fiber of the forking thread:
+//  - a fiber of the parent is copied into the images that miss it right
+//    before it next changes, that is when it is activated or freed, or
+//    when the parent exits (fork_before_change);
+//  - a fiber of the child is set up on its first activation, from the
+//    copy in the image or, if there is none, from the unchanged fiber of
+//    the parent (fork_lookup).
+// Fibers running on other threads when the image is taken are not
+// inherited, their state is not saved anywhere.
+
+// Fibers of the parent not inherited by the child of an image, and fibers
+// that went through a change since the image was taken
+struct fork_entry{
+
+    pid_t fid;
+    struct fork_copy *copy;     // NULL if the fiber is not inherited
+
+    struct hlist_node enext;
+};
+
+// State of a fiber when an image was taken, shared by every image that
+// needs it
+struct fork_copy{
+
+    int refs;
+    struct fiber *f;            // From fiber_dup(), not in any registry
+};
+
+#define FORK_CHILD_PENDING  0   // Not adopted yet
+#define FORK_CHILD_ATTACHED 1   // Adopted, fibers left to set up
+#define FORK_CHILD_GONE     2   // Every fiber set up, or child exited
+
+// Images not adopted yet kept per process, the oldest is dropped. A child
+// that never calls kernelForkChild would leak its image otherwise.
+#define FORK_PENDING_MAX    16
+
+struct fork_image{
+
+    pid_t tgid;                 // Parent process
+    u64 seq;                    // p->fork_seq of the parent when taken
+    struct process *parent;     // NULL once the parent exited
+    int child;                  // FORK_CHILD_*
+    int stale;                  // Fibers without entry are not inherited,
+                                // an entry could not be allocated
+
+    // Registry of the parent when the image was taken
+    pid_t last_fid;
+    pid_t fork_fid;             // Active fiber of the forking thread
+    pid_t home_fid;
+    pid_t sched_fid;
+    long  fibers;               // Inherited fibers
+
+    DECLARE_HASHTABLE(entries, 6);
+
+    struct fork_image *next;
+};
+
+void fork_preserve      (struct process *p, struct fiber *f);
+
+struct fiber *fork_materialize(struct process *p, pid_t fid);
+
+// Called by the parent before f changes, with f booked by the caller or
+// about to be freed.
+// The activation cmpxchg is a full barrier and pairs with the one taking
+// an image: either the image sees f active, or this sees the new seq.
+static inline void fork_before_change(struct process *p, struct fiber *f){
+
+    if(unlikely(READ_ONCE(f->fork_seq) != READ_ONCE(p->fork_seq)))
+        fork_preserve(p, f);
+}
+
+// Called when fid is not in the registry of p: sets up the inherited
+// fiber fid on its first use, NULL if p inherited no such fiber. Another
+// thread may have just set up the last one and dropped the image.
+static inline struct fiber *fork_lookup(struct process *p, pid_t fid){
+
+    if(likely(!READ_ONCE(p->fork_from))) return get_fiber_by_id(fid, p);
+
+    return fork_materialize(p, fid);
+}
+
+// Process cleanup: the parent side copies every fiber its images still
+// miss, the child side drops the image it adopted
+void fork_parent_exit   (struct process *p);
+void fork_child_exit    (struct process *p);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FIBERS_INSTRUMENT
+#define FIBERS_INSTRUMENT
+
+#include "common.h"
+#include <linux/jump_label.h>
+
+// Optional accounting on the switch path, behind static keys: a disabled
+// feature costs a patched-out jump. Both are on by default and switched at
+// runtime through the module parameters of the same name, e.g.
+//   echo N > /sys/module/main/parameters/fiber_stats
+//
+// fiber_stats:   per-fiber metrics (running time, run lengths, parked
+//                time, faults, context switches and perf counters), the
+//                generation bumps of incremental polling and the switch
+//                counters of the live stats page. While off they stay as
+//                they were, the first switch after turning them back on
+//                charges the whole gap to the fiber switched out.
+// latency_hist:  the ioctl latency histograms of /proc/fibers/<tgid>.
+
+DECLARE_STATIC_KEY_TRUE(fiber_stats_key);
+DECLARE_STATIC_KEY_TRUE(latency_hist_key);
+
+static inline bool fiber_stats_on(void){
+    return static_branch_likely(&fiber_stats_key);
+}
+
+static inline bool latency_hist_on(void){
+    return static_branch_likely(&latency_hist_key);
+}
+
+#endif
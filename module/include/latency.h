@@ -0,0 +1,70 @@
+#ifndef FIBERS_LATENCY
+#define FIBERS_LATENCY
+
+#include "fibers.h"
+#include "instrument.h"
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+
+// Per-process histograms of the time spent in the fibers ioctls, from entry
+// to exit. Buckets are log-linear, HDR-style: 8 per power of two, so every
+// value is reported within 12.5%, up to 2^34 ns (17 s) where the last
+// bucket catches everything above. Each cpu updates its own copy, readers
+// sum them up.
+
+#define LAT_SUB_BITS    3
+#define LAT_MAX_BITS    34
+#define LAT_BUCKETS     ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+// Measured calls
+#define LAT_SWITCH      0
+#define LAT_CREATE      1
+#define LAT_KINDS       2
+
+struct latency_hist{
+
+    u64 count[LAT_BUCKETS];
+    u64 total;
+    u64 sum;        // ns
+    u64 max;        // ns
+
+};
+
+struct latency_percpu{
+
+    struct latency_hist kind[LAT_KINDS];
+
+};
+
+// Set up and release the histograms of p, latency_alloc may sleep
+int  latency_alloc      (struct process *p);
+void latency_free       (struct process *p);
+
+void __latency_record   (struct process *p, int kind, u64 start_ns);
+
+// Start time of a call to measure, 0 while latency_hist is off
+static inline u64 latency_start(void){
+    return latency_hist_on() ? ktime_get_ns() : 0;
+}
+
+// Accounts a call of the given kind that started at start_ns
+// (latency_start()) and returns now. Called with the p the call itself
+// looked up, so measuring costs no lookup of its own.
+static inline void latency_record(struct process *p, int kind, u64 start_ns){
+    if(start_ns) __latency_record(p, kind, start_ns);
+}
+
+// Sums the per-cpu copies of a histogram into out
+void latency_sum        (struct process *p, int kind, struct latency_hist *out);
+
+// Zeroes every histogram of p, updates racing with it may be lost
+void latency_reset      (struct process *p);
+
+// Largest value falling in bucket b
+u64  latency_bucket_limit(int b);
+
+// Limit of the bucket holding the call of rank ppm/1000000 in h, 0 if h
+// is empty
+u64  latency_percentile (struct latency_hist *h, unsigned int ppm);
+
+#endif
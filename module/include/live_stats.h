@@ -0,0 +1,59 @@
+#ifndef FIBERS_LIVE_STATS
+#define FIBERS_LIVE_STATS
+
+#include "fibers.h"
+#include <linux/mm_types.h>
+
+// Live counters of a process (struct fiber_live_stats in fibers_driver.h),
+// kept in a page that monitoring processes map read-only and updated in
+// place. The gauges (fibers, threads, FLS) follow the seqcount protocol,
+// their writers are serialized by the live_lock of the process. The
+// monotonic counters, bumped by every switch, are added to atomically
+// without it, so that switches on different threads never wait on each
+// other.
+
+// Sets up the page of a new process, before it is published
+int  live_stats_alloc   (struct process *p);
+
+// Mappings of the page stay valid until unmapped
+void live_stats_free    (struct process *p);
+
+// Maps the page of process tgid into vma
+int  live_stats_mmap    (pid_t tgid, struct vm_area_struct *vma);
+
+static inline struct fiber_live_stats *live_stats_begin(struct process *p){
+
+    struct fiber_live_stats *s = p->live_stats;
+
+    if(!s) return NULL;
+
+    spin_lock(&(p->live_lock));
+    WRITE_ONCE(s->seq, s->seq + 1);
+    smp_wmb();
+
+    return s;
+}
+
+static inline void live_stats_end(struct process *p, struct fiber_live_stats *s){
+
+    smp_wmb();
+    WRITE_ONCE(s->seq, s->seq + 1);
+    spin_unlock(&(p->live_lock));
+}
+
+// Runs stmt on the gauges s of p, if it has them
+#define live_stats_update(p, s, stmt) do {                  \
+        struct fiber_live_stats *s = live_stats_begin(p);   \
+        if(s){                                              \
+            stmt;                                           \
+            live_stats_end(p, s);                           \
+        }                                                   \
+    } while(0)
+
+// Adds n to the monotonic counter field of p, if it has them
+#define live_stats_count(p, field, n) do {                                  \
+        struct fiber_live_stats *__s = (p)->live_stats;                     \
+        if(__s) atomic64_add((n), (atomic64_t *) &(__s->field));            \
+    } while(0)
+
+#endif
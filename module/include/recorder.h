@@ -0,0 +1,38 @@
+#ifndef FIBERS_RECORDER
+#define FIBERS_RECORDER
+
+#include "fibers.h"
+#include <linux/mm_types.h>
+
+// Flight recorder, an optional per-process ring of the last fiber events
+// (layout in fibers_driver.h) that monitoring processes map read-only.
+// Writers claim a slot with an atomic increment of the head and publish
+// it through its sequence number: recording never waits, old events are
+// overwritten.
+
+#define RECORDER_DEFAULT_EVENTS 4096
+#define RECORDER_MIN_EVENTS     256         // Writers racing on a slot would
+                                            // need a lap during one event
+#define RECORDER_MAX_EVENTS     (1 << 20)   // 32 MiB per process
+
+// Starts recording the events of p in a ring of at least events entries,
+// 0 for the default. A ring already in place is kept. May sleep.
+int  recorder_alloc (struct process *p, unsigned long events);
+
+// Stops recording, mappings of the ring stay valid until unmapped
+void recorder_free  (struct process *p);
+
+// Maps the ring of process tgid into vma
+int  recorder_mmap  (pid_t tgid, struct vm_area_struct *vma);
+
+void __recorder_log (struct fiber_recorder *r, int type, pid_t from, pid_t to);
+
+// Records an event of p, if its recorder is on
+static inline void recorder_log(struct process *p, int type, pid_t from, pid_t to){
+
+    struct fiber_recorder *r = READ_ONCE(p->recorder);
+
+    if(r) __recorder_log(r, type, from, to);
+}
+
+#endif
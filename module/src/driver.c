@@ -2,11 +2,172 @@
 #include "fibers_driver.h"
 #include "driver.h"
 #include "fibers.h"
+#include "latency.h"
+#include "recorder.h"
+#include "live_stats.h"
 
 #include <linux/slab.h>
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/ktime.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/ptrace.h>
+#include <linux/sched/task.h>
+
+
+// Whoever may ptrace a process may map its shared areas and read the
+// stats of its fibers
+static int device_may_map(pid_t tgid)
+{
+    struct task_struct *task;
+    int allowed;
+
+    rcu_read_lock();
+    task = pid_task(find_pid_ns(tgid, &init_pid_ns), PIDTYPE_PID);
+    if(task) get_task_struct(task);
+    rcu_read_unlock();
+
+    if(!task) return 0;
+
+    allowed = ptrace_may_access(task, PTRACE_MODE_READ_FSCREDS);
+    put_task_struct(task);
+
+    return allowed;
+}
+
+// Upper bound on the number of records returned by a single
+// IOCTL_GetFiberStats, bigger processes are paged through fid ranges.
+#define FIBER_STATS_MAX_BATCH 65536
+
+static long device_get_fiber_stats(unsigned long ioctl_param){
+
+    struct fiber_stats_args sargs;
+    struct fiber_stats *kbuf;
+    long capacity, count, i;
+    size_t entry_copy;
+    u64 generation;
+
+    if(!access_ok(VERIFY_WRITE, ioctl_param, sizeof(struct fiber_stats_args))){
+        log("GetFiberStats, invalid ioctl_param\n");
+        return -EFAULT;
+    }
+
+    if(copy_from_user(&sargs, (void __user *) ioctl_param, sizeof(struct fiber_stats_args))){
+        log("GetFiberStats, error Unable to copy_from_user");
+        return -EFAULT;
+    }
+
+    if(sargs.entry_size <= 0 || sargs.capacity < 0){
+        dbg("GetFiberStats, invalid entry_size %ld or capacity %ld\n", sargs.entry_size, sargs.capacity);
+        return -EINVAL;
+    }
+
+    if(!sargs.tgid) sargs.tgid = current->tgid;
+    if(sargs.tgid != current->tgid && !device_may_map(sargs.tgid)){
+        dbg("GetFiberStats, %d may not read the stats of %d\n", current->tgid, sargs.tgid);
+        return -EACCES;
+    }
+
+    capacity = min_t(long, sargs.capacity, FIBER_STATS_MAX_BATCH);
+
+    if(!access_ok(VERIFY_WRITE, sargs.buf, capacity * sargs.entry_size)){
+        log("GetFiberStats, invalid user buffer\n");
+        return -EFAULT;
+    }
+
+    kbuf = NULL;
+    if(capacity > 0){
+        kbuf = vmalloc(capacity * sizeof(struct fiber_stats));
+        if(!kbuf){
+            log("GetFiberStats, error allocating %ld records\n", capacity);
+            return -ENOMEM;
+        }
+    }
+
+    count = kernelGetFiberStats(sargs.tgid, sargs.fid_from, sargs.fid_to,
+                                sargs.since_generation, kbuf, capacity,
+                                &sargs.total, &generation);
+    if(count < 0){
+        vfree(kbuf);
+        return count;
+    }
+
+    // Records are appended to over time, only copy the part both sides know
+    entry_copy = min_t(size_t, sargs.entry_size, sizeof(struct fiber_stats));
+
+    if(sargs.entry_size == sizeof(struct fiber_stats)){
+        if(copy_to_user(sargs.buf, kbuf, count * sizeof(struct fiber_stats))) count = -EFAULT;
+    } else {
+        for(i = 0; i < count; i++){
+            if(copy_to_user((char __user *) sargs.buf + i * sargs.entry_size, &kbuf[i], entry_copy)){
+                count = -EFAULT;
+                break;
+            }
+        }
+    }
+
+    vfree(kbuf);
+
+    if(count < 0){
+        log("GetFiberStats, error Unable to copy_to_user");
+        return -EFAULT;
+    }
+
+    sargs.generation = generation;
+    sargs.count = count;
+
+    if(copy_to_user((void __user *) ioctl_param, &sargs, sizeof(struct fiber_stats_args))){
+        log("GetFiberStats, error Unable to copy_to_user");
+        return -EFAULT;
+    }
+
+    return count;
+}
+
+
+static long device_create_fibers(unsigned long ioctl_param){
+
+    struct fibers_args bargs;
+    void **params;
+    long ret;
+
+    if(!access_ok(VERIFY_READ, ioctl_param, sizeof(struct fibers_args))){
+        log("CreateFibers, invalid ioctl_param\n");
+        return -EFAULT;
+    }
+
+    if(copy_from_user(&bargs, (void __user *) ioctl_param, sizeof(struct fibers_args))){
+        log("CreateFibers, error Unable to copy_from_user");
+        return -EFAULT;
+    }
+
+    if(bargs.count <= 0 || bargs.count > FIBERS_BULK_MAX){
+        dbg("CreateFibers, invalid count %d\n", bargs.count);
+        return -EINVAL;
+    }
+
+    params = vmalloc(bargs.count * sizeof(void *));
+    if(!params){
+        log("CreateFibers, error allocating %d parameters\n", bargs.count);
+        return -ENOMEM;
+    }
+
+    if(copy_from_user(params, (void __user *) bargs.fn_params, bargs.count * sizeof(void *))){
+        log("CreateFibers, error Unable to copy_from_user");
+        vfree(params);
+        return -EFAULT;
+    }
+
+    ret = kernelCreateFibers(current->tgid, current->pid, bargs.count,
+                             bargs.user_fn, params, bargs.stack_region,
+                             bargs.stack_stride, bargs.stack_size, bargs.node);
+
+    vfree(params);
+    return ret;
+}
 
 
 long int device_ioctl(
@@ -17,6 +178,10 @@ long int device_ioctl(
     struct fiber_args fargs;
     long ret;
     struct fls_args flsargs;
+    struct preempt_args pargs;
+    struct fiber_affinity_args aargs;
+    struct fiber_stack_args stargs;
+    u64 start;
 
     switch (ioctl_num) {
         
@@ -25,29 +190,35 @@ long int device_ioctl(
             break;
         
         case IOCTL_CreateFiber:
-            
+            start = latency_start();
+
             if(!access_ok(VERIFY_READ,ioctl_param,sizeof(struct fiber_args))){
                 log("CreateFiber, invalid ioctl_param\n");
-                return ERROR;
+                return -EFAULT;
             }
 
             if(copy_from_user(&fargs, (void*) ioctl_param, sizeof(struct fiber_args))){
                 log("CreateFiber, error Unable to copy_from_user");
-                return ERROR;
+                return -EFAULT;
             }
  
-            return  kernelCreateFiber(
+            ret = kernelCreateFiber(
                 fargs.user_fn,
                 fargs.fn_params,
                 current->tgid,
                 current->pid,
                 fargs.stack_base,
-                fargs.stack_size);
+                fargs.stack_size,
+                fargs.node,
+                start);
+            return ret;
 
             break;
 
         case IOCTL_SwitchToFiber:
-            return kernelSwitchToFiber(current->tgid, current->pid, (pid_t) ioctl_param );
+            start = latency_start();
+            ret = kernelSwitchToFiber(current->tgid, current->pid, (pid_t) ioctl_param, start);
+            return ret;
             break;
         
         
@@ -63,72 +234,164 @@ long int device_ioctl(
         
             if(!access_ok(VERIFY_READ, ioctl_param, sizeof(struct fls_args))){
                 log("FlsGetValue, invalid ioctl_param\n");
-                return ERROR;
+                return -EFAULT;
             }
             if(!access_ok(VERIFY_WRITE, ioctl_param, sizeof(struct fls_args))){
                 log("FlsGetValue, invalid ioctl_param\n");
-                return ERROR;
+                return -EFAULT;
             }
 
             if(copy_from_user(&flsargs, (void __user *) ioctl_param, sizeof(struct fls_args))){
                 log("FlsGetValue, error Unable to copy_from_user");
-                return ERROR;
+                return -EFAULT;
             }
             
-            ret =  kernelFlsGetValue(current->tgid, current->pid, (long) flsargs.index );
-            
-            log("*****************!!!!!!!!!!!!!!!!!!GETVALUE RET:%ld",ret);
-            flsargs.value = ret;
+            ret =  kernelFlsGetValue(current->tgid, current->pid, (long) flsargs.index, &flsargs.value );
+            if(ret) return ret;
             
             if(copy_to_user((void *) ioctl_param, &flsargs, sizeof(struct fls_args))){
                 log("FlsGetValue, error Unable to copy_to_user");
-                return ERROR;
+                return -EFAULT;
             }
             return SUCCESS;
-            //return kernelFlsGetValue(current->tgid, current->pid, (long) ioctl_param );
             break;
             
         case IOCTL_FlsSetValue:
         
             if(!access_ok(VERIFY_READ, ioctl_param, sizeof(struct fls_args))){
                 log("FlsSetValue, invalid ioctl_param\n");
-                return ERROR;
+                return -EFAULT;
             }
 
             if(copy_from_user(&flsargs, (void*) ioctl_param, sizeof(struct fls_args))){
                 log("FlsSetValue, error Unable to copy_from_user");
-                return ERROR;
+                return -EFAULT;
             }
             
             return kernelFlsSetValue(current->tgid, current->pid, flsargs.index, flsargs.value );
             break;
             
         case IOCTL_FiberExit:
-            log("[%d->%d] FiberExit was called", current->tgid, current->pid);
+            dbg("[%d->%d] FiberExit was called", current->tgid, current->pid);
             return kernelFiberExit(current->tgid, current->pid);
             break;
+
+        case IOCTL_GetFiberStats:
+            return device_get_fiber_stats(ioctl_param);
+            break;
+
+        case IOCTL_SetPreemption:
+
+            if(!access_ok(VERIFY_READ, ioctl_param, sizeof(struct preempt_args))){
+                log("SetPreemption, invalid ioctl_param\n");
+                return -EFAULT;
+            }
+
+            if(copy_from_user(&pargs, (void __user *) ioctl_param, sizeof(struct preempt_args))){
+                log("SetPreemption, error Unable to copy_from_user");
+                return -EFAULT;
+            }
+
+            return kernelSetPreemption(current->tgid, current->pid,
+                pargs.slice_ns,
+                pargs.sched_fid,
+                (int __user *) pargs.critical);
+            break;
+
+        case IOCTL_EnablePerfCounters:
+            return kernelEnablePerfCounters(current->tgid, current->pid, (unsigned int) ioctl_param);
+            break;
+
+        case IOCTL_EnableFlightRecorder:
+            return kernelEnableFlightRecorder(current->tgid, current->pid, ioctl_param);
+            break;
+
+        case IOCTL_CreateFibers:
+            return device_create_fibers(ioctl_param);
+            break;
+
+        case IOCTL_ForkPrepare:
+            return kernelForkPrepare(current->tgid, current->pid);
+            break;
+
+        case IOCTL_ForkChild:
+            return kernelForkChild(current->tgid, current->pid, (u64) ioctl_param);
+            break;
+
+        case IOCTL_SetFiberAffinity:
+            if(copy_from_user(&aargs, (void __user *) ioctl_param, sizeof(struct fiber_affinity_args))){
+                log("SetFiberAffinity, error Unable to copy_from_user");
+                return -EFAULT;
+            }
+
+            return kernelSetFiberAffinity(current->tgid, current->pid,
+                aargs.fid,
+                (const unsigned long __user *) aargs.mask,
+                aargs.size);
+            break;
+
+        case IOCTL_GetFiberLastCpu:
+            return kernelGetFiberLastCpu(current->tgid, (pid_t) ioctl_param);
+            break;
+
+        case IOCTL_GetFiberStack:
+            ret = kernelGetFiberStack(current->tgid, current->pid, &stargs);
+            if(ret) return ret;
+
+            if(copy_to_user((void __user *) ioctl_param, &stargs, sizeof(struct fiber_stack_args))){
+                log("GetFiberStack, error Unable to copy_to_user");
+                return -EFAULT;
+            }
+            return SUCCESS;
+            break;
   }
 
-  return SUCCESS;
+  return -ENOTTY;
 
 }
 
 static int device_open(struct inode *inode, 
                        struct file *file)
 {
-    if(!try_module_get(THIS_MODULE)) return ERROR;
+    if(!try_module_get(THIS_MODULE)) return -ENODEV;
+
+    // A forked child shares the file until it opens its own, the last
+    // close may come from either process
+    file->private_data = (void *) (long) current->tgid;
     return SUCCESS;
 }
 
 static int device_release(struct inode *inode, 
                           struct file *file)
 {  
-    kernelProcCleanup(current->tgid);
+    kernelProcCleanup((pid_t) (long) file->private_data);
 
     module_put(THIS_MODULE); 
     return SUCCESS;
 }
 
+// Maps one of the areas shared read-only with monitoring processes,
+// selected by the offset (FIBERS_MMAP_PGOFF in fibers_driver.h)
+static int device_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    pid_t tgid = vma->vm_pgoff >> FIBERS_MMAP_REGION_BITS;
+    int region = vma->vm_pgoff & ((1 << FIBERS_MMAP_REGION_BITS) - 1);
+
+    if(vma->vm_flags & VM_WRITE) return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    if(!device_may_map(tgid)) return -EACCES;
+
+    switch(region){
+        case FIBERS_MMAP_RECORDER:
+            return recorder_mmap(tgid, vma);
+        case FIBERS_MMAP_STATS:
+            return live_stats_mmap(tgid, vma);
+    }
+
+    return -EINVAL;
+}
+
 /* This function is called whenever a process which 
  * has already opened the device file attempts to 
  * read from it. */
@@ -151,6 +414,7 @@ static ssize_t device_read(
 static struct file_operations Fops = {
   .read    = device_read, 
   .unlocked_ioctl   = device_ioctl,   
+  .mmap    = device_mmap,
   .open    = device_open,
   .release =device_release 
 };
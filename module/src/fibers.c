@@ -1,321 +1,1078 @@
 #include "fibers.h"
+#include "fibers_proc.h"
+#include "fls.h"
+#include "latency.h"
+#include "recorder.h"
+#include "live_stats.h"
+#include "fork.h"
+#include "instrument.h"
 #include <asm/fpu/types.h>
 #include <asm/fpu/internal.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/task_work.h>
+#include <linux/sched/task.h>
+#include <linux/uaccess.h>
+#include <linux/perf_event.h>
 
-DEFINE_HASHTABLE(processes,6);
-DEFINE_SPINLOCK(processes_lock); // processes hashtable spinlock.(RW LOCK?)
 
-inline struct process * get_process_by_id(pid_t tgid){
+// Number of consecutive activations on the same remote node after which a
+// fiber is asked to move its stack there, 0 never migrates.
+static unsigned int numa_migrate_after = 0;
+module_param(numa_migrate_after, uint, 0644);
+MODULE_PARM_DESC(numa_migrate_after, "Remote activations in a row before a fiber stack migrates, 0 to disable");
 
-    struct process *p;
 
-    hash_for_each_possible_rcu(processes, p, pnext, tgid){
-        if(p==NULL) break;
-        if(p->tgid==tgid) break;
+void freeFiber(struct process *p, struct fiber *f);
+// Stack high-water mark from the sp saved into f: only the switches are
+// sampled, so deeper calls made in between go unnoticed. A converted
+// thread has no stack of ours, and a fiber may be running on some other
+// stack of its own.
+static void fiber_account_stack(struct fiber *f){
+
+    unsigned long used = (unsigned long) f->stack_base + f->stack_size - f->pt_regs.sp;
+
+    if(f->stack_base && used <= f->stack_size && used > f->info->stack_hwm)
+        f->info->stack_hwm = used;
+}
+
+static long switch_fibers(struct process *p, struct thread *t, struct fiber *src_f, struct fiber *dst_f, long ret);
+static enum hrtimer_restart slice_expired(struct hrtimer *timer);
+static void thread_snapshot_counters(struct thread *t);
+
+// Whether f may be resumed on the current cpu. A fiber pinned elsewhere is
+// left to the caller, which knows on which of its threads to resume it.
+static inline int fiber_cpu_allowed(struct fiber *f){
+
+    struct cpumask *mask = READ_ONCE(f->affinity);
+
+    return !mask || cpumask_test_cpu(raw_smp_processor_id(), mask);
+}
+
+// Accounts an activation of f on the current node, returns 1 if the stack
+// of f should be moved to the current node.
+// On single-node machines every activation is local.
+static int fiber_account_node(struct fiber *f){
+
+    int node = numa_node_id();
+
+    f->last_node = node;
+
+    if(node == f->node){
+        f->local_activations++;
+        f->remote_streak = 0;
+        return 0;
     }
 
-    return p;
+    f->remote_activations++;
+    if(node != f->remote_node){
+        f->remote_node = node;
+        f->remote_streak = 0;
+    }
+    f->remote_streak++;
+
+    // Threads converted to fiber keep the stack they were born with, and
+    // a fiber starting afresh does not return from SwitchToFiber
+    if(!numa_migrate_after || !f->stack_base || f->activations == 1 ||
+       f->remote_streak < numa_migrate_after)
+        return 0;
+
+    dbg("Fiber %d resumed %u times in a row on node %d, migrating its stack\n", f->fid, f->remote_streak, node);
+
+    // The resumed fiber moves its own stack, from now on node is home
+    f->node = node;
+    f->remote_streak = 0;
+    return 1;
 }
 
-inline struct thread * get_thread_by_id(pid_t pid, struct process * p){
+// Fpu state
+//
+// Only the fxsave area is switched, so a fiber needs 512 bytes of it
+// rather than a whole struct fpu sized for the largest xstate. The buffer
+// is allocated on the first switch that saves or loads it: fibers that
+// never ran have none, a fiber converted from a thread gets it when it is
+// first switched out.
 
-    struct thread *t;
+static struct kmem_cache *fxregs_cache;
+
+// copy_fxregs_to_kernel() on x86_64, for a buffer outside of a struct fpu
+static inline void fxregs_save(struct fxregs_state *fx){
+    asm volatile("fxsaveq %[fx]" : [fx] "=m" (*fx));
+}
+
+// Keeps the floating point control words of the caller, which the user
+// state still holds during the ioctl
+static void fiber_save_control(struct fiber *f){
+    asm volatile("stmxcsr %0" : "=m" (f->info->mxcsr));
+    asm volatile("fnstcw %0" : "=m" (f->info->fcw));
+}
+
+// Gives src_f a buffer to save into and dst_f a state to load, a fiber
+// that never ran starts from the control words of its creator with empty
+// registers. Called before anything of the switch is done.
+static int fiber_fpu_prepare(struct fiber *src_f, struct fiber *dst_f){
 
-    hash_for_each_possible_rcu(p->threads, t, tnext, pid){
-        if(t==NULL) break;
-        if(t->pid==pid) break;
+    if(unlikely(!src_f->fxregs)){
+        src_f->fxregs = kmem_cache_alloc_node(fxregs_cache, GFP_KERNEL, src_f->node);
+        if(!src_f->fxregs) goto fail;
     }
 
-    return t;
+    if(unlikely(!dst_f->fxregs)){
+        dst_f->fxregs = kmem_cache_alloc_node(fxregs_cache, GFP_KERNEL | __GFP_ZERO, dst_f->node);
+        if(!dst_f->fxregs) goto fail;
+        dst_f->fxregs->cwd = dst_f->info->fcw;
+        dst_f->fxregs->mxcsr = dst_f->info->mxcsr;
+    }
+
+    return SUCCESS;
+
+fail:
+    log("Error allocating the fpu state of fiber %d or %d\n", src_f->fid, dst_f->fid);
+    return -ENOMEM;
 }
 
-inline struct fiber * get_fiber_by_id(pid_t fid, struct process * p){
+struct fiber *fiber_alloc(int node){
 
     struct fiber *f;
 
-    hash_for_each_possible_rcu(p->fibers, f, fnext, fid){
-        if(f==NULL) break;
-        if(f->fid==fid) break;
+    f = kmalloc_node(sizeof(struct fiber), GFP_KERNEL, node);
+    if(!f) return NULL;
+
+    f->info = kzalloc_node(sizeof(struct fiber_info), GFP_KERNEL, node);
+    if(!f->info){
+        kfree(f);
+        return NULL;
     }
+    f->fxregs = NULL;
+    f->affinity = NULL;
 
     return f;
 }
 
-void freeFiber(struct fiber *f);
+void fiber_release(struct fiber *f){
 
-pid_t kernelConvertThreadToFiber(pid_t tgid,pid_t pid){
-    struct process *p;
-    struct thread  *t;
-    struct fiber   *f;
+    if(f->fxregs) kmem_cache_free(fxregs_cache, f->fxregs);
+    kfree(f->info->affinity_buf);
+    kfree(f->info);
+    kfree(f);
+}
 
-    unsigned long flags;
+static void fiber_release_cb(struct rcu_head *rcu){
+    fiber_release(container_of(rcu, struct fiber, rcu));
+}
 
-    log("kernelConvertThreadToFiber tgid:%d, pid:%d\n",tgid,pid);
+void fiber_release_rcu(struct fiber *f){
+    call_rcu(&(f->rcu), fiber_release_cb);
+}
 
+// Copies src into dst, both from fiber_alloc, dst keeps its fpu state
+static void fiber_copy(struct fiber *dst, const struct fiber *src){
 
-    // Access bucket with key tgid and search for the struct process
-    spin_lock_irqsave(&processes_lock,flags);
+    struct fiber_info *info = dst->info;
+    struct fxregs_state *fxregs = dst->fxregs;
+    struct cpumask *affinity_buf = info->affinity_buf;
 
-    p = get_process_by_id(tgid);
+    memcpy(dst, src, sizeof(struct fiber));
+    memcpy(info, src->info, sizeof(struct fiber_info));
+    dst->info = info;
+    dst->fxregs = fxregs;
+    dst->info->affinity_buf = affinity_buf;
+    dst->affinity = NULL;
+}
 
-    if(!p){    // First thread of process that is going to be
-                    //converted to Fiber.
-        dbg("There was no process %d in the hashtable, lets create one.\n",tgid);
+struct fiber *fiber_dup(const struct fiber *src, int node){
 
-        p= kmalloc(sizeof(struct process),GFP_KERNEL);
-        if(!p){
-            log("ConvertThreadToFiber, error allocating struct process.\n");
-            return ERROR;
+    struct fiber *f;
+
+    f = fiber_alloc(node);
+    if(!f) goto fail;
+
+    fiber_copy(f, src);
+
+    if(src->fxregs){
+        f->fxregs = kmem_cache_alloc_node(fxregs_cache, GFP_KERNEL, node);
+        if(!f->fxregs){
+            fiber_release(f);
+            goto fail;
         }
+        memcpy(f->fxregs, src->fxregs, sizeof(struct fxregs_state));
+    }
 
-        p->tgid = tgid;
-        atomic_set(&(p->last_fid),0);
-        hash_init(p->fibers);
-        hash_init(p->threads);
-        hash_add_rcu(processes,&(p->pnext),p->tgid);
+    if(src->info->affinity_buf){
+        f->info->affinity_buf = kmalloc_node(cpumask_size(), GFP_KERNEL, node);
+        if(!f->info->affinity_buf){
+            fiber_release(f);
+            goto fail;
+        }
+        cpumask_copy(f->info->affinity_buf, src->info->affinity_buf);
+        if(READ_ONCE(src->affinity)) f->affinity = f->info->affinity_buf;
+    }
 
+    if(fls_clone(f, src)){
+        fiber_release(f);
+        goto fail;
     }
 
+    return f;
+
+fail:
+    log("Error copying fiber %d\n", src->fid);
+    return NULL;
+}
+
+// Serializes the creation of processes, which sleeps: a process is only
+// published once its /proc directory exists
+static DEFINE_MUTEX(process_create_mutex);
+
+struct process *process_get_or_create(pid_t tgid){
+
+    struct process *p;
+
+    unsigned long flags;
+
+    p = get_process_by_id(tgid);
+    if(p) return p;
+
+    mutex_lock(&process_create_mutex);
+
+    // Another thread of the process may have been converted meanwhile
+    p = get_process_by_id(tgid);
+    if(p) goto out;
+
+    // First thread of process that is going to be converted to Fiber.
+    dbg("There was no process %d in the hashtable, lets create one.\n",tgid);
+
+    p= kmalloc(sizeof(struct process),GFP_KERNEL);
+    if(!p){
+        log("ConvertThreadToFiber, error allocating struct process.\n");
+        goto out;
+    }
+
+    p->tgid = tgid;
+    atomic_set(&(p->last_fid),0);
+    atomic64_set(&(p->generation),0);
+    p->slice_ns = 0;
+    p->perf_flags = 0;
+    p->latency = NULL;
+    p->recorder = NULL;
+    spin_lock_init(&(p->fibers_lock));
+    p->exited = NULL;
+    p->exited_count = 0;
+    p->exited_horizon = 0;
+    if(live_stats_alloc(p)){
+        kfree(p);
+        p = NULL;
+        goto out;
+    }
+    p->fork_seq = 0;
+    p->fork_from = NULL;
+    p->fork_pending = NULL;
+    hash_init(p->fibers);
+    hash_init(p->threads);
+    p->proc_dir = NULL;
+
+    // Percpu allocations and /proc registration may sleep, do them
+    // before taking the spinlock
+    latency_alloc(p);
+    fibers_proc_add_process(p);
+
+    spin_lock_irqsave(&processes_lock,flags);
+    hash_add_rcu(processes,&(p->pnext),p->tgid);
     spin_unlock_irqrestore(&processes_lock,flags);
 
+out:
+    mutex_unlock(&process_create_mutex);
+    return p;
+}
+
+struct thread *thread_create(struct process *p, pid_t pid, int node){
+
+    struct thread *t;
+
     // Create a new thread struct only if it hadn't been created yet
     t = get_thread_by_id(pid, p);
 
     if(t){ // thread already was a fiber
         dbg("Error converting thread %d to fiber, it already exists in p->threads.\n",pid);
-        return ERROR;
+        return ERR_PTR(-EEXIST);
     }
 
-    t= kmalloc(sizeof(struct thread),GFP_KERNEL);
+    t= kmalloc_node(sizeof(struct thread),GFP_KERNEL,node);
     if(!t) {
         log("ConvertThreadToFiber, error allocating struct thread.\n");
-        return ERROR;
+        return ERR_PTR(-ENOMEM);
     }
 
 
     t->pid=pid;
-    //t->active_fid is set below
+    //t->active_fid, t->home_fid and t->sched_fid are set by the caller
+    t->critical = NULL;
+    t->task = current;
+    get_task_struct(t->task);
+    hrtimer_init(&(t->slice_timer), CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    t->slice_timer.function = slice_expired;
+    t->slice_end = 0;
+    atomic_set(&(t->preempt_pending), 0);
+    thread_snapshot_counters(t);
+    memset(t->perf, 0, sizeof(t->perf));
+    t->perf_failed = 0;
+
+    spin_lock(&(p->fibers_lock));
     hash_add_rcu(p->threads,&(t->tnext),t->pid);
+    spin_unlock(&(p->fibers_lock));
+
+    return t;
+}
+
+void thread_release(struct process *p, struct thread *t){
+
+    int i;
+
+    // Expiries already queued find no thread and do nothing
+    hrtimer_cancel(&(t->slice_timer));
+    put_task_struct(t->task);
+
+    for(i=0; i<FIBER_PERF_COUNTERS; i++)
+        if(t->perf[i]) perf_event_release_kernel(t->perf[i]);
+
+    spin_lock(&(p->fibers_lock));
+    hash_del_rcu(&(t->tnext));
+    spin_unlock(&(p->fibers_lock));
+
+    kfree_rcu(t, rcu);
+}
+
+pid_t kernelConvertThreadToFiber(pid_t tgid,pid_t pid){
+    struct process *p;
+    struct thread  *t;
+    struct fiber   *f;
+
+    int node = numa_node_id();
+
+    log("kernelConvertThreadToFiber tgid:%d, pid:%d\n",tgid,pid);
+
+    p = process_get_or_create(tgid);
+    if(!p) return -ENOMEM;
+
+    t = thread_create(p, pid, node);
+    if(IS_ERR(t)) return PTR_ERR(t);
 
 
     // Create a new fiber, activated by this thread.
-    f= kmalloc(sizeof(struct fiber), GFP_KERNEL);
+    f= fiber_alloc(node);
+    if(!f){
+        log("ConvertThreadToFiber, error allocating struct fiber.\n");
+        return -ENOMEM;
+    }
 
     atomic_set(&(f->active_pid),pid);
 
     f->stack_base = NULL; // A Fiber created from an existing Thread
     f->stack_size = 0;    // has not a newly allocated stack
+    fiber_save_control(f);
 
     f->fid = atomic_fetch_inc(&(p->last_fid));
-    snprintf(f->name,30,"%d",f->fid);
+    snprintf(f->info->name, sizeof(f->info->name), "%d", f->fid);
+    f->fork_seq = 0;
 
     t->active_fid = f->fid;
+    t->home_fid   = f->fid;
+    t->sched_fid  = f->fid;
 
     // FLS management
     f->used_fls = 0;
 
-    f->entry_point = (void*) task_pt_regs(current)->ip;
-    f->parent = pid;
+    f->info->entry_point = (void*) task_pt_regs(current)->ip;
+    f->info->parent = pid;
     f->activations = 1;
-    atomic_long_set(&(f->failed_activations), 0);
-    f->total_running_time = 0;
-    f->last_activation_time = current->utime;   // this fiber starts living now
+    atomic_long_set(&(f->info->failed_activations), 0);
+    f->info->total_running_time = 0;
+    f->info->last_activation_time = current->utime;   // this fiber starts living now
                                                 // and is already scheduled
+    f->info->switch_in_ns = ktime_get_ns();
+    f->last_cpu = raw_smp_processor_id();
+    f->last_pid = pid;
+    f->info->generation = atomic64_inc_return(&(p->generation));
+
+    f->node = node;
+    f->last_node = node;
+    f->local_activations = 1;
+    f->remote_activations = 0;
+    f->remote_node = NUMA_NO_NODE;
+    f->remote_streak = 0;
+
+    f->preempted = 0;
+    f->info->preemptions = 0;
+    f->info->min_flt = 0;
+    f->info->maj_flt = 0;
+    f->info->nvcsw = 0;
+    f->info->nivcsw = 0;
+    memset(f->info->perf, 0, sizeof(f->info->perf));
+    f->info->switch_out_ns = 0;
+    f->info->max_run_ns = 0;
+    memset(f->info->run_hist, 0, sizeof(f->info->run_hist));
+    f->info->parked_ns = 0;
+    f->info->stack_hwm = 0;
+    f->info->cpu_migrations = 0;
+    f->info->thread_migrations = 0;
 
 
     dbg("A new fiber with fid %d is created, with active_pid %d\n",f->fid,atomic_read(&(f->active_pid)));
 
+    spin_lock(&(p->fibers_lock));
     hash_add_rcu(p->fibers,&(f->fnext),f->fid);
+    spin_unlock(&(p->fibers_lock));
 
-    return f->fid;
-}
-
-pid_t kernelCreateFiber(long user_fn, void *param, pid_t tgid,pid_t pid, void *stack_base, size_t stack_size){
+    fibers_proc_add_fiber(p, f);
 
+    live_stats_update(p, s, {
+        s->threads++;
+        s->fibers++;
+    });
+    live_stats_count(p, created, 1);
 
-    struct process *p;
-    struct thread  *t;
-    struct fiber   *f;
-
-    log("kernelCreateFiber\n");
-
-    // Check if struct process with given tgid exists or
-    p = get_process_by_id(tgid);
-    if(!p){
-        dbg("Error creating fiber, process %d still not created into processes hashtable",tgid);
-        return ERROR;
-    }
+    return f->fid;
+}
 
-    // Check if struct thread with given pid exists
-    t = get_thread_by_id(pid, p);
-    if(!t){
-        dbg("Error creating fiber, thread %d still not created into %d->threads",pid,tgid);
-        return ERROR;
-    }
+// Sets up f as a fiber created by thread pid on node, that has
+// never run, with the cpu context of the caller. Its fid, entry point and
+// stack are set by fiber_set_entry().
+static void fiber_init_created(struct fiber *f, pid_t pid, int node){
 
-    // Create a new struct fiber with given function and stack
     // Initially registers are not set because they are needed to store
     // data when a running fiber is scheduled out, only rip is set.
+    atomic_set(&(f->active_pid),0);
 
-    f= kmalloc(sizeof(struct fiber),GFP_KERNEL);
-    if(!f){
-        log("CreateFiber, error allocating struct fiber");
-        return ERROR;
+    memcpy(&(f->pt_regs), task_pt_regs(current), sizeof(struct pt_regs));
+    fiber_save_control(f);
+
+    /*
+    // Set return address
+    if(copy_to_user((void*)f->pt_regs.bp, &FiberExit, sizeof(void *))){
+        dbg("CreateFiber, error could not write in user stack");
     }
+    */
+    
+    // FLS management
+    f->used_fls = 0;
 
-    f->fid = atomic_fetch_inc(&(p->last_fid)) ;
-    snprintf(f->name,30,"%d",f->fid);
+    // Additional metrics
+    f->info->parent = pid;
+    f->activations = 0;
+    atomic_long_set(&(f->info->failed_activations), 0);
+    f->info->total_running_time = 0;
+    f->info->last_activation_time = 0;    // Gets updated upon switching into it
+    f->info->switch_in_ns = 0;
+    f->last_cpu = -1;
+    f->last_pid = 0;
+
+    f->node = node;
+    f->last_node = NUMA_NO_NODE;
+    f->local_activations = 0;
+    f->remote_activations = 0;
+    f->remote_node = NUMA_NO_NODE;
+    f->remote_streak = 0;
+
+    f->preempted = 0;
+    f->info->preemptions = 0;
+    f->info->min_flt = 0;
+    f->info->maj_flt = 0;
+    f->info->nvcsw = 0;
+    f->info->nivcsw = 0;
+    memset(f->info->perf, 0, sizeof(f->info->perf));
+    f->info->switch_out_ns = 0;
+    f->info->max_run_ns = 0;
+    memset(f->info->run_hist, 0, sizeof(f->info->run_hist));
+    f->info->parked_ns = 0;
+    f->info->stack_hwm = 0;
+    f->info->cpu_migrations = 0;
+    f->info->thread_migrations = 0;
+
+    f->fork_seq = 0;
+}
 
-    atomic_set(&(f->active_pid),0);
+static void fiber_set_entry(struct fiber *f, pid_t fid, long user_fn, void *param, void *stack_base, size_t stack_size){
+
+    f->fid = fid;
+    snprintf(f->info->name, sizeof(f->info->name), "%d", f->fid);
 
     f->stack_base = stack_base;
     f->stack_size = stack_size;
 
-    memcpy(&(f->pt_regs), task_pt_regs(current), sizeof(struct pt_regs));
-    copy_fxregs_to_kernel(&(f->fpu));
-    
-     
     f->pt_regs.ip = (long) user_fn;
-    f->entry_point = (void *) f->pt_regs.ip;
+    f->info->entry_point = (void *) f->pt_regs.ip;
     //f->pt_regs.cx = (long) user_fn;
     f->pt_regs.di = (long) param;
     f->pt_regs.sp = (long) (stack_base + stack_size) - 8;
     
     f->pt_regs.bp = f->pt_regs.sp;
-    
-    /*
-    // Set return address
-    if(copy_to_user((void*)f->pt_regs.bp, &FiberExit, sizeof(void *))){
-        dbg("CreateFiber, error could not write in user stack");
+}
+
+// Checks the arguments shared by kernelCreateFiber and kernelCreateFibers,
+// resolves NUMA_NO_NODE to the node of the caller
+static int create_check(pid_t tgid, pid_t pid, struct process **p, struct thread **t, int *node){
+
+    // Check if struct process with given tgid exists or
+    *p = get_process_by_id(tgid);
+    if(!*p){
+        dbg("Error creating fiber, process %d still not created into processes hashtable",tgid);
+        return -ESRCH;
     }
-    */
-    
-    // FLS management
-    f->used_fls = 0;
 
-    // Additional metrics
-    f->parent = pid;
-    f->activations = 0;
-    atomic_long_set(&(f->failed_activations), 0);
-    f->total_running_time = 0;
-    f->last_activation_time = 0;    // Gets updated upon switching into it
+    // Check if struct thread with given pid exists
+    *t = get_thread_by_id(pid, *p);
+    if(!*t){
+        dbg("Error creating fiber, thread %d still not created into %d->threads",pid,tgid);
+        return -ESRCH;
+    }
+
+    // Keep the bookkeeping on the node that will run the fiber, where
+    // userspace has placed its stack
+    if(*node == NUMA_NO_NODE) *node = numa_node_id();
+    if(*node < 0 || *node >= MAX_NUMNODES || !node_online(*node)){
+        dbg("Error creating fiber, node %d is not online\n",*node);
+        return -EINVAL;
+    }
+
+    return SUCCESS;
+}
+
+static pid_t create_fiber(struct process *p, struct thread *t, long user_fn, void *param, pid_t pid, void *stack_base, size_t stack_size, int node){
+
+    struct fiber   *f;
+
+    // Create a new struct fiber with given function and stack
+    f= fiber_alloc(node);
+    if(!f){
+        log("CreateFiber, error allocating struct fiber");
+        return -ENOMEM;
+    }
+
+    fiber_init_created(f, pid, node);
+    fiber_set_entry(f, atomic_fetch_inc(&(p->last_fid)), user_fn, param, stack_base, stack_size);
+    f->info->generation = atomic64_inc_return(&(p->generation));
 
 
     dbg("Inserting a new fiber fid %d with active_pid %d and RIP %ld",f->fid,atomic_read(&(f->active_pid)),(long)f->pt_regs.ip);
 
+    spin_lock(&(p->fibers_lock));
     hash_add_rcu(p->fibers,&(f->fnext),f->fid);
+    spin_unlock(&(p->fibers_lock));
+
+    fibers_proc_add_fiber(p, f);
+
+    recorder_log(p, FIBER_EVENT_CREATE, t->active_fid, f->fid);
+    live_stats_update(p, s, s->fibers++);
+    live_stats_count(p, created, 1);
 
     return f->fid;
 }
 
-pid_t kernelSwitchToFiber(pid_t tgid, pid_t pid, pid_t fid){
+pid_t kernelCreateFiber(long user_fn, void *param, pid_t tgid,pid_t pid, void *stack_base, size_t stack_size, int node, u64 start_ns){
+
 
     struct process *p;
     struct thread  *t;
-    struct fiber   *dst_f;
+    int ret;
+
+    dbg("kernelCreateFiber\n");
+
+    ret = create_check(tgid, pid, &p, &t, &node);
+    if(!ret) ret = create_fiber(p, t, user_fn, param, pid, stack_base, stack_size, node);
+
+    if(p) latency_record(p, LAT_CREATE, start_ns);
+
+    return ret;
+}
+
+pid_t kernelCreateFibers(pid_t tgid, pid_t pid, int count, long user_fn, void **params, void *stack_region, long stack_stride, size_t stack_size, int node){
+
+    struct process *p;
+    struct thread  *t;
+    struct fiber   *tmpl;
+    struct fiber  **f;
+    pid_t first;
+    u64 gen;
+    int i, ret;
+
+    dbg("kernelCreateFibers, %d fibers\n", count);
+
+    if(count <= 0 || count > FIBERS_BULK_MAX){
+        dbg("Error creating fibers, invalid count %d\n", count);
+        return -EINVAL;
+    }
+
+    ret = create_check(tgid, pid, &p, &t, &node);
+    if(ret) return ret;
+
+    f = vmalloc(count * sizeof(struct fiber *));
+    tmpl = fiber_alloc(node);
+    if(!f || !tmpl){
+        log("CreateFibers, error allocating %d fibers\n", count);
+        goto fail;
+    }
+
+    // Every fiber starts from the same context, only the entry point and
+    // the stack differ
+    fiber_init_created(tmpl, pid, node);
+
+    for(i=0; i<count; i++){
+        f[i] = fiber_alloc(node);
+        if(!f[i]){
+            log("CreateFibers, error allocating struct fiber %d of %d\n", i, count);
+            while(i--) fiber_release(f[i]);
+            goto fail;
+        }
+    }
+
+    // Fids are contiguous, one generation covers the whole batch
+    first = atomic_fetch_add(count, &(p->last_fid));
+    gen = atomic64_inc_return(&(p->generation));
+
+    for(i=0; i<count; i++){
+        fiber_copy(f[i], tmpl);
+        fiber_set_entry(f[i], first + i, user_fn, params[i],
+                        stack_region + i * stack_stride, stack_size);
+        f[i]->info->generation = gen;
+    }
+
+    spin_lock(&(p->fibers_lock));
+    for(i=0; i<count; i++)
+        hash_add_rcu(p->fibers,&(f[i]->fnext),f[i]->fid);
+    spin_unlock(&(p->fibers_lock));
+
+    for(i=0; i<count; i++){
+        fibers_proc_add_fiber(p, f[i]);
+        recorder_log(p, FIBER_EVENT_CREATE, t->active_fid, f[i]->fid);
+    }
+
+    live_stats_update(p, s, s->fibers += count);
+    live_stats_count(p, created, count);
+
+    fiber_release(tmpl);
+    vfree(f);
+
+    dbg("CreateFibers, created fibers %d to %d\n", first, first + count - 1);
+    return first;
+
+fail:
+    if(tmpl) fiber_release(tmpl);
+    vfree(f);
+    return -ENOMEM;
+}
+
+// Counters
+//
+// Faults and context switches of the task are always accounted, hardware
+// counters only once the process opts in. Each thread remembers the values
+// at the last switch and charges the difference to the fiber switched out.
+
+static const u64 perf_configs[FIBER_PERF_COUNTERS] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CPU_CYCLES,
+};
+
+static void thread_snapshot_counters(struct thread *t){
+    t->last_min_flt = current->min_flt;
+    t->last_maj_flt = current->maj_flt;
+    t->last_nvcsw   = current->nvcsw;
+    t->last_nivcsw  = current->nivcsw;
+}
+
+static u64 read_counter(struct perf_event *event){
+    u64 enabled, running;
+
+    return perf_event_read_value(event, &enabled, &running);
+}
+
+// Creates or releases the hardware counters of the calling thread t to
+// match the ones the process asks for
+static void thread_sync_perf(struct process *p, struct thread *t){
+
+    unsigned int flags = READ_ONCE(p->perf_flags);
+    struct perf_event_attr attr;
+    struct perf_event *event;
+    int i;
+
+    for(i=0; i<FIBER_PERF_COUNTERS; i++){
+
+        if(!(flags & (1 << i))){
+            if(t->perf[i]){
+                perf_event_release_kernel(t->perf[i]);
+                t->perf[i] = NULL;
+            }
+            continue;
+        }
+
+        if(t->perf[i] || (t->perf_failed & (1 << i))) continue;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.type           = PERF_TYPE_HARDWARE;
+        attr.size           = sizeof(attr);
+        attr.config         = perf_configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        event = perf_event_create_kernel_counter(&attr, -1, current, NULL, NULL);
+        if(IS_ERR(event)){
+            dbg("[%d->%d] cannot create perf counter %d: %ld\n", p->tgid, t->pid, i, PTR_ERR(event));
+            t->perf_failed |= 1 << i;
+            continue;
+        }
+
+        t->perf[i] = event;
+        t->perf_last[i] = read_counter(event);
+    }
+}
+
+// Charges f, which ran on the calling thread t since the last switch
+static void fiber_charge_counters(struct thread *t, struct fiber *f){
+
+    u64 value;
+    int i;
+
+    f->info->min_flt += current->min_flt - t->last_min_flt;
+    f->info->maj_flt += current->maj_flt - t->last_maj_flt;
+    f->info->nvcsw   += current->nvcsw   - t->last_nvcsw;
+    f->info->nivcsw  += current->nivcsw  - t->last_nivcsw;
+    thread_snapshot_counters(t);
+
+    for(i=0; i<FIBER_PERF_COUNTERS; i++){
+        if(!t->perf[i]) continue;
+        value = read_counter(t->perf[i]);
+        f->info->perf[i] += value - t->perf_last[i];
+        t->perf_last[i] = value;
+    }
+}
+
+
+// Shortest time slice accepted, below it the timer interrupts alone would
+// keep the thread busy
+#define FIBERS_MIN_SLICE_NS 100000
+
+// Time slices
+//
+// slice_start() arms a per-thread hrtimer whenever a fiber other than the
+// scheduler fiber of the thread is switched in. On expiry the timer queues
+// a task_work on the thread, which runs in its context right before going
+// back to userspace, and switches to the scheduler fiber from there as if
+// the preempted fiber had called SwitchToFiber.
+
+struct preempt_work{
+    struct callback_head cb;
+    pid_t tgid;
+    pid_t pid;
+};
+
+static void slice_start(struct process *p, struct thread *t, pid_t fid){
+
+    u64 slice = READ_ONCE(p->slice_ns);
+
+    if(!slice || fid == t->sched_fid){
+        if(t->slice_end){
+            t->slice_end = 0;
+            hrtimer_try_to_cancel(&(t->slice_timer));
+        }
+        return;
+    }
+
+    t->slice_end = ktime_add_ns(ktime_get(), slice);
+    hrtimer_start(&(t->slice_timer), t->slice_end, HRTIMER_MODE_ABS);
+}
+
+// Runs in the context of the preempted thread, on its way to userspace.
+// Looks everything up again by id: the process may be gone by now.
+static void preempt_current_fiber(struct callback_head *cb){
+
+    struct preempt_work *w = container_of(cb, struct preempt_work, cb);
+    struct process *p;
+    struct thread  *t;
     struct fiber   *src_f;
+    struct fiber   *dst_f;
+    pid_t tgid = w->tgid;
+    pid_t pid  = w->pid;
+    int critical = 0;
+
+    kfree(w);
+
+    if(current->flags & PF_EXITING) return;
+
+    p = get_process_by_id(tgid);
+    if(!p) return;
+    t = get_thread_by_id(pid, p);
+    if(!t) return;
+
+    atomic_set(&(t->preempt_pending), 0);
+
+    // The thread switched fiber since the timer fired
+    if(!t->slice_end || ktime_before(ktime_get(), t->slice_end)) return;
+
+    src_f = get_fiber_by_id(t->active_fid, p);
+    dst_f = get_fiber_by_id(t->sched_fid, p);
+    if(!src_f || !dst_f || src_f == dst_f) return;
+
+    // Inside a critical section, or the scheduler fiber is running on
+    // another thread: let the fiber run for another slice
+    if(t->critical && get_user(critical, t->critical) == 0 && critical){
+        dbg("[%d->%d] fiber %d in a critical section, preemption deferred\n", tgid, pid, src_f->fid);
+        slice_start(p, t, src_f->fid);
+        return;
+    }
+    if(atomic_cmpxchg(&(dst_f->active_pid), 0, pid) != 0){
+        if(fiber_stats_on()){
+            atomic_long_inc(&(dst_f->info->failed_activations));
+            live_stats_count(p, failed_activations, 1);
+        }
+        slice_start(p, t, src_f->fid);
+        return;
+    }
+
+    if(!fiber_cpu_allowed(dst_f)){
+        atomic_set(&(dst_f->active_pid), 0);
+        slice_start(p, t, src_f->fid);
+        return;
+    }
+
+    fork_before_change(p, dst_f);
+
+    if(fiber_fpu_prepare(src_f, dst_f)){
+        atomic_set(&(dst_f->active_pid), 0);
+        slice_start(p, t, src_f->fid);
+        return;
+    }
+
+    dbg("[%d->%d] fiber %d preempted, switching to %d\n", tgid, pid, src_f->fid, dst_f->fid);
+
+    src_f->preempted = 1;
+    src_f->info->preemptions++;
+
+    switch_fibers(p, t, src_f, dst_f, FIBER_SWITCH_PREEMPTED);
+}
+
+static enum hrtimer_restart slice_expired(struct hrtimer *timer){
+
+    struct thread *t = container_of(timer, struct thread, slice_timer);
+    struct preempt_work *w;
+
+    if(atomic_cmpxchg(&(t->preempt_pending), 0, 1) != 0)
+        return HRTIMER_NORESTART;
+
+    w = kmalloc(sizeof(struct preempt_work), GFP_ATOMIC);
+    if(!w) goto out;
+
+    init_task_work(&(w->cb), preempt_current_fiber);
+    w->tgid = t->task->tgid;
+    w->pid  = t->pid;
+
+    // Kicks the thread into the kernel if it is running in userspace
+    if(task_work_add(t->task, &(w->cb), true) == 0)
+        return HRTIMER_NORESTART;
+
+    kfree(w);
+out:
+    atomic_set(&(t->preempt_pending), 0);
+    return HRTIMER_NORESTART;
+}
+
+// Ends the activation of src_f and starts the one of dst_f at now
+static void fiber_account_run(struct fiber *src_f, struct fiber *dst_f, u64 now){
+
+    u64 run = now - src_f->info->switch_in_ns;
+    u64 limit = 10 * NSEC_PER_USEC;
+    int b;
+
+    for(b=0; b<FIBER_RUN_BUCKETS-1 && run>=limit; b++) limit *= 10;
+    src_f->info->run_hist[b]++;
+    if(run > src_f->info->max_run_ns) src_f->info->max_run_ns = run;
+    src_f->info->switch_out_ns = now;
+
+    // Time before the first activation is not parked time
+    if(dst_f->info->switch_out_ns) dst_f->info->parked_ns += now - dst_f->info->switch_out_ns;
+    dst_f->info->switch_in_ns = now;
+}
+
+// Saves the cpu context into src_f and loads the one of dst_f, which must
+// already be booked by the calling thread t, with fpu buffers from
+// fiber_fpu_prepare().
+// Returns the value that ends up in ax when going back to userspace, ret
+// unless the fiber being resumed says otherwise.
+static long switch_fibers(struct process *p, struct thread *t, struct fiber *src_f, struct fiber *dst_f, long ret){
+
     struct pt_regs *cpu_regs;
-    long src_fid,old;
-    //unsigned long exectime;
+    u64 gen;
+    int migrate;
+    int cpu = raw_smp_processor_id();
+
+    // Save current cpu context into current fiber and mark it as not running
+    cpu_regs = task_pt_regs(current);
+
+    memcpy(&(src_f->pt_regs), cpu_regs, sizeof(struct pt_regs));
     
-    struct fpu *prev_fpu;
-    struct fpu *next_fpu;
-    struct fxregs_state * next_fx_regs;
     
-    log("kernelSwitchToFiber tgid:%d pid:%d fid:%d\n",tgid,pid,fid);
+    //save previous FPU registers in the previous fiber
+    fxregs_save(src_f->fxregs);
 
-    // Get time spent in userspace
-    //exectime = current->utime;
-    //dbg("kernelSwitchToFiber [%d->%d] has run last fiber for %lld\n", tgid, pid, current->utime);
+    //restore next FPU registers of the next fiber
+    copy_kernel_to_fxregs(dst_f->fxregs);
 
 
-    // Check if struct process exists otherwise return error
-    p = get_process_by_id(tgid);
-    if(!p){
-        dbg("Error SwitchToFiber, process %d still not created.\n",tgid);
-        return ERROR;   // In the current process no thread has
-                        // been converted to fiber yet
+
+
+    // Update metrics before releasing old fiber
+    if(fiber_stats_on()){
+        fiber_charge_counters(t, src_f);
+        thread_sync_perf(p, t);
+        fiber_account_stack(src_f);
+        src_f->info->total_running_time += current->utime - src_f->info->last_activation_time;
+        dbg("kernelSwitchToFiber [Fiber %d] total execution time %ld\n", src_f->fid, src_f->info->total_running_time);
+
+        // Start counting time for new fiber
+        dst_f->info->last_activation_time = current->utime;
+
+        // Cache affinity lost since the last activation
+        if(dst_f->last_pid){
+            if(dst_f->last_cpu != cpu) dst_f->info->cpu_migrations++;
+            if(dst_f->last_pid != t->pid) dst_f->info->thread_migrations++;
+        }
+
+        fiber_account_run(src_f, dst_f, ktime_get_ns());
+
+        gen = atomic64_inc_return(&(p->generation));
+        src_f->info->generation = gen;
+        dst_f->info->generation = gen;
+
+        live_stats_count(p, switches, 1);
+        if(ret == FIBER_SWITCH_PREEMPTED) live_stats_count(p, preemptions, 1);
     }
 
+    recorder_log(p, ret == FIBER_SWITCH_PREEMPTED ? FIBER_EVENT_PREEMPT : FIBER_EVENT_SWITCH,
+                 src_f->fid, dst_f->fid);
+
+    // Disengage old fiber
+    atomic_set(&(src_f->active_pid),0);
+
+    dbg("SwitchToFiber, Saved CPU ctx into src_fiber %d and active_pid to 0\n",src_f->fid);
+
+    // Restore into the CPU the context of dst_f
+    memcpy(cpu_regs, &(dst_f->pt_regs), sizeof(struct pt_regs));
+
+    // ****************************************
+    // @TODO RESTORE fpu;
+    // ***************************************
+    dbg("SwitchToFiber, Loaded into CPU ctx the context that was into dst_fiber %d\n",dst_f->fid);
+    dbg("SwitchToFiber, Loaded RIP: %ld\n",dst_f->pt_regs.ip);
+
+    t->active_fid = dst_f->fid;
+    dst_f->last_cpu = cpu;
+    dst_f->last_pid = t->pid;
+
+    // Activation successful, counted anyway: a fiber starting afresh is
+    // told apart by its first activation
+    dst_f->activations++;
+    migrate = fiber_account_node(dst_f);
+
+    slice_start(p, t, dst_f->fid);
+
+    // A preempted fiber resumes with all of its registers, the others get
+    // back the return value of their own SwitchToFiber
+    if(dst_f->preempted){
+        dst_f->preempted = 0;
+        return dst_f->pt_regs.ax;
+    }
+
+    cpu_regs->ax = migrate ? FIBER_SWITCH_MIGRATE : ret;
+    return cpu_regs->ax;
+}
+
+static long switch_to_fiber(struct process *p, pid_t pid, pid_t fid){
+
+    struct thread  *t;
+    struct fiber   *dst_f;
+    struct fiber   *src_f;
+    long src_fid,old;
+    //unsigned long exectime;
+    
+    dbg("kernelSwitchToFiber tgid:%d pid:%d fid:%d\n",p->tgid,pid,fid);
+
+    // Get time spent in userspace
+    //exectime = current->utime;
+    //dbg("kernelSwitchToFiber [%d->%d] has run last fiber for %lld\n", tgid, pid, current->utime);
+
+
     // Check if current thread has been converted to fiber otherwise error
     t = get_thread_by_id(pid, p);
     if(!t){
-        dbg("Error SwitchToFiber, thread %d still not in %d->threads\n",pid,tgid);
-        return ERROR;    // Calling thread was not converted yet
+        dbg("Error SwitchToFiber, thread %d still not in %d->threads\n",pid,p->tgid);
+        return -ESRCH;    // Calling thread was not converted yet
     }
 
     src_fid = t->active_fid;
 
     // Find target fiber
+    // Inherited fibers are set up on first use
     dst_f = get_fiber_by_id(fid, p);
+    if (!dst_f) dst_f = fork_lookup(p, fid);
     if (!dst_f){
         dbg("Error SwitchToFiber, fiber %d not created yet\n",fid);
-        return ERROR;    // Target fiber does not exist
+        return -ESRCH;    // Target fiber does not exist
     }
     dbg("SwitchToFiber, found dest_fiber %d has active_pid %d\n",fid,atomic_read(&(dst_f->active_pid)));
 
     // Check if target fiber is already in use and book it for the new use
     if( (old = atomic_cmpxchg(&(dst_f->active_pid),0,pid)) !=0){
-        atomic_long_inc(&(dst_f->failed_activations));
-        log("[%d->%d] Error, fiber %d was already in use by %ld\n",tgid,pid,fid,old);
-        return ERROR;
+        if(fiber_stats_on()){
+            atomic_long_inc(&(dst_f->info->failed_activations));
+            dst_f->info->generation = atomic64_inc_return(&(p->generation));
+            live_stats_count(p, failed_activations, 1);
+        }
+        dbg("[%d->%d] Error, fiber %d was already in use by %ld\n",p->tgid,pid,fid,old);
+        recorder_log(p, FIBER_EVENT_FAILED, t->active_fid, fid);
+        return -EBUSY;
     }
     dbg("Booked dst_fiber %d with active_pid %d",dst_f->fid, atomic_read(&(dst_f->active_pid)));
 
+    if(!fiber_cpu_allowed(dst_f)){
+        atomic_set(&(dst_f->active_pid), 0);
+        dbg("[%d->%d] Error, fiber %d may not run on cpu %d\n",p->tgid,pid,fid,raw_smp_processor_id());
+        return -EXDEV;
+    }
+
+    // Children forked since it last ran see it as it was at fork time
+    fork_before_change(p, dst_f);
+
     // Find currently executing fiber, we need to write into it
     src_f = get_fiber_by_id(src_fid, p);
     if(!src_f){ // Currently running fiber does not exist???
         dbg("SwitchToFiber cannot find fiber %ld that was referenced as activated by thread %d\n",src_fid,pid);
-        return ERROR;
+        return -ESRCH;
     }
     dbg("SwitchToFiber, found src_fiber %d has active_pid %d",src_f->fid,atomic_read(&(src_f->active_pid)));
 
-    // Save current cpu context into current fiber and mark it as not running
-    cpu_regs = task_pt_regs(current);
-
-    memcpy(&(src_f->pt_regs), cpu_regs, sizeof(struct pt_regs));
-    
-    
-    //save previous FPU registers in the previous fiber
-    prev_fpu = &(src_f->fpu);
-    copy_fxregs_to_kernel(prev_fpu);
-
-    
-    //restore next FPU registers of the next fiber
-    next_fpu = &(dst_f->fpu);
-    next_fx_regs = &(next_fpu->state.fxsave);
-    copy_kernel_to_fxregs(next_fx_regs);
-
-
-
-
-    // Update metrics before releasing old fiber
-    src_f->total_running_time += current->utime - src_f->last_activation_time;
-    dbg("kernelSwitchToFiber [Fiber %ld] total execution time %ld\n", src_fid, src_f->total_running_time);
-    
-    // Start counting time for new fiber
-    dst_f->last_activation_time = current->utime;
-
-    // Disengage old fiber
-    atomic_set(&(src_f->active_pid),0);
+    if(fiber_fpu_prepare(src_f, dst_f)){
+        atomic_set(&(dst_f->active_pid), 0);
+        return -ENOMEM;
+    }
 
-    dbg("SwitchToFiber, Saved CPU ctx into src_fiber %d and active_pid to 0\n",src_f->fid);
+    return switch_fibers(p, t, src_f, dst_f, SUCCESS);
+}
 
-    // Restore into the CPU the context of dst_f
-    memcpy(cpu_regs, &(dst_f->pt_regs), sizeof(struct pt_regs));
+long kernelSwitchToFiber(pid_t tgid, pid_t pid, pid_t fid, u64 start_ns){
 
-    // ****************************************
-    // @TODO RESTORE fpu;
-    // ***************************************
-    dbg("SwitchToFiber, Loaded into CPU ctx the context that was into dst_fiber %d\n",dst_f->fid);
-    dbg("SwitchToFiber, Loaded RIP: %ld\n",dst_f->pt_regs.ip);
+    struct process *p;
+    long ret;
 
-    t->active_fid = dst_f->fid;
+    // Check if struct process exists otherwise return error
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error SwitchToFiber, process %d still not created.\n",tgid);
+        return -ESRCH;   // In the current process no thread has
+                        // been converted to fiber yet
+    }
 
-    // Activation successful
-    dst_f->activations++;
+    ret = switch_to_fiber(p, pid, fid);
+    latency_record(p, LAT_SWITCH, start_ns);
 
-    return SUCCESS;
+    return ret;
 }
 
 long kernelFlsAlloc(pid_t tgid, pid_t pid){
@@ -325,8 +1082,8 @@ long kernelFlsAlloc(pid_t tgid, pid_t pid){
     struct process *p;
     struct thread  *t;
     struct fiber   *f;
-    struct fls_free_ll * ll_old;
     long index;
+    int first;
 
     dbg("FlsAlloc, process %d thread %d\n", tgid, pid);
 
@@ -334,7 +1091,7 @@ long kernelFlsAlloc(pid_t tgid, pid_t pid){
     p = get_process_by_id(tgid);
     if(!p){
         dbg("Error FlsAlloc, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
-        return ERROR;   // In the current process no thread has
+        return -ESRCH;   // In the current process no thread has
                         // been converted to fiber yet
     }
 
@@ -342,7 +1099,7 @@ long kernelFlsAlloc(pid_t tgid, pid_t pid){
     t = get_thread_by_id(pid, p);
     if(!t){
         dbg("Error FlsAlloc, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
-        return ERROR;    // Calling thread was not converted yet
+        return -ESRCH;    // Calling thread was not converted yet
     }
 
     fid = t->active_fid;
@@ -351,101 +1108,22 @@ long kernelFlsAlloc(pid_t tgid, pid_t pid){
     f = get_fiber_by_id(fid, p);
     if (!f){
         dbg("Error FlsAlloc, [%d->%d->%d] currently executing fiber does not exist???\n", tgid, pid, fid);
-        return ERROR;    // Target fiber does not exist
+        return -ESRCH;    // Target fiber does not exist
     }
 
-    // Check if fiber already has used FLS
-    if(!f->used_fls){
-
-        dbg("FlsAlloc, [%d->%d->%d] fiber had never used FLS, initializing\n", tgid, pid, fid);
-
-        // FLS was never used yet, set it up
-        // Alloc space
-        f->fls = vmalloc(sizeof(long long) * FLS_SIZE);
-
-        // Setup LL for free entries
-        f->free_ll = vmalloc(sizeof(struct fls_free_ll));
-        f->free_ll->index = 1;
-        f->free_ll->next = NULL;
-
-        dbg("FlsAlloc, [%d->%d->%d] linked list set up\n", tgid, pid, fid);
-
-        // Setup the bitmaps
-        f->fls_used_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
-        bitmap_clear(f->fls_used_bmp, 0, FLS_SIZE);
-
-        f->fls_pointed_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
-        bitmap_clear(f->fls_pointed_bmp, 0, FLS_SIZE);
-
-
-        // Bit 1 is pointed by LL - set bit in bitmap
-        set_bit(1, f->fls_pointed_bmp);
-
-        // Setup bmp
-        set_bit(0, f->fls_used_bmp);
-
-        dbg("FlsAlloc, [%d->%d->%d] bitmaps set up\n", tgid, pid, fid);
-
-        index = 0;
-
-        // First intialization complete
-        f->used_fls = 1;
-
-    } else if(f->free_ll==NULL){ // FLS had already been used, but no
-                                 // pointer to free slot is found
-
-        // -> FLS is full
-        dbg("Error FlsAlloc, [%d->%d->%d] no more space is available in FLS\n", tgid, pid, fid);
-        return ERROR;
-
-    } else { // FLS was already initialized
-
-        dbg("FlsAlloc, [%d->%d->%d] fiber has space in FLS\n", tgid, pid, fid);
-
-        index = f->free_ll->index;
-
-        // Mark slot as used in the bitmap
-        set_bit(index, f->fls_used_bmp);
+    first = !f->used_fls;
 
-        // Clear bit in pointed bmp
-        // Slot will not be pointed anymore in any case
-        clear_bit(index, f->fls_pointed_bmp);
+    index = fls_alloc(f);
+    if(index == ERROR) return -ENOSPC;    // FLS is full
 
-        dbg("FlsAlloc, [%d->%d->%d] got index, updated bitmaps\n", tgid, pid, fid);
-
-        // We need to check that
-        // + The free bit is not the last one in the bitmap
-        // AND
-        // + The free bit is not followed by a zone pointed by another LL node
-        // AND
-        // + Whether the free zone continues or we need the next pointer
-        // THEN
-        // => if next bit is not pointed and not used, increment
-        //      index if it doesn't go above FLS_SIZE
-        if(index+1<FLS_SIZE && !test_bit(index+1, f->fls_pointed_bmp) && !test_bit(index+1, f->fls_used_bmp)){
-
-            dbg("FlsAlloc, [%d->%d->%d] the slot following the allocated one is free and not pointed by a node of linked list\n", tgid, pid, fid);
-
-            f->free_ll->index = index+1;
-            set_bit(index+1, f->fls_pointed_bmp);
-
-        } else { // Either free zone ends or another LL node points the next
-
-            dbg("FlsAlloc, [%d->%d->%d] the slot following the allocated one is either used or pointed by a node of the linked list\n", tgid, pid, fid);
-
-            ll_old = f->free_ll;
-            f->free_ll = f->free_ll->next;
-            vfree(ll_old);
-
-        }
-
-    }
+    if(first) live_stats_update(p, s, {
+        s->fls_fibers++;
+        s->fls_bytes += FLS_FOOTPRINT;
+    });
 
     dbg("FlsAlloc, [%d->%d->%d] Done. Returning index %ld\n", tgid, pid, fid, index);
 
     return index;
-
-    return 0;
 }
 
 int kernelFlsFree(pid_t tgid, pid_t pid, long index){
@@ -455,21 +1133,20 @@ int kernelFlsFree(pid_t tgid, pid_t pid, long index){
     struct process *p;
     struct thread  *t;
     struct fiber   *f;
-    struct fls_free_ll * ll_new;
 
     dbg("FlsFree, process %d thread %d\n", tgid, pid);
 
 
     if(index>=FLS_SIZE || index < 0){
         dbg("Error FlsFree, [%d->%d] tried freeing index %ld out of the FLS memory range\n", tgid, pid, index);
-        return ERROR;
+        return -EINVAL;
     }
 
     // Check if struct process exists otherwise return error
     p = get_process_by_id(tgid);
     if(!p){
         dbg("Error FlsFree, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
-        return ERROR;   // In the current process no thread has
+        return -ESRCH;   // In the current process no thread has
                         // been converted to fiber yet
     }
 
@@ -477,7 +1154,7 @@ int kernelFlsFree(pid_t tgid, pid_t pid, long index){
     t = get_thread_by_id(pid, p);
     if(!t){
         dbg("Error FlsFree, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
-        return ERROR;    // Calling thread was not converted yet
+        return -ESRCH;    // Calling thread was not converted yet
     }
 
     fid = t->active_fid;
@@ -486,48 +1163,17 @@ int kernelFlsFree(pid_t tgid, pid_t pid, long index){
     f = get_fiber_by_id(fid, p);
     if (!f){
         dbg("Error FlsFree, [%d->%d->%d] currently executing fiber does not exist???\n", tgid, pid, fid);
-        return ERROR;    // Target fiber does not exist
-    }
-
-    // Check if FLS has been initialized and entry had been previously malloc-ed
-    if(!f->used_fls  || !test_bit(index, f->fls_used_bmp)){
-        dbg("Error FlsFree, [%d->%d->%d] tried freeing a non malloc-ed entry\n", tgid, pid, fid);
-        return ERROR;    // Target entry does not exist
+        return -ESRCH;    // Target fiber does not exist
     }
 
-    clear_bit(index, f->fls_used_bmp);
-    dbg("FlsFree, [%d->%d->%d] usage flag for index %ld cleared\n", tgid, pid, fid, index);
-
-    // Freed bit does not follow a free area
-    if(!(index > 0 && !test_bit(index-1, f->fls_used_bmp))){
-
-        dbg("FlsFree, [%d->%d->%d] cleared bit does not follow a free area, I point it with a linkedList node\n", tgid, pid, fid);
-
-        // Create LL node for this new free area
-        // Put new node at start of LL chain
-        ll_new = vmalloc(sizeof(struct fls_free_ll));
-        ll_new->index=index;
-        ll_new->next = f->free_ll;
-        f->free_ll = ll_new;
-
-        dbg("FlsFree, [%d->%d->%d] new head of the linkedList is at index: %ld\n", tgid, pid, fid, f->free_ll->index);
-
-        dbg("FlsFree, [%d->%d->%d] next node points index: %ld\n", tgid, pid, fid, f->free_ll->next==NULL ? -1 : f->free_ll->next->index);
-
-        // Bit at index index is now pointed by a LL element
-        set_bit(index, f->fls_pointed_bmp);
-
-    }
-
-    // If freed bit is preceeded by a free area, no action is needed, as
-    // it will be reached through the LL node pointing to preceding area
+    if(fls_free(f, index) == ERROR) return -ENOENT;  // Target entry does not exist
 
     dbg("FlsFree, [%d->%d->%d] done!\n", tgid, pid, fid);
 
     return SUCCESS;
 }
 
-long long kernelFlsGetValue(pid_t tgid, pid_t pid, long index){
+int kernelFlsGetValue(pid_t tgid, pid_t pid, long index, long long *value){
 
     pid_t fid;
 
@@ -539,14 +1185,14 @@ long long kernelFlsGetValue(pid_t tgid, pid_t pid, long index){
 
     if(index>=FLS_SIZE || index < 0){
         dbg("Error FlsGetValue, [%d->%d] tried reading index %ld out of the FLS memory range\n", tgid, pid, index);
-        return ERROR;
+        return -EINVAL;
     }
 
     // Check if struct process exists otherwise return error
     p = get_process_by_id(tgid);
     if(!p){
         dbg("Error FlsGetValue, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
-        return ERROR;   // In the current process no thread has
+        return -ESRCH;   // In the current process no thread has
                         // been converted to fiber yet
     }
 
@@ -554,7 +1200,7 @@ long long kernelFlsGetValue(pid_t tgid, pid_t pid, long index){
     t = get_thread_by_id(pid, p);
     if(!t){
         dbg("Error FlsGetValue, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
-        return ERROR;    // Calling thread was not converted yet
+        return -ESRCH;    // Calling thread was not converted yet
     }
 
     fid = t->active_fid;
@@ -563,19 +1209,19 @@ long long kernelFlsGetValue(pid_t tgid, pid_t pid, long index){
     f = get_fiber_by_id(fid, p);
     if (!f){
         dbg("Error FlsGetValue, [%d->%d->%d] currently executing fiber does not exist???\n", tgid, pid, fid);
-        return ERROR;    // Current fiber does not exist???
+        return -ESRCH;    // Current fiber does not exist???
     }
 
     // Check if FLS has been initialized and target entry exists
-    if(!f->used_fls || !test_bit(index, f->fls_used_bmp)){
+    if(!fls_is_allocated(f, index)){
         dbg("Error FlsGetValue, [%d->%d->%d] tried accessing a non malloc-ed entry\n", tgid, pid, fid);
-        return ERROR;    // Target entry does not exist
+        return -ENOENT;    // Target entry does not exist
     }
 
     dbg("FlsGetValue, [%d->%d->%d] read %lld\n", tgid, pid, fid, f->fls[index]);
 
-    // @TODO COPY TO USER
-    return f->fls[index];
+    *value = f->fls[index];
+    return SUCCESS;
 }
 
 int kernelFlsSetValue(pid_t tgid, pid_t pid, long index, long long value){
@@ -590,14 +1236,14 @@ int kernelFlsSetValue(pid_t tgid, pid_t pid, long index, long long value){
 
     if(index>=FLS_SIZE || index < 0){
         dbg("Error FlsSetValue, [%d->%d] tried writing to index %ld out of the FLS memory range\n", tgid, pid, index);
-        return ERROR;
+        return -EINVAL;
     }
 
     // Check if struct process exists otherwise return error
     p = get_process_by_id(tgid);
     if(!p){
         dbg("Error FlsSetValue, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
-        return ERROR;   // In the current process no thread has
+        return -ESRCH;   // In the current process no thread has
                         // been converted to fiber yet
     }
 
@@ -605,7 +1251,7 @@ int kernelFlsSetValue(pid_t tgid, pid_t pid, long index, long long value){
     t = get_thread_by_id(pid, p);
     if(!t){
         dbg("Error FlsSetValue, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
-        return ERROR;    // Calling thread was not converted yet
+        return -ESRCH;    // Calling thread was not converted yet
     }
 
     fid = t->active_fid;
@@ -614,15 +1260,15 @@ int kernelFlsSetValue(pid_t tgid, pid_t pid, long index, long long value){
     f = get_fiber_by_id(fid, p);
     if (!f){
         dbg("Error FlsSetValue, [%d->%d->%d] currently executing fiber does not exist???\n", tgid, pid, fid);
-        return ERROR;    // Current fiber does not exist???
+        return -ESRCH;    // Current fiber does not exist???
     }
 
     dbg("FlsSetValue, [%d->%d->%d] wants to write %lld in index %ld\n", tgid, pid, fid, value, index);
 
     // Check if FLS has been initialized and target entry has been allocated and not freed
-    if(!f->used_fls || !test_bit(index, f->fls_used_bmp)){
+    if(!fls_is_allocated(f, index)){
         dbg("Error FlsSetValue, [%d->%d->%d] tried writing a non malloc-ed entry\n", tgid, pid, fid);
-        return ERROR;    // Target entry does not exist
+        return -ENOENT;    // Target entry does not exist
     }
 
     // Write into the slot
@@ -640,6 +1286,9 @@ int kernelFiberExit(pid_t tgid, pid_t pid){
     struct process *p;
     struct thread  *t;
     struct fiber   *f;
+    struct fiber_tombstone *tomb, *ring;
+    pid_t parent;
+    u64 gen;
     //struct fls_free_ll * ll_old;
     
     //int ret;
@@ -648,7 +1297,7 @@ int kernelFiberExit(pid_t tgid, pid_t pid){
     p = get_process_by_id(tgid);
     if(!p){
         dbg("Error kernelFiberExit, process %d had no fibers.\n",tgid);
-        return ERROR;   // In the current process no thread has
+        return -ESRCH;   // In the current process no thread has
                         // been converted to fiber yet
     }
     
@@ -656,7 +1305,7 @@ int kernelFiberExit(pid_t tgid, pid_t pid){
     t = get_thread_by_id(pid, p);
     if(!t){
         dbg("Error kernelFiberExit, thread %d not in %d->threads\n",pid,tgid);
-        return ERROR;    // Calling thread was not converted yet
+        return -ESRCH;    // Calling thread was not converted yet
     }
         
     fid = t->active_fid;
@@ -665,12 +1314,44 @@ int kernelFiberExit(pid_t tgid, pid_t pid){
     f = get_fiber_by_id(fid, p);
     if (!f){
         dbg("Error kernelFiberExit, currently running fiber %d does not exist?\n",fid);
-        return ERROR;    // Currently executing fiber does not exist???
+        return -ESRCH;    // Currently executing fiber does not exist???
     }
     
-    log("kernelFiberExit, [%d->%d->%d] wants to exit, clearing memory...\n", tgid, pid, fid);
-    
-    freeFiber(f);
+    dbg("kernelFiberExit, [%d->%d->%d] wants to exit, clearing memory...\n", tgid, pid, fid);
+
+    recorder_log(p, FIBER_EVENT_EXIT, fid, -1);
+
+    // The first exit of the process sets up the ring of tombstones
+    ring = NULL;
+    if(!READ_ONCE(p->exited))
+        ring = kmalloc_array(FIBER_TOMBSTONES, sizeof(struct fiber_tombstone), GFP_KERNEL);
+
+    parent = f->info->parent;
+    freeFiber(p, f);
+
+    // Let incremental pollers know that the fiber is gone: its tombstone
+    // is reported once with the generation of the exit, until the ring
+    // wraps around
+    spin_lock(&(p->fibers_lock));
+    gen = atomic64_inc_return(&(p->generation));
+    if(!p->exited){
+        p->exited = ring;
+        ring = NULL;
+    }
+    if(p->exited){
+        tomb = &(p->exited[p->exited_count % FIBER_TOMBSTONES]);
+        if(p->exited_count >= FIBER_TOMBSTONES) p->exited_horizon = tomb->generation;
+        tomb->fid        = fid;
+        tomb->parent     = parent;
+        tomb->generation = gen;
+        p->exited_count++;
+    } else {
+        log("kernelFiberExit, no tombstone for fiber %d, pollers have to resync\n", fid);
+        p->exited_horizon = gen;
+    }
+    spin_unlock(&(p->fibers_lock));
+
+    kfree(ring);
     
     /*
      * ALL THIS IS DONE IN freeFiber
@@ -706,45 +1387,336 @@ int kernelFiberExit(pid_t tgid, pid_t pid){
     */
     
     
-    // DO NOT free Thread entry unless the process is exiting
-    // as other threads may want to call the thread's fibers
-    
-    log("kernelFiberExit, [%d->%d->%d] done! Fiber exiting...\n", tgid, pid, fid);
+    // The task is going away with the fiber: its fibers other than f
+    // stay in p->fibers for the other threads to switch to
+    thread_release(p, t);
+    live_stats_update(p, s, s->threads--);
+
+    dbg("kernelFiberExit, [%d->%d->%d] done! Fiber exiting...\n", tgid, pid, fid);
     do_exit(0);
     
 }
 
-void freeFiber(struct fiber *f){
-    struct fls_free_ll * ll_old;
+long kernelGetFiberStats(pid_t tgid, int fid_from, int fid_to, u64 since_generation, struct fiber_stats *out, long capacity, long *total, u64 *generation){
+
+    struct process *p;
+    struct fiber   *f;
+    struct fiber_tombstone *tomb;
+    unsigned long n;
+    int bucket, b, stale = 0;
+    long count = 0;
+
+    *total = 0;
+
+    // Fibers exiting on other threads are freed after a grace period
+    rcu_read_lock();
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        rcu_read_unlock();
+        dbg("Error GetFiberStats, process %d has no fibers yet.\n", tgid);
+        return -ESRCH;
+    }
+
+    // Read the generation first: a fiber updated while we walk the table
+    // will be reported again by the next incremental poll.
+    *generation = atomic64_read(&(p->generation));
+
+    hash_for_each_rcu(p->fibers, bucket, f, fnext){
+
+        if(f->fid < fid_from) continue;
+        if(fid_to >= 0 && f->fid > fid_to) continue;
+        if(f->info->generation <= since_generation) continue;
+
+        (*total)++;
+        if(count >= capacity) continue;  // Keep counting for the caller
+
+        out[count].fid                = f->fid;
+        out[count].parent             = f->info->parent;
+        out[count].state              = atomic_read(&(f->active_pid)) ?
+                                            FIBER_STATE_RUNNING :
+                                            FIBER_STATE_IDLE;
+        out[count].last_cpu           = f->last_cpu;
+        out[count].activations        = f->activations;
+        out[count].failed_activations = atomic_long_read(&(f->info->failed_activations));
+        out[count].running_time       = f->info->total_running_time;
+        out[count].generation         = f->info->generation;
+        out[count].local_activations  = f->local_activations;
+        out[count].remote_activations = f->remote_activations;
+        out[count].node               = f->node;
+        out[count].last_node          = f->last_node;
+        out[count].preemptions        = f->info->preemptions;
+        out[count].min_flt            = f->info->min_flt;
+        out[count].maj_flt            = f->info->maj_flt;
+        out[count].nvcsw              = f->info->nvcsw;
+        out[count].nivcsw             = f->info->nivcsw;
+        out[count].instructions       = f->info->perf[0];
+        out[count].cycles             = f->info->perf[1];
+        out[count].max_run_ns         = f->info->max_run_ns;
+        for(b=0; b<FIBER_RUN_BUCKETS; b++)
+            out[count].run_hist[b]    = f->info->run_hist[b];
+        out[count].parked_ns          = f->info->parked_ns;
+        out[count].last_deactivation_ns = f->info->switch_out_ns;
+        out[count].stack_size         = f->stack_size;
+        out[count].stack_hwm          = f->info->stack_hwm;
+        out[count].last_pid           = f->last_pid;
+        out[count].pinned             = READ_ONCE(f->affinity) != NULL;
+        out[count].cpu_migrations     = f->info->cpu_migrations;
+        out[count].thread_migrations  = f->info->thread_migrations;
+
+        count++;
+    }
+
+    // Exits since the last poll, newest first. A full poll only reports
+    // live fibers, an incremental one fails if exits it did not see were
+    // dropped from the ring.
+    spin_lock(&(p->fibers_lock));
+    if(since_generation && since_generation < p->exited_horizon) stale = 1;
+
+    // Tombstone n-1 is the n-th exit, the ring holds the last ones
+    n = (since_generation && !stale && p->exited) ? p->exited_count : 0;
+    for(; n > 0 && p->exited_count - n < FIBER_TOMBSTONES; n--){
+
+        tomb = &(p->exited[(n - 1) % FIBER_TOMBSTONES]);
+        if(tomb->generation <= since_generation) break;
+
+        if(tomb->fid < fid_from) continue;
+        if(fid_to >= 0 && tomb->fid > fid_to) continue;
+
+        (*total)++;
+        if(count >= capacity) continue;
+
+        memset(&(out[count]), 0, sizeof(struct fiber_stats));
+        out[count].fid        = tomb->fid;
+        out[count].parent     = tomb->parent;
+        out[count].state      = FIBER_STATE_EXITED;
+        out[count].last_cpu   = -1;
+        out[count].generation = tomb->generation;
+
+        count++;
+    }
+    spin_unlock(&(p->fibers_lock));
+
+    rcu_read_unlock();
+
+    if(stale){
+        dbg("GetFiberStats, process %d dropped exits after generation %llu\n", tgid, since_generation);
+        return -ESTALE;
+    }
+
+    dbg("GetFiberStats, process %d reported %ld of %ld fibers\n", tgid, count, *total);
+
+    return count;
+}
+
+int kernelSetPreemption(pid_t tgid, pid_t pid, u64 slice_ns, pid_t sched_fid, int __user *critical){
+
+    struct process *p;
+    struct thread  *t;
+
+    if(slice_ns && slice_ns < FIBERS_MIN_SLICE_NS){
+        dbg("Error SetPreemption, [%d->%d] time slice of %llu ns is too short\n", tgid, pid, slice_ns);
+        return -EINVAL;
+    }
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error SetPreemption, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
+        return -ESRCH;
+    }
+
+    t = get_thread_by_id(pid, p);
+    if(!t){
+        dbg("Error SetPreemption, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
+        return -ESRCH;
+    }
+
+    if(sched_fid == -1) sched_fid = t->home_fid;
+    if(!get_fiber_by_id(sched_fid, p)){
+        dbg("Error SetPreemption, [%d->%d] scheduler fiber %d does not exist\n", tgid, pid, sched_fid);
+        return -ESRCH;
+    }
+
+    t->sched_fid = sched_fid;
+    t->critical  = critical;
+    WRITE_ONCE(p->slice_ns, slice_ns);
+
+    // Other threads pick the new slice up at their next switch
+    slice_start(p, t, t->active_fid);
+
+    dbg("SetPreemption, [%d->%d] time slice %llu ns, scheduler fiber %d\n", tgid, pid, slice_ns, sched_fid);
+
+    return SUCCESS;
+}
+
+int kernelEnablePerfCounters(pid_t tgid, pid_t pid, unsigned int flags){
+
+    struct process *p;
+    struct thread  *t;
+
+    if(flags & ~((1 << FIBER_PERF_COUNTERS) - 1)){
+        dbg("Error EnablePerfCounters, [%d->%d] unknown counters %x\n", tgid, pid, flags);
+        return -EINVAL;
+    }
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error EnablePerfCounters, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
+        return -ESRCH;
+    }
+
+    t = get_thread_by_id(pid, p);
+    if(!t){
+        dbg("Error EnablePerfCounters, [%d->%d] thread %d still not in %d->threads\n", tgid, pid, pid, tgid);
+        return -ESRCH;
+    }
+
+    // Other threads follow at their next switch, the calling thread right
+    // away so that a missing PMU is reported
+    WRITE_ONCE(p->perf_flags, flags);
+    t->perf_failed = 0;
+    thread_sync_perf(p, t);
+
+    if(t->perf_failed & flags){
+        dbg("Error EnablePerfCounters, [%d->%d] counters %x are not available\n", tgid, pid, t->perf_failed & flags);
+        return -EOPNOTSUPP;
+    }
+
+    return SUCCESS;
+}
+
+int kernelSetFiberAffinity(pid_t tgid, pid_t pid, pid_t fid, const unsigned long __user *mask, int size){
+
+    struct process *p;
+    struct fiber   *f;
+    struct cpumask *new;
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error SetFiberAffinity, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
+        return -ESRCH;
+    }
+
+    f = get_fiber_by_id(fid, p);
+    if(!f) f = fork_lookup(p, fid);
+    if(!f){
+        dbg("Error SetFiberAffinity, [%d->%d] fiber %d not created yet\n", tgid, pid, fid);
+        return -ESRCH;
+    }
+
+    if(size <= 0){
+        WRITE_ONCE(f->affinity, NULL);
+        return SUCCESS;
+    }
+
+    new = kmalloc(cpumask_size(), GFP_KERNEL);
+    if(!new) return -ENOMEM;
+
+    cpumask_clear(new);
+    if(copy_from_user(new, mask, min_t(size_t, size, cpumask_size()))){
+        log("SetFiberAffinity, error Unable to copy_from_user");
+        kfree(new);
+        return -EFAULT;
+    }
+    cpumask_and(new, new, cpu_possible_mask);
+
+    if(!cpumask_intersects(new, cpu_online_mask)){
+        dbg("Error SetFiberAffinity, [%d->%d] no online cpu for fiber %d\n", tgid, pid, fid);
+        kfree(new);
+        return -EINVAL;
+    }
+
+    // The buffer is never freed before the fiber, so a switch reading the
+    // mask while it is updated in place sees at worst a mix of both masks.
+    // Not a change fork images track: a forked child may see the new mask.
+    if(cmpxchg(&(f->info->affinity_buf), NULL, new) != NULL){
+        cpumask_copy(f->info->affinity_buf, new);
+        kfree(new);
+    }
+    WRITE_ONCE(f->affinity, f->info->affinity_buf);
+
+    dbg("SetFiberAffinity, [%d->%d] fiber %d pinned to %*pbl\n", tgid, pid, fid, cpumask_pr_args(f->affinity));
+
+    return SUCCESS;
+}
+
+int kernelGetFiberLastCpu(pid_t tgid, pid_t fid){
+
+    struct process *p;
+    struct fiber   *f;
+
+    p = get_process_by_id(tgid);
+    if(!p) return -ESRCH;
+
+    f = get_fiber_by_id(fid, p);
+    if(!f) return -ESRCH;
+
+    return READ_ONCE(f->last_cpu) >= 0 ? READ_ONCE(f->last_cpu) : -ENODATA;
+}
+
+int kernelGetFiberStack(pid_t tgid, pid_t pid, struct fiber_stack_args *stack){
+
+    struct process *p;
+    struct thread  *t;
+    struct fiber   *f;
+
+    p = get_process_by_id(tgid);
+    if(!p) return -ESRCH;
+
+    t = get_thread_by_id(pid, p);
+    if(!t) return -ESRCH;
+
+    f = get_fiber_by_id(t->active_fid, p);
+    if(!f) return -ESRCH;
+
+    stack->stack_base = f->stack_base;
+    stack->stack_size = f->stack_size;
+    return SUCCESS;
+}
+
+int kernelEnableFlightRecorder(pid_t tgid, pid_t pid, unsigned long events){
+
+    struct process *p;
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error EnableFlightRecorder, [%d->%d] process %d has no fibers yet.\n", tgid, pid, tgid);
+        return -ESRCH;
+    }
+
+    return recorder_alloc(p, events);
+}
+
+void freeFiber(struct process *p, struct fiber *f){
     
+    fork_before_change(p, f);
+
     // Free fiber stack?
     
     // Delete entry from hashtable
+    spin_lock(&(p->fibers_lock));
     hash_del_rcu(&(f->fnext));
+    spin_unlock(&(p->fibers_lock));
+
+    live_stats_count(p, exited, 1);
+    live_stats_update(p, s, {
+        s->fibers--;
+        if(f->used_fls){
+            s->fls_fibers--;
+            s->fls_bytes -= FLS_FOOTPRINT;
+        }
+    });
+
+    // Waits for pending /proc readers, which look the fiber up by id
+    fibers_proc_remove_fiber(f);
     
     // Free FLS-related fields, if FLS was used
-    if(f->used_fls){
-        dbg("freeFiber, [%d] used FLS, freeing it\n", f->fid);
-        dbg("freeFiber, [%d] freeing f->fls\n", f->fid);
-        vfree(f->fls);
-
-        dbg("freeFiber, [%d] freeing bitmaps\n", f->fid);
-        bitmap_free(f->fls_used_bmp);
-        bitmap_free(f->fls_pointed_bmp);
-
-        dbg("freeFiber, [%d] freeing f->free_ll\n", f->fid);
-        while(f->free_ll){
-            ll_old = f->free_ll;
-            f->free_ll = f->free_ll->next;
-            vfree(ll_old);
-        }
-    } else {
-        dbg("freeFiber, [%d] had never used FLS\n", f->fid);
-    }
+    fls_destroy(f);
     
-    // Free struct fiber itself
+    // Free struct fiber itself, GetFiberStats and /proc walk the table
+    // under RCU only
     dbg("freeFiber, [%d] freeing the struct fiber itself\n", f->fid);
-    kfree(f);
+    fiber_release_rcu(f);
 }
 
 
@@ -754,6 +1726,8 @@ void kernelProcCleanup(pid_t tgid){
     struct process  *p;
     struct thread   *t;
     struct fiber    *f;
+    struct fiber_tombstone *ring;
+    unsigned long flags;
     int bucket;
 
     log("kernelProcCleanup for process %d\n",tgid);
@@ -764,6 +1738,9 @@ void kernelProcCleanup(pid_t tgid){
         return;
     }
     
+    // Images taken for children get what they still miss
+    fork_parent_exit(p);
+
     // Iterate over all fibers in the table of p
     hash_for_each_rcu(p->fibers, bucket, f, fnext){
         if (f==NULL) break; // Cleaned all fibers
@@ -771,7 +1748,7 @@ void kernelProcCleanup(pid_t tgid){
         dbg("kernelProcCleanup, freeing fiber %d.\n", f->fid);
         
         // Cleanup after the fiber
-        freeFiber(f);
+        freeFiber(p, f);
     }
     
     // Iterate over all threads in the table of p
@@ -780,21 +1757,50 @@ void kernelProcCleanup(pid_t tgid){
         
         dbg("kernelProcCleanup, freeing thread %d.\n", t->pid);
         
-        // Delete entry from hashtable
-        hash_del_rcu(&(t->tnext));
-        // Free the struct thread itself
-        kfree(t);
+        thread_release(p, t);
     }
     
+    // Fiber entries are gone already, drop /proc/fibers/<tgid>
+    fibers_proc_remove_process(p);
+    latency_free(p);
+    recorder_free(p);
+    live_stats_free(p);
+    fork_child_exit(p);
+
+    spin_lock(&(p->fibers_lock));
+    ring = p->exited;
+    p->exited = NULL;
+    spin_unlock(&(p->fibers_lock));
+    kfree(ring);
+
     // Remove the process entry from hashtable
+    spin_lock_irqsave(&processes_lock,flags);
     hash_del_rcu(&(p->pnext));
-    // Free the struct process itself
-    kfree(p);
+    spin_unlock_irqrestore(&processes_lock,flags);
+    // Free the struct process itself, once lookups from other processes
+    // are done with it
+    kfree_rcu(p, rcu);
     
     return;
 
 }
 
+int kernelModInit(){
+
+    // fxsave needs 16 byte alignment, a cache line keeps it whole
+    fxregs_cache = kmem_cache_create("fiber_fxregs", sizeof(struct fxregs_state),
+                                     L1_CACHE_BYTES, 0, NULL);
+    if(!fxregs_cache){
+        log("Error creating the fpu state cache\n");
+        return -ENOMEM;
+    }
+
+    log("struct fiber %zu B, fiber_info %zu B, fpu state %zu B from the first switch\n",
+        sizeof(struct fiber), sizeof(struct fiber_info), sizeof(struct fxregs_state));
+
+    return SUCCESS;
+}
+
 void kernelModCleanup(){
     
     struct process  *p;
@@ -812,5 +1818,9 @@ void kernelModCleanup(){
         kernelProcCleanup(p->tgid);
     }
     
+    // Fibers freed by the cleanup still wait for a grace period
+    rcu_barrier();
+    kmem_cache_destroy(fxregs_cache);
+
     dbg("kernelModCleanup done.\n");
 }
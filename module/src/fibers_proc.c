@@ -1,142 +1,401 @@
 #include "fibers_proc.h"
+#include "latency.h"
 
-struct file_operations fiber_fops = {
-				read: fiber_read,
-};
+#include <linux/uaccess.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/ptrace.h>
+#include <linux/sched/task.h>
 
-struct dentry* fiber_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags){
+static struct proc_dir_entry *fibers_proc_root;
 
-	struct dentry      *ret;
 
-	struct task_struct *task = get_pid_task(proc_pid(dir), PIDTYPE_PID);
-	struct process     *process;
+// The entries show code addresses and stack usage: like /proc/<pid>, only
+// whoever may ptrace a process may open its entries
+static int fibers_proc_may_read(pid_t tgid){
 
-	int                 bkt, fiber_i = 0;
-	struct fiber       *fiber_p;
+	struct task_struct *task;
+	int allowed;
 
-	unsigned long       nents;
-	struct pid_entry   *fiber_entries;
+	rcu_read_lock();
+	task = pid_task(find_pid_ns(tgid, &init_pid_ns), PIDTYPE_PID);
+	if(task) get_task_struct(task);
+	rcu_read_unlock();
 
+	if(!task) return 0;
 
-	if(task == NULL )
-		return ERR_PTR(-ENOENT);
+	allowed = ptrace_may_access(task, PTRACE_MODE_READ_FSCREDS);
+	put_task_struct(task);
 
-	process = get_process_by_id(task->tgid);
+	return allowed;
+}
 
-	if (process==NULL) return 0;
 
-	nents = atomic_read(&(process->last_fid));
+// Both ids are encoded in the path: /proc/fibers/<tgid>/<fid>
+static int fiber_ids_from_file(struct file *filp, pid_t *tgid, pid_t *fid){
 
-	fiber_entries = kmalloc(nents * sizeof(struct pid_entry), GFP_KERNEL);
-	memset(fiber_entries, 0, nents * sizeof(struct pid_entry));
+	struct dentry *dentry = filp->f_path.dentry;
 
-	hash_for_each_rcu(process->fibers, bkt, fiber_p, fnext){
+	if(kstrtoint(dentry->d_name.name, 10, fid))
+		return -ENOENT;
+	if(kstrtoint(dentry->d_parent->d_name.name, 10, tgid))
+		return -ENOENT;
 
-		fiber_entries[fiber_i].name = fiber_p->name;
-		fiber_entries[fiber_i].len = strlen(fiber_entries[fiber_i].name);
-		fiber_entries[fiber_i].mode = (S_IFREG|(S_IRUGO));
-		fiber_entries[fiber_i].iop = NULL;
-		fiber_entries[fiber_i].fop = &fiber_fops;
+	return 0;
+}
 
-		fiber_i++;
+static int fiber_show(struct seq_file *m, void *v){
 
-	}
+	struct process *p;
+	struct fiber   *f;
+	struct cpumask *affinity;
 
-	ret = lookup(dir, dentry, fiber_entries, nents);
-	kfree(fiber_entries);
-	return ret;
+	unsigned long ids = (unsigned long) m->private;
+	pid_t tgid = ids >> 32;
+	pid_t fid  = ids & 0xffffffff;
+	int active_pid, b;
 
+	p = get_process_by_id(tgid);
+	if(p == NULL)
+		return -ENOENT;
+
+	f = get_fiber_by_id(fid, p);
+	if(f == NULL)
+		return -ENOENT;
+
+	active_pid = atomic_read(&(f->active_pid));
+
+	seq_printf(m,
+		"Currently Running: %s\n"\
+		"Start Address: 0x%016lx\n"\
+		"Created From: %d\n"\
+		"Tot Activations: %lu\n"\
+		"Tot Failed Activations: %ld\n"\
+		"Total Execution Time: %lu\n"\
+		"Last CPU: %d\n"\
+		"NUMA Node: %d\n"\
+		"Local Activations: %lu\n"\
+		"Remote Activations: %lu\n"\
+		"Preemptions: %lu\n"\
+		"Minor Faults: %lu\n"\
+		"Major Faults: %lu\n"\
+		"Voluntary Context Switches: %lu\n"\
+		"Involuntary Context Switches: %lu\n"\
+		"Instructions: %llu\n"\
+		"Cycles: %llu\n"\
+		"Max Run Length: %llu ns\n"\
+		"Run Lengths (<10us <100us <1ms <10ms <100ms longer):",
+			(active_pid >0) ? "yes" : "no",
+			(unsigned long)f->info->entry_point,
+			f->info->parent,
+			f->activations,
+			atomic_long_read(&(f->info->failed_activations)),
+			f->info->total_running_time,
+			f->last_cpu,
+			f->node,
+			f->local_activations,
+			f->remote_activations,
+			f->info->preemptions,
+			f->info->min_flt,
+			f->info->maj_flt,
+			f->info->nvcsw,
+			f->info->nivcsw,
+			f->info->perf[0],
+			f->info->perf[1],
+			f->info->max_run_ns);
+
+	for(b=0; b<FIBER_RUN_BUCKETS; b++)
+		seq_printf(m, " %lu", f->info->run_hist[b]);
+
+	seq_printf(m, "\n"\
+		"Parked Time: %llu ns\n"\
+		"Last Deactivation: %llu ns\n"\
+		"Stack Size: %lu\n"\
+		"Stack High Water Mark: %lu\n"\
+		"Last Thread: %d\n"\
+		"CPU Migrations: %lu\n"\
+		"Thread Migrations: %lu\n",
+			f->info->parked_ns,
+			f->info->switch_out_ns,
+			f->stack_size,
+			f->info->stack_hwm,
+			f->last_pid,
+			f->info->cpu_migrations,
+			f->info->thread_migrations);
+
+	affinity = READ_ONCE(f->affinity);
+	if(affinity)
+		seq_printf(m, "Affinity: %*pbl\n\n", cpumask_pr_args(affinity));
+	else
+		seq_puts(m, "Affinity: any\n\n");
+
+	return 0;
 }
 
-int fiber_readdir(struct file *file, struct dir_context *ctx){
+static int fiber_open(struct inode *inode, struct file *filp){
 
-	int                 ret;
+	pid_t tgid, fid;
+	int ret;
 
-	struct task_struct *task = get_pid_task(proc_pid(file_inode(file)), PIDTYPE_PID);
-	struct process     *process;
+	ret = fiber_ids_from_file(filp, &tgid, &fid);
+	if(ret)
+		return ret;
 
-	int                 bkt, fiber_i = 0;
-	struct fiber       *fiber_p;
+	if(!fibers_proc_may_read(tgid))
+		return -EACCES;
 
-	unsigned long       nents;
-	struct pid_entry   *fiber_entries;
+	return single_open(filp, fiber_show,
+			(void *)(((unsigned long) tgid << 32) | (u32) fid));
+}
+
+static const struct file_operations fiber_fops = {
+	.owner   = THIS_MODULE,
+	.open    = fiber_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+
+// /proc/fibers/<tgid>/latency, reading it shows the ioctl latency
+// histograms of the process, writing anything to it resets them
+static const char * const latency_names[LAT_KINDS] = {
+	[LAT_SWITCH] = "SwitchToFiber",
+	[LAT_CREATE] = "CreateFiber",
+};
+
+static int latency_show(struct seq_file *m, void *v){
 
+	struct process *p;
+	struct latency_hist *h;
+	pid_t tgid = (pid_t)(unsigned long) m->private;
+	int kind, b;
 
-	if(task == NULL)
+	p = get_process_by_id(tgid);
+	if(p == NULL)
 		return -ENOENT;
 
-	process = get_process_by_id(task->tgid);
+	h = kmalloc(sizeof(struct latency_hist), GFP_KERNEL);
+	if(h == NULL)
+		return -ENOMEM;
+
+	for(kind=0; kind<LAT_KINDS; kind++){
+
+		latency_sum(p, kind, h);
+
+		seq_printf(m,
+			"%s\n"\
+			"Count: %llu\n"\
+			"Mean: %llu ns\n"\
+			"Max: %llu ns\n"\
+			"p50: %llu ns\n"\
+			"p90: %llu ns\n"\
+			"p99: %llu ns\n"\
+			"p99.9: %llu ns\n"\
+			"p99.99: %llu ns\n"\
+			"Buckets (ns <=, count):\n",
+				latency_names[kind],
+				h->total,
+				h->total ? div64_u64(h->sum, h->total) : 0,
+				h->max,
+				latency_percentile(h, 500000),
+				latency_percentile(h, 900000),
+				latency_percentile(h, 990000),
+				latency_percentile(h, 999000),
+				latency_percentile(h, 999900));
+
+		for(b=0; b<LAT_BUCKETS; b++)
+			if(h->count[b])
+				seq_printf(m, "%llu %llu\n", latency_bucket_limit(b), h->count[b]);
+
+		seq_putc(m, '\n');
+	}
+
+	kfree(h);
+	return 0;
+}
 
-	if (process==NULL) return 0;
+static int latency_open(struct inode *inode, struct file *filp){
 
-	nents = atomic_read(&(process->last_fid));
+	pid_t tgid;
 
-	fiber_entries = kmalloc(nents * sizeof(struct pid_entry), GFP_KERNEL);
-	memset(fiber_entries, 0, nents * sizeof(struct pid_entry));
+	if(kstrtoint(filp->f_path.dentry->d_parent->d_name.name, 10, &tgid))
+		return -ENOENT;
 
-	hash_for_each_rcu(process->fibers, bkt, fiber_p, fnext){
+	if(!fibers_proc_may_read(tgid))
+		return -EACCES;
 
-		fiber_entries[fiber_i].name = fiber_p->name;
-		fiber_entries[fiber_i].len = strlen(fiber_entries[fiber_i].name);
-		fiber_entries[fiber_i].mode = (S_IFREG|(S_IRUGO));
-		fiber_entries[fiber_i].iop = NULL;
-		fiber_entries[fiber_i].fop = &fiber_fops;
+	return single_open(filp, latency_show, (void *)(unsigned long) tgid);
+}
 
-		fiber_i++;
+static ssize_t latency_write(struct file *filp, const char __user *buf,
+			size_t count, loff_t *ppos){
 
-	}
+	struct seq_file *m = filp->private_data;
+	struct process *p;
 
-	ret = readdir(file, ctx, fiber_entries, nents);
-	kfree(fiber_entries);
-	return ret;
+	p = get_process_by_id((pid_t)(unsigned long) m->private);
+	if(p == NULL)
+		return -ENOENT;
 
+	latency_reset(p);
+	return count;
 }
 
+static const struct file_operations latency_fops = {
+	.owner   = THIS_MODULE,
+	.open    = latency_open,
+	.read    = seq_read,
+	.write   = latency_write,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
 
-ssize_t fiber_read(struct file *filp, char __user *buf, size_t buf_size, loff_t *offset){
-	
-	char fiber_dump[DUMP_SIZE];
-	int dump_len,byte_to_copy;
+// /proc/fibers/<tgid>/stacks, fibers of the process by stack high-water
+// mark, to size their stacks. Buckets double from 512 bytes.
+#define STACK_BUCKETS 10
+
+static int stacks_show(struct seq_file *m, void *v){
 
 	struct process *p;
 	struct fiber   *f;
+	pid_t tgid = (pid_t)(unsigned long) m->private;
+	unsigned long count[STACK_BUCKETS] = {0};
+	unsigned long limit, fibers = 0, converted = 0;
+	unsigned long max_hwm = 0, max_pct = 0;
+	pid_t max_fid = -1;
+	int bkt, b;
+
+	p = get_process_by_id(tgid);
+	if(p == NULL)
+		return -ENOENT;
 
-	unsigned long fiber_id=0;
-	int active_pid;
+	// Fibers exiting meanwhile are freed after a grace period
+	rcu_read_lock();
+	hash_for_each_rcu(p->fibers, bkt, f, fnext){
+
+		if(!f->stack_size){
+			converted++;
+			continue;
+		}
+
+		fibers++;
+		limit = 512;
+		for(b=0; b<STACK_BUCKETS-1 && f->info->stack_hwm>=limit; b++)
+			limit *= 2;
+		count[b]++;
+
+		if(f->info->stack_hwm > max_hwm){
+			max_hwm = f->info->stack_hwm;
+			max_fid = f->fid;
+		}
+		if(f->info->stack_hwm * 100 / f->stack_size > max_pct)
+			max_pct = f->info->stack_hwm * 100 / f->stack_size;
+	}
+	rcu_read_unlock();
+
+	seq_printf(m,
+		"Fibers: %lu\n"\
+		"Converted Threads: %lu\n"\
+		"Max High Water Mark: %lu (fiber %d)\n"\
+		"Max Stack Usage: %lu%%\n"\
+		"Buckets (bytes <, count):\n",
+			fibers, converted, max_hwm, max_fid, max_pct);
+
+	limit = 512;
+	for(b=0; b<STACK_BUCKETS-1; b++, limit *= 2)
+		seq_printf(m, "%lu %lu\n", limit, count[b]);
+	seq_printf(m, "larger %lu\n", count[STACK_BUCKETS-1]);
+
+	return 0;
+}
 
-	struct task_struct *task = get_pid_task(proc_pid(file_inode(filp)), PIDTYPE_PID);
+static int stacks_open(struct inode *inode, struct file *filp){
 
-	kstrtoul(filp->f_path.dentry->d_name.name, 10, &fiber_id);
+	pid_t tgid;
 
-	p = get_process_by_id(task->tgid);
-	f = get_fiber_by_id(fiber_id,p);
+	if(kstrtoint(filp->f_path.dentry->d_parent->d_name.name, 10, &tgid))
+		return -ENOENT;
 
-	active_pid = atomic_read(&(f->active_pid));
+	if(!fibers_proc_may_read(tgid))
+		return -EACCES;
 
-	snprintf(fiber_dump, DUMP_SIZE,
-		"Currently Running: %s\n"\
-		"Start Address: 0x%016lx\n"\
-		"Created From: %d\n"\
-		"Tot Activations: %lu\n"\
-		"Tot Failed Activations: %ld\n"\
-		"Total Execution Time: %lu\n\n",
-			(active_pid >0) ? "yes" : "no",
-			(unsigned long)f->entry_point,
-			f->parent,
-			f->activations,
-			atomic64_read(&(f->failed_activations)),
-			f->total_running_time);
+	return single_open(filp, stacks_show, (void *)(unsigned long) tgid);
+}
+
+static const struct file_operations stacks_fops = {
+	.owner   = THIS_MODULE,
+	.open    = stacks_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+};
+
+
+int init_fibers_proc(void){
+
+	fibers_proc_root = proc_mkdir(FIBERS_PROC_ROOT, NULL);
+	if(fibers_proc_root == NULL){
+		log("Error creating /proc/%s.\n", FIBERS_PROC_ROOT);
+		return ERROR;
+	}
+
+	return SUCCESS;
+}
 
-	dump_len = strnlen(fiber_dump, DUMP_SIZE);
-	if (*offset >= dump_len)
-		return 0;
+void destroy_fibers_proc(void){
 
-	byte_to_copy =
-		(buf_size<(dump_len-*offset-1)) ? buf_size : dump_len-(*offset)-1;
+	proc_remove(fibers_proc_root);
+	fibers_proc_root = NULL;
+}
+
+int fibers_proc_add_process(struct process *p){
+
+	char name[16];
+
+	snprintf(name, sizeof(name), "%d", p->tgid);
+
+	p->proc_dir = proc_mkdir(name, fibers_proc_root);
+	if(p->proc_dir == NULL){
+		dbg("Error creating /proc/%s/%s.\n", FIBERS_PROC_ROOT, name);
+		return ERROR;
+	}
+
+	if(proc_create(FIBERS_PROC_LATENCY, S_IRUGO | S_IWUSR, p->proc_dir, &latency_fops) == NULL)
+		dbg("Error creating /proc/%s/%s/%s.\n", FIBERS_PROC_ROOT, name, FIBERS_PROC_LATENCY);
+
+	if(proc_create(FIBERS_PROC_STACKS, S_IRUGO, p->proc_dir, &stacks_fops) == NULL)
+		dbg("Error creating /proc/%s/%s/%s.\n", FIBERS_PROC_ROOT, name, FIBERS_PROC_STACKS);
+
+	return SUCCESS;
+}
 
-	if (copy_to_user(buf, fiber_dump+*offset, byte_to_copy)) {
-				return -EFAULT;
+void fibers_proc_remove_process(struct process *p){
+
+	// Removes the fiber entries as well, waiting for pending readers
+	proc_remove(p->proc_dir);
+	p->proc_dir = NULL;
+}
+
+int fibers_proc_add_fiber(struct process *p, struct fiber *f){
+
+	f->info->proc_entry = NULL;
+
+	if(p->proc_dir == NULL)
+		return ERROR;
+
+	f->info->proc_entry = proc_create(f->info->name, S_IRUGO, p->proc_dir, &fiber_fops);
+	if(f->info->proc_entry == NULL){
+		dbg("Error creating /proc entry for fiber %d.\n", f->fid);
+		return ERROR;
 	}
-	*offset += byte_to_copy;
-	return byte_to_copy;
+
+	return SUCCESS;
+}
+
+void fibers_proc_remove_fiber(struct fiber *f){
+
+	proc_remove(f->info->proc_entry);
+	f->info->proc_entry = NULL;
 }
@@ -0,0 +1,220 @@
+#include "fls.h"
+
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+
+
+int fls_is_allocated(struct fiber *f, long index){
+
+    if(index>=FLS_SIZE || index < 0) return 0;
+
+    return f->used_fls && test_bit(index, f->fls_used_bmp);
+}
+
+long fls_alloc(struct fiber *f){
+
+    struct fls_free_ll * ll_old;
+    long index;
+
+    // Check if fiber already has used FLS
+    if(!f->used_fls){
+
+        dbg("FlsAlloc, [%d] fiber had never used FLS, initializing\n", f->fid);
+
+        // FLS was never used yet, set it up
+        // Alloc space
+        f->fls = vmalloc_node(sizeof(long long) * FLS_SIZE, f->node);
+
+        // Setup LL for free entries
+        f->free_ll = vmalloc_node(sizeof(struct fls_free_ll), f->node);
+        f->free_ll->index = 1;
+        f->free_ll->next = NULL;
+
+        dbg("FlsAlloc, [%d] linked list set up\n", f->fid);
+
+        // Setup the bitmaps
+        f->fls_used_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
+        bitmap_clear(f->fls_used_bmp, 0, FLS_SIZE);
+
+        f->fls_pointed_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
+        bitmap_clear(f->fls_pointed_bmp, 0, FLS_SIZE);
+
+
+        // Bit 1 is pointed by LL - set bit in bitmap
+        set_bit(1, f->fls_pointed_bmp);
+
+        // Setup bmp
+        set_bit(0, f->fls_used_bmp);
+
+        dbg("FlsAlloc, [%d] bitmaps set up\n", f->fid);
+
+        index = 0;
+
+        // First intialization complete
+        f->used_fls = 1;
+
+    } else if(f->free_ll==NULL){ // FLS had already been used, but no
+                                 // pointer to free slot is found
+
+        // -> FLS is full
+        dbg("Error FlsAlloc, [%d] no more space is available in FLS\n", f->fid);
+        return ERROR;
+
+    } else { // FLS was already initialized
+
+        dbg("FlsAlloc, [%d] fiber has space in FLS\n", f->fid);
+
+        index = f->free_ll->index;
+
+        // Mark slot as used in the bitmap
+        set_bit(index, f->fls_used_bmp);
+
+        // Clear bit in pointed bmp
+        // Slot will not be pointed anymore in any case
+        clear_bit(index, f->fls_pointed_bmp);
+
+        dbg("FlsAlloc, [%d] got index, updated bitmaps\n", f->fid);
+
+        // We need to check that
+        // + The free bit is not the last one in the bitmap
+        // AND
+        // + The free bit is not followed by a zone pointed by another LL node
+        // AND
+        // + Whether the free zone continues or we need the next pointer
+        // THEN
+        // => if next bit is not pointed and not used, increment
+        //      index if it doesn't go above FLS_SIZE
+        if(index+1<FLS_SIZE && !test_bit(index+1, f->fls_pointed_bmp) && !test_bit(index+1, f->fls_used_bmp)){
+
+            dbg("FlsAlloc, [%d] the slot following the allocated one is free and not pointed by a node of linked list\n", f->fid);
+
+            f->free_ll->index = index+1;
+            set_bit(index+1, f->fls_pointed_bmp);
+
+        } else { // Either free zone ends or another LL node points the next
+
+            dbg("FlsAlloc, [%d] the slot following the allocated one is either used or pointed by a node of the linked list\n", f->fid);
+
+            ll_old = f->free_ll;
+            f->free_ll = f->free_ll->next;
+            vfree(ll_old);
+
+        }
+
+    }
+
+    return index;
+}
+
+int fls_free(struct fiber *f, long index){
+
+    struct fls_free_ll * ll_new;
+
+    // Check if FLS has been initialized and entry had been previously malloc-ed
+    if(!fls_is_allocated(f, index)){
+        dbg("Error FlsFree, [%d] tried freeing a non malloc-ed entry\n", f->fid);
+        return ERROR;    // Target entry does not exist
+    }
+
+    clear_bit(index, f->fls_used_bmp);
+    dbg("FlsFree, [%d] usage flag for index %ld cleared\n", f->fid, index);
+
+    // Freed bit does not follow a free area
+    if(!(index > 0 && !test_bit(index-1, f->fls_used_bmp))){
+
+        dbg("FlsFree, [%d] cleared bit does not follow a free area, I point it with a linkedList node\n", f->fid);
+
+        // Create LL node for this new free area
+        // Put new node at start of LL chain
+        ll_new = vmalloc_node(sizeof(struct fls_free_ll), f->node);
+        ll_new->index=index;
+        ll_new->next = f->free_ll;
+        f->free_ll = ll_new;
+
+        dbg("FlsFree, [%d] new head of the linkedList is at index: %ld\n", f->fid, f->free_ll->index);
+
+        dbg("FlsFree, [%d] next node points index: %ld\n", f->fid, f->free_ll->next==NULL ? -1 : f->free_ll->next->index);
+
+        // Bit at index index is now pointed by a LL element
+        set_bit(index, f->fls_pointed_bmp);
+
+    }
+
+    // If freed bit is preceeded by a free area, no action is needed, as
+    // it will be reached through the LL node pointing to preceding area
+
+    return SUCCESS;
+}
+
+void fls_destroy(struct fiber *f){
+
+    struct fls_free_ll * ll_old;
+
+    if(f->used_fls){
+        dbg("freeFiber, [%d] used FLS, freeing it\n", f->fid);
+        dbg("freeFiber, [%d] freeing f->fls\n", f->fid);
+        vfree(f->fls);
+
+        dbg("freeFiber, [%d] freeing bitmaps\n", f->fid);
+        bitmap_free(f->fls_used_bmp);
+        bitmap_free(f->fls_pointed_bmp);
+
+        dbg("freeFiber, [%d] freeing f->free_ll\n", f->fid);
+        while(f->free_ll){
+            ll_old = f->free_ll;
+            f->free_ll = f->free_ll->next;
+            vfree(ll_old);
+        }
+    } else {
+        dbg("freeFiber, [%d] had never used FLS\n", f->fid);
+    }
+}
+
+int fls_clone(struct fiber *dst, const struct fiber *src){
+
+    struct fls_free_ll *ll, **tail;
+
+    dst->used_fls = 0;
+    dst->fls = NULL;
+    dst->free_ll = NULL;
+    dst->fls_used_bmp = NULL;
+    dst->fls_pointed_bmp = NULL;
+
+    if(!src->used_fls) return SUCCESS;
+
+    dst->used_fls = 1;
+
+    dst->fls = vmalloc_node(sizeof(long long) * FLS_SIZE, dst->node);
+    dst->fls_used_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
+    dst->fls_pointed_bmp = bitmap_alloc(FLS_SIZE, GFP_KERNEL);
+    if(!dst->fls || !dst->fls_used_bmp || !dst->fls_pointed_bmp) goto fail;
+
+    memcpy(dst->fls, src->fls, sizeof(long long) * FLS_SIZE);
+    bitmap_copy(dst->fls_used_bmp, src->fls_used_bmp, FLS_SIZE);
+    bitmap_copy(dst->fls_pointed_bmp, src->fls_pointed_bmp, FLS_SIZE);
+
+    // Same free areas, in the same order
+    tail = &(dst->free_ll);
+    for(ll = src->free_ll; ll; ll = ll->next){
+        *tail = vmalloc_node(sizeof(struct fls_free_ll), dst->node);
+        if(!*tail) goto fail;
+        (*tail)->index = ll->index;
+        (*tail)->next = NULL;
+        tail = &((*tail)->next);
+    }
+
+    return SUCCESS;
+
+fail:
+    dbg("fls_clone, [%d] error allocating a copy of the FLS\n", src->fid);
+    vfree(dst->fls);
+    bitmap_free(dst->fls_used_bmp);
+    bitmap_free(dst->fls_pointed_bmp);
+    while(dst->free_ll){
+        ll = dst->free_ll;
+        dst->free_ll = ll->next;
+        vfree(ll);
+    }
+    dst->used_fls = 0;
+    return ERROR;
+}
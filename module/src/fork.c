@@ -0,0 +1,477 @@
+#include "fork.h"
+#include "fibers_proc.h"
+#include "fls.h"
+#include "live_stats.h"
+
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
+#include <linux/sched/signal.h>
+#include <linux/ktime.h>
+
+
+// Serializes everything below: images, their entries and copies, and the
+// inherited fibers of children
+static DEFINE_MUTEX(fork_mutex);
+
+// Images of every process, newest first
+static struct fork_image *images = NULL;
+
+
+static struct fork_entry *entry_find(struct fork_image *img, pid_t fid){
+
+    struct fork_entry *e;
+
+    hash_for_each_possible(img->entries, e, enext, fid){
+        if(e->fid == fid) return e;
+    }
+
+    return NULL;
+}
+
+// copy may be NULL, the fiber is not inherited then
+static int entry_add(struct fork_image *img, pid_t fid, struct fork_copy *copy){
+
+    struct fork_entry *e;
+
+    e = kmalloc(sizeof(struct fork_entry), GFP_KERNEL);
+    if(!e){
+        log("Fork image %d.%llu, error allocating the entry of fiber %d\n", img->tgid, img->seq, fid);
+        return ERROR;
+    }
+
+    e->fid = fid;
+    e->copy = copy;
+    if(copy) copy->refs++;
+    hash_add(img->entries, &(e->enext), fid);
+
+    return SUCCESS;
+}
+
+static struct fork_copy *copy_create(const struct fiber *src){
+
+    struct fork_copy *c;
+
+    c = kmalloc(sizeof(struct fork_copy), GFP_KERNEL);
+    if(!c){
+        log("Error copying fiber %d for a fork image\n", src->fid);
+        return NULL;
+    }
+
+    c->f = fiber_dup(src, src->node);
+    if(!c->f){
+        kfree(c);
+        return NULL;
+    }
+    c->refs = 0;
+
+    return c;
+}
+
+static void copy_put(struct fork_copy *c){
+
+    if(!c || --(c->refs) > 0) return;
+
+    fls_destroy(c->f);
+    fiber_release(c->f);
+    kfree(c);
+}
+
+static void image_free(struct fork_image *img){
+
+    struct fork_entry *e;
+    struct hlist_node *tmp;
+    int bucket;
+
+    hash_for_each_safe(img->entries, bucket, tmp, e, enext){
+        hash_del(&(e->enext));
+        copy_put(e->copy);
+        kfree(e);
+    }
+
+    dbg("Fork image %d.%llu freed\n", img->tgid, img->seq);
+    kfree(img);
+}
+
+// Drops the images nobody needs anymore, and the oldest images of p that
+// no child adopted beyond FORK_PENDING_MAX
+static void images_gc(struct process *p){
+
+    struct fork_image **pimg = &images;
+    struct fork_image *img;
+    int pending = 0;
+
+    while((img = *pimg)){
+        if(img->child == FORK_CHILD_PENDING && img->parent == p)
+            pending++;
+
+        if(img->child == FORK_CHILD_GONE ||
+           (img->child == FORK_CHILD_PENDING && !img->parent) ||
+           (img->child == FORK_CHILD_PENDING && img->parent == p && pending > FORK_PENDING_MAX)){
+            *pimg = img->next;
+            image_free(img);
+            continue;
+        }
+
+        pimg = &(img->next);
+    }
+}
+
+// Gives every image of p missing f a copy of it, with fork_mutex held
+static void __fork_preserve(struct process *p, struct fiber *f){
+
+    struct fork_image *img;
+    struct fork_copy *c = NULL;
+    int copied = 0;
+
+    for(img = images; img; img = img->next){
+        if(img->parent != p || img->child == FORK_CHILD_GONE) continue;
+        if(img->seq <= f->fork_seq || f->fid >= img->last_fid) continue;
+        if(entry_find(img, f->fid)) continue;
+
+        if(!copied){
+            c = copy_create(f);
+            copied = 1;
+        }
+
+        // Without an entry the child would see the fiber as it is now
+        if(entry_add(img, f->fid, c)) img->stale = 1;
+    }
+
+    // Images all took a reference, or none was needed
+    if(c && !c->refs){
+        c->refs = 1;
+        copy_put(c);
+    }
+
+    WRITE_ONCE(f->fork_seq, p->fork_seq);
+}
+
+void fork_preserve(struct process *p, struct fiber *f){
+
+    mutex_lock(&fork_mutex);
+    __fork_preserve(p, f);
+    mutex_unlock(&fork_mutex);
+}
+
+// Sets up a fiber of p with the state of src, booked by pid if not 0
+static struct fiber *fiber_clone(struct process *p, const struct fiber *src, pid_t pid){
+
+    struct fiber *f;
+
+    f = fiber_dup(src, src->node);
+    if(!f) return NULL;
+
+    atomic_set(&(f->active_pid), pid);
+    f->info->generation = atomic64_inc_return(&(p->generation));
+    f->fork_seq = 0;
+
+    spin_lock(&(p->fibers_lock));
+    hash_add_rcu(p->fibers, &(f->fnext), f->fid);
+    spin_unlock(&(p->fibers_lock));
+
+    fibers_proc_add_fiber(p, f);
+
+    if(f->used_fls){
+        live_stats_update(p, s, {
+            s->fls_fibers++;
+            s->fls_bytes += FLS_FOOTPRINT;
+        });
+    }
+
+    return f;
+}
+
+// Sets up the inherited fiber fid of p, with fork_mutex held
+static struct fiber *__fork_materialize(struct process *p, pid_t fid, pid_t pid){
+
+    struct fork_image *img = p->fork_from;
+    struct fork_entry *e;
+    struct fiber *src = NULL;
+    struct fiber *f = NULL;
+
+    // Not inherited, or already set up
+    if(!img || fid < 0 || fid >= img->last_fid || !test_bit(fid, p->fork_pending))
+        return get_fiber_by_id(fid, p);
+
+    e = entry_find(img, fid);
+    if(e){
+        if(e->copy) src = e->copy->f;
+    } else if(img->parent && !img->stale){
+        // Unchanged since the image was taken, the parent cannot change
+        // it without fork_mutex
+        src = get_fiber_by_id(fid, img->parent);
+    }
+
+    if(src){
+        f = fiber_clone(p, src, pid);
+        if(!f) return NULL;     // Out of memory, a later lookup retries
+        dbg("Fiber %d inherited by %d from %d\n", fid, p->tgid, img->tgid);
+    }
+
+    clear_bit(fid, p->fork_pending);
+
+    return f;
+}
+
+// Drops the image adopted by p, with fork_mutex held
+static void fork_release(struct process *p){
+
+    struct fork_image *img = p->fork_from;
+
+    if(!img) return;
+
+    img->child = FORK_CHILD_GONE;
+    WRITE_ONCE(p->fork_from, NULL);
+    bitmap_free(p->fork_pending);
+    p->fork_pending = NULL;
+
+    images_gc(p);
+}
+
+// Once every inherited fiber is set up the image is no longer needed
+static void fork_release_if_done(struct process *p){
+
+    struct fork_image *img = p->fork_from;
+
+    if(img && bitmap_empty(p->fork_pending, img->last_fid)) fork_release(p);
+}
+
+struct fiber *fork_materialize(struct process *p, pid_t fid){
+
+    struct fiber *f;
+
+    mutex_lock(&fork_mutex);
+    f = __fork_materialize(p, fid, 0);
+    fork_release_if_done(p);
+    mutex_unlock(&fork_mutex);
+
+    return f;
+}
+
+long kernelForkPrepare(pid_t tgid, pid_t pid){
+
+    struct process *p;
+    struct thread  *t;
+    struct fiber   *f;
+    struct fork_image *img;
+    struct fork_copy *c;
+    int bucket;
+    pid_t fid;
+    long seq;
+
+    dbg("kernelForkPrepare tgid:%d pid:%d\n", tgid, pid);
+
+    p = get_process_by_id(tgid);
+    if(!p){
+        dbg("Error ForkPrepare, process %d has no fibers\n", tgid);
+        return -ESRCH;
+    }
+
+    t = get_thread_by_id(pid, p);
+    if(!t){
+        dbg("Error ForkPrepare, thread %d is not a fiber\n", pid);
+        return -ESRCH;
+    }
+
+    mutex_lock(&fork_mutex);
+
+    // An image only covers fibers of p, inherited ones are set up first
+    if(p->fork_from){
+        for(fid = 0; fid < p->fork_from->last_fid; fid++){
+            if(test_bit(fid, p->fork_pending) && !__fork_materialize(p, fid, 0) &&
+               test_bit(fid, p->fork_pending))
+                goto fail;
+        }
+        fork_release(p);
+    }
+
+    img = kzalloc(sizeof(struct fork_image), GFP_KERNEL);
+    if(!img){
+        log("ForkPrepare, error allocating the image of %d\n", tgid);
+        goto fail;
+    }
+
+    img->tgid = tgid;
+    img->parent = p;
+    img->child = FORK_CHILD_PENDING;
+    img->fork_fid = t->active_fid;
+    img->home_fid = t->home_fid;
+    img->sched_fid = t->sched_fid;
+    hash_init(img->entries);
+
+    // The fiber of the forking thread is running, copy it right away
+    f = get_fiber_by_id(t->active_fid, p);
+    c = f ? copy_create(f) : NULL;
+    if(!c || entry_add(img, f->fid, c)){
+        copy_put(c);
+        kfree(img);
+        goto fail;
+    }
+
+    img->seq = p->fork_seq + 1;
+    img->next = images;
+    images = img;
+
+    // Pairs with the activation cmpxchg, see fork_before_change()
+    WRITE_ONCE(p->fork_seq, img->seq);
+    smp_mb();
+
+    img->last_fid = atomic_read(&(p->last_fid));
+
+    // Fibers running on other threads have no state to inherit
+    hash_for_each_rcu(p->fibers, bucket, f, fnext){
+        if(f->fid >= img->last_fid) continue;
+
+        if(f->fid != img->fork_fid && atomic_read(&(f->active_pid))){
+            if(entry_add(img, f->fid, NULL)) img->stale = 1;
+            continue;
+        }
+        img->fibers++;
+    }
+
+    images_gc(p);
+
+    seq = img->seq;
+    dbg("ForkPrepare, image %d.%ld of %ld fibers\n", tgid, seq, img->fibers);
+
+    mutex_unlock(&fork_mutex);
+
+    return seq;
+
+fail:
+    mutex_unlock(&fork_mutex);
+    return -ENOMEM;
+}
+
+pid_t kernelForkChild(pid_t tgid, pid_t pid, u64 seq){
+
+    struct process *p;
+    struct thread  *t;
+    struct fiber   *f;
+    struct fork_image *img;
+    unsigned long *pending;
+    pid_t ptgid;
+    pid_t fid;
+    long fibers;
+    int node = numa_node_id();
+    int ret = -ENOMEM;
+
+    dbg("kernelForkChild tgid:%d pid:%d seq:%llu\n", tgid, pid, seq);
+
+    if(get_process_by_id(tgid)){
+        dbg("Error ForkChild, process %d already has fibers\n", tgid);
+        return -EBUSY;
+    }
+
+    rcu_read_lock();
+    ptgid = rcu_dereference(current->real_parent)->tgid;
+    rcu_read_unlock();
+
+    mutex_lock(&fork_mutex);
+
+    for(img = images; img; img = img->next){
+        if(img->tgid == ptgid && img->seq == seq && img->child == FORK_CHILD_PENDING) break;
+    }
+    if(!img || !img->parent){
+        dbg("Error ForkChild, %d has no image %llu\n", ptgid, seq);
+        ret = -ENOENT;
+        goto fail;
+    }
+
+    pending = bitmap_zalloc(img->last_fid, GFP_KERNEL);
+    if(!pending){
+        log("ForkChild, error allocating the pending bitmap of %d\n", tgid);
+        goto fail;
+    }
+    bitmap_set(pending, 0, img->last_fid);
+
+    p = process_get_or_create(tgid);
+    if(!p){
+        bitmap_free(pending);
+        goto fail;
+    }
+    t = thread_create(p, pid, node);
+    if(IS_ERR(t)){
+        bitmap_free(pending);
+        ret = PTR_ERR(t);
+        goto unregister;
+    }
+
+    img->child = FORK_CHILD_ATTACHED;
+    p->fork_pending = pending;
+    WRITE_ONCE(p->fork_from, img);
+    atomic_set(&(p->last_fid), img->last_fid);
+
+    fid = img->fork_fid;
+    fibers = img->fibers;
+
+    // The forking fiber keeps running on this thread
+    f = __fork_materialize(p, fid, pid);
+    if(!f) goto unregister;
+
+    f->info->last_activation_time = current->utime;
+    f->info->switch_in_ns = ktime_get_ns();
+    f->last_cpu = raw_smp_processor_id();
+    f->last_pid = pid;
+
+    t->active_fid = fid;
+    t->home_fid = img->home_fid;
+    t->sched_fid = img->sched_fid;
+
+    fork_release_if_done(p);
+
+    mutex_unlock(&fork_mutex);
+
+    live_stats_update(p, s, {
+        s->threads = 1;
+        s->fibers = fibers;
+    });
+
+    dbg("ForkChild, %d adopted image %d.%llu, running fiber %d\n", tgid, ptgid, seq, fid);
+
+    return fid;
+
+fail:
+    mutex_unlock(&fork_mutex);
+    return ret;
+
+    // Leave nothing registered, or the next ForkChild would see a process
+    // with fibers already. The cleanup also hands the image back.
+unregister:
+    mutex_unlock(&fork_mutex);
+    kernelProcCleanup(tgid);
+    return ret;
+}
+
+void fork_parent_exit(struct process *p){
+
+    struct fork_image *img;
+    struct fiber *f;
+    int bucket;
+
+    if(!READ_ONCE(p->fork_seq)) return;   // Never forked
+
+    mutex_lock(&fork_mutex);
+
+    hash_for_each_rcu(p->fibers, bucket, f, fnext){
+        if(f->fork_seq != p->fork_seq) __fork_preserve(p, f);
+    }
+
+    for(img = images; img; img = img->next){
+        if(img->parent == p) img->parent = NULL;
+    }
+
+    images_gc(p);
+
+    mutex_unlock(&fork_mutex);
+}
+
+void fork_child_exit(struct process *p){
+
+    if(!READ_ONCE(p->fork_from)) return;
+
+    mutex_lock(&fork_mutex);
+    fork_release(p);
+    mutex_unlock(&fork_mutex);
+}
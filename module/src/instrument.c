@@ -0,0 +1,41 @@
+#include "instrument.h"
+
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+
+
+DEFINE_STATIC_KEY_TRUE(fiber_stats_key);
+DEFINE_STATIC_KEY_TRUE(latency_hist_key);
+
+// Module parameters backed by a static key
+static int key_param_set(const char *val, const struct kernel_param *kp){
+
+    struct static_key_true *key = kp->arg;
+    bool on;
+
+    if(kstrtobool(val, &on)) return -EINVAL;
+
+    if(on) static_branch_enable(key);
+    else   static_branch_disable(key);
+
+    dbg("%s %s\n", kp->name, on ? "on" : "off");
+    return 0;
+}
+
+static int key_param_get(char *buffer, const struct kernel_param *kp){
+
+    struct static_key_true *key = kp->arg;
+
+    return sprintf(buffer, "%c\n", static_key_enabled(key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops key_param_ops = {
+    .set = key_param_set,
+    .get = key_param_get,
+};
+
+module_param_cb(fiber_stats, &key_param_ops, &fiber_stats_key, 0644);
+MODULE_PARM_DESC(fiber_stats, "Account per-fiber metrics on every switch (default Y)");
+
+module_param_cb(latency_hist, &key_param_ops, &latency_hist_key, 0644);
+MODULE_PARM_DESC(latency_hist, "Keep the ioctl latency histograms (default Y)");
@@ -0,0 +1,112 @@
+#include "latency.h"
+
+#include <linux/slab.h>
+#include <linux/ktime.h>
+
+
+static int latency_bucket(u64 ns){
+
+    int msb;
+
+    if(ns < (1 << LAT_SUB_BITS)) return ns;
+    if(ns >> LAT_MAX_BITS) return LAT_BUCKETS - 1;
+
+    msb = fls64(ns) - 1;
+    return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+           ((ns >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+u64 latency_bucket_limit(int b){
+
+    int msb, sub;
+
+    if(b < (1 << LAT_SUB_BITS)) return b;
+
+    msb = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    sub = b & ((1 << LAT_SUB_BITS) - 1);
+    return (((u64) (1 << LAT_SUB_BITS) + sub + 1) << (msb - LAT_SUB_BITS)) - 1;
+}
+
+int latency_alloc(struct process *p){
+
+    p->latency = alloc_percpu(struct latency_percpu);
+    if(!p->latency){
+        dbg("Error allocating latency histograms of process %d\n", p->tgid);
+        return ERROR;
+    }
+
+    return SUCCESS;
+}
+
+void latency_free(struct process *p){
+
+    free_percpu(p->latency);
+    p->latency = NULL;
+}
+
+void __latency_record(struct process *p, int kind, u64 start_ns){
+
+    u64 ns = ktime_get_ns() - start_ns;
+    struct latency_percpu __percpu *latency;
+    struct latency_hist *h;
+
+    latency = READ_ONCE(p->latency);
+    if(!latency) return;    // Still being set up
+
+    // Only this cpu writes to its copy, with preemption disabled
+    h = &(get_cpu_ptr(latency)->kind[kind]);
+    h->count[latency_bucket(ns)]++;
+    h->total++;
+    h->sum += ns;
+    if(ns > h->max) h->max = ns;
+    put_cpu_ptr(latency);
+}
+
+void latency_sum(struct process *p, int kind, struct latency_hist *out){
+
+    struct latency_hist *h;
+    int cpu, b;
+
+    memset(out, 0, sizeof(struct latency_hist));
+    if(!p->latency) return;
+
+    for_each_possible_cpu(cpu){
+        h = &(per_cpu_ptr(p->latency, cpu)->kind[kind]);
+
+        for(b=0; b<LAT_BUCKETS; b++)
+            out->count[b] += READ_ONCE(h->count[b]);
+        out->total += READ_ONCE(h->total);
+        out->sum   += READ_ONCE(h->sum);
+        out->max    = max(out->max, READ_ONCE(h->max));
+    }
+}
+
+void latency_reset(struct process *p){
+
+    int cpu;
+
+    if(!p->latency) return;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(p->latency, cpu), 0, sizeof(struct latency_percpu));
+}
+
+u64 latency_percentile(struct latency_hist *h, unsigned int ppm){
+
+    u64 total = 0, rank;
+    int b;
+
+    // Recount, h->total may be off by the updates racing with the sum
+    for(b=0; b<LAT_BUCKETS; b++) total += h->count[b];
+    if(!total) return 0;
+
+    rank = div_u64(total * ppm, 1000000);
+    if(rank >= total) rank = total - 1;
+
+    for(b=0; b<LAT_BUCKETS; b++){
+        if(h->count[b] > rank) return latency_bucket_limit(b);
+        rank -= h->count[b];
+    }
+
+    return h->max;
+}
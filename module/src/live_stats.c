@@ -0,0 +1,62 @@
+#include "live_stats.h"
+
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+
+
+// Serializes teardown of the pages against mmap()
+static DEFINE_MUTEX(live_stats_mutex);
+
+int live_stats_alloc(struct process *p){
+
+    spin_lock_init(&(p->live_lock));
+
+    p->live_stats = (struct fiber_live_stats *) get_zeroed_page(GFP_KERNEL);
+    if(!p->live_stats){
+        log("Error allocating the live stats page of process %d\n", p->tgid);
+        return -ENOMEM;
+    }
+
+    return SUCCESS;
+}
+
+void live_stats_free(struct process *p){
+
+    mutex_lock(&live_stats_mutex);
+
+    // A mapped page holds a reference of its own and outlives free_page
+    if(p->live_stats) free_page((unsigned long) p->live_stats);
+    p->live_stats = NULL;
+
+    mutex_unlock(&live_stats_mutex);
+}
+
+int live_stats_mmap(pid_t tgid, struct vm_area_struct *vma){
+
+    struct process *p;
+    struct fiber_live_stats *s;
+    int ret;
+
+    if(vma->vm_end - vma->vm_start != PAGE_SIZE) return -EINVAL;
+
+    mutex_lock(&live_stats_mutex);
+
+    // p goes away after a grace period once tgid exits, the page only
+    // after live_stats_free(), which waits for live_stats_mutex
+    rcu_read_lock();
+    p = get_process_by_id(tgid);
+    s = p ? p->live_stats : NULL;
+    rcu_read_unlock();
+
+    if(!s){
+        dbg("Process %d has no live stats\n", tgid);
+        ret = -ENOENT;
+    } else {
+        ret = vm_insert_page(vma, vma->vm_start, virt_to_page(s));
+    }
+
+    mutex_unlock(&live_stats_mutex);
+
+    return ret;
+}
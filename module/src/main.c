@@ -3,7 +3,7 @@
 #include "fibers_driver.h"
 #include "fibers.h"
 
-#include "probes.h"
+#include "fibers_proc.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("AdrianoPi & Be-P");
@@ -15,18 +15,28 @@ static int __init ex0_init(void){
 
     log("Hello from kernel space!\n");
     dbg("DEBUG is ACTIVE");
-    init_driver();
-
-	register_fiber_kretprobe();
-	return SUCCESS;
+    if(kernelModInit()) return -ENOMEM;
+
+    // /proc/fibers has to be there before a process can open the device
+    if(init_fibers_proc()){
+        kernelModCleanup();
+        return -ENOMEM;
+    }
+    if(init_driver()){
+        destroy_fibers_proc();
+        kernelModCleanup();
+        return -EBUSY;
+    }
+
+    return SUCCESS;
 }
 
 static void __exit ex0_exit(void){
 
 
-	unregister_fiber_kretprobe();
-    kernelModCleanup();
     destroy_driver();
+    kernelModCleanup();
+    destroy_fibers_proc();
 
     log("Goodbye from kernel space!\n");
 
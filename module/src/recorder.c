@@ -0,0 +1,117 @@
+#include "recorder.h"
+
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+
+
+// Serializes setup and teardown of the rings against mmap()
+static DEFINE_MUTEX(recorder_mutex);
+
+static size_t recorder_size(unsigned int capacity){
+    return PAGE_ALIGN(sizeof(struct fiber_recorder) +
+                      (size_t) capacity * sizeof(struct fiber_event));
+}
+
+int recorder_alloc(struct process *p, unsigned long events){
+
+    struct fiber_recorder *r;
+
+    if(!events) events = RECORDER_DEFAULT_EVENTS;
+    if(events > RECORDER_MAX_EVENTS){
+        dbg("Flight recorder of %d, %lu events exceed the budget\n", p->tgid, events);
+        return -EINVAL;
+    }
+    events = roundup_pow_of_two(max_t(unsigned long, events, RECORDER_MIN_EVENTS));
+
+    mutex_lock(&recorder_mutex);
+
+    if(p->recorder){
+        mutex_unlock(&recorder_mutex);
+        return SUCCESS;
+    }
+
+    // Zeroed, and suitable for remap_vmalloc_range()
+    r = vmalloc_user(recorder_size(events));
+    if(!r){
+        mutex_unlock(&recorder_mutex);
+        log("Flight recorder of %d, error allocating %lu events\n", p->tgid, events);
+        return -ENOMEM;
+    }
+
+    r->capacity   = events;
+    r->event_size = sizeof(struct fiber_event);
+
+    // Writers only look at the ring once it is set up
+    smp_store_release(&(p->recorder), r);
+
+    mutex_unlock(&recorder_mutex);
+
+    dbg("Flight recorder of %d on, %lu events\n", p->tgid, events);
+    return SUCCESS;
+}
+
+void recorder_free(struct process *p){
+
+    mutex_lock(&recorder_mutex);
+
+    // Mapped pages hold a reference of their own and outlive the vfree
+    vfree(p->recorder);
+    p->recorder = NULL;
+
+    mutex_unlock(&recorder_mutex);
+}
+
+void __recorder_log(struct fiber_recorder *r, int type, pid_t from, pid_t to){
+
+    struct fiber_event *e;
+    u64 idx;
+
+    // Userspace can only read the ring, head is only updated here
+    idx = atomic64_inc_return((atomic64_t *) &(r->head)) - 1;
+    e = &(r->events[idx & (r->capacity - 1)]);
+
+    WRITE_ONCE(e->seq, 0);
+    smp_wmb();
+
+    e->ts_ns = ktime_get_ns();
+    e->type  = type;
+    e->cpu   = raw_smp_processor_id();
+    e->pid   = current->pid;
+    e->from  = from;
+    e->to    = to;
+
+    smp_wmb();
+    WRITE_ONCE(e->seq, idx + 1);
+}
+
+int recorder_mmap(pid_t tgid, struct vm_area_struct *vma){
+
+    struct process *p;
+    struct fiber_recorder *r;
+    int ret;
+
+    mutex_lock(&recorder_mutex);
+
+    // p goes away after a grace period once tgid exits, the ring only
+    // after recorder_free(), which waits for recorder_mutex
+    rcu_read_lock();
+    p = get_process_by_id(tgid);
+    r = p ? p->recorder : NULL;
+    rcu_read_unlock();
+
+    if(!r){
+        dbg("Flight recorder of %d is not on\n", tgid);
+        ret = -ENOENT;
+    } else if(vma->vm_end - vma->vm_start > recorder_size(r->capacity)){
+        ret = -EINVAL;
+    } else {
+        ret = remap_vmalloc_range(vma, r, 0);
+    }
+
+    mutex_unlock(&recorder_mutex);
+
+    return ret;
+}
@@ -0,0 +1,40 @@
+#include "fibers.h"
+
+DEFINE_HASHTABLE(processes,6);
+DEFINE_SPINLOCK(processes_lock); // processes hashtable spinlock.(RW LOCK?)
+
+inline struct process * get_process_by_id(pid_t tgid){
+
+    struct process *p;
+
+    hash_for_each_possible_rcu(processes, p, pnext, tgid){
+        if(p==NULL) break;
+        if(p->tgid==tgid) break;
+    }
+
+    return p;
+}
+
+inline struct thread * get_thread_by_id(pid_t pid, struct process * p){
+
+    struct thread *t;
+
+    hash_for_each_possible_rcu(p->threads, t, tnext, pid){
+        if(t==NULL) break;
+        if(t->pid==pid) break;
+    }
+
+    return t;
+}
+
+inline struct fiber * get_fiber_by_id(pid_t fid, struct process * p){
+
+    struct fiber *f;
+
+    hash_for_each_possible_rcu(p->fibers, f, fnext, fid){
+        if(f==NULL) break;
+        if(f->fid==fid) break;
+    }
+
+    return f;
+}
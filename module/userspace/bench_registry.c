@@ -0,0 +1,200 @@
+#include "fls.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Throughput of the fibers registry and FLS allocator, built in userspace.
+// Lookups follow the path of every ioctl: get_process_by_id() on the global
+// table, then get_fiber_by_id() on the per-process one.
+//
+// Usage: bench_registry [-n fibers] [-l lookups] [-t max_threads] [-r fls_rounds]
+
+static long nfibers     = 10000;
+static long nlookups    = 1000000;
+static int  max_threads = 4;
+static long fls_rounds  = 200;
+
+static struct process *proc;
+static volatile long   sink;
+
+
+static double now_s(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline unsigned long xorshift(unsigned long *s){
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// Same steps as kernelConvertThreadToFiber for a new process
+static struct process *create_process(pid_t tgid){
+    struct process *p = kmalloc(sizeof(struct process), GFP_KERNEL);
+
+    p->tgid = tgid;
+    atomic_set(&(p->last_fid), 0);
+    atomic64_set(&(p->generation), 0);
+    hash_init(p->fibers);
+    hash_init(p->threads);
+    hash_add_rcu(processes, &(p->pnext), p->tgid);
+    return p;
+}
+
+// Same steps as kernelCreateFiber, minus the cpu context
+static struct fiber *create_fiber(struct process *p){
+    struct fiber *f = kmalloc(sizeof(struct fiber), GFP_KERNEL);
+
+    f->fid = atomic_fetch_inc(&(p->last_fid));
+    atomic_set(&(f->active_pid), 0);
+    f->used_fls = 0;
+    hash_add_rcu(p->fibers, &(f->fnext), f->fid);
+    return f;
+}
+
+struct lookup_args{
+    long          n;
+    long          fid_range;    // Fids are drawn from [0, fid_range)
+    unsigned long seed;
+    long          found;
+};
+
+static void *lookup_thread(void *arg){
+    struct lookup_args *a = arg;
+    struct process *p;
+    struct fiber *f;
+
+    for (long i = 0; i < a->n; i++){
+        p = get_process_by_id(proc->tgid);
+        f = get_fiber_by_id(xorshift(&a->seed) % a->fid_range, p);
+        if (f) a->found++;
+    }
+    return NULL;
+}
+
+// Aggregate lookups/sec with threads concurrent readers
+static double bench_lookups(int threads, long fid_range){
+    pthread_t tid[threads];
+    struct lookup_args args[threads];
+    double t0, t1;
+    long found = 0;
+
+    t0 = now_s();
+    for (int i = 0; i < threads; i++){
+        args[i] = (struct lookup_args){ nlookups / threads, fid_range, 88172645463325252ul + i, 0 };
+        pthread_create(&tid[i], NULL, lookup_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++){
+        pthread_join(tid[i], NULL);
+        found += args[i].found;
+    }
+    t1 = now_s();
+
+    sink = found;
+    return (nlookups / threads) * threads / (t1 - t0);
+}
+
+static void bench_fls(double *allocs_per_sec, double *frees_per_sec, double *churn_per_sec){
+    struct fiber f = { 0 };
+    static long order[FLS_SIZE];
+    unsigned long seed = 1;
+    double t_alloc = 0, t_free = 0, t0;
+    long i, j, tmp, churn_ops = 0;
+
+    f.fid = 1;
+
+    // Fill the FLS, then free it in random order
+    for (long r = 0; r < fls_rounds; r++){
+        t0 = now_s();
+        for (i = 0; i < FLS_SIZE; i++) order[i] = fls_alloc(&f);
+        t_alloc += now_s() - t0;
+
+        for (i = FLS_SIZE - 1; i > 0; i--){
+            j = xorshift(&seed) % (i + 1);
+            tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+        }
+
+        t0 = now_s();
+        for (i = 0; i < FLS_SIZE; i++) fls_free(&f, order[i]);
+        t_free += now_s() - t0;
+    }
+
+    *allocs_per_sec = fls_rounds * FLS_SIZE / t_alloc;
+    *frees_per_sec  = fls_rounds * FLS_SIZE / t_free;
+
+    // Steady state around half occupancy, fragmented free list
+    for (i = 0; i < FLS_SIZE / 2; i++) order[i] = fls_alloc(&f);
+    t0 = now_s();
+    for (long r = 0; r < fls_rounds * FLS_SIZE; r++){
+        j = xorshift(&seed) % (FLS_SIZE / 2);
+        fls_free(&f, order[j]);
+        order[j] = fls_alloc(&f);
+        churn_ops += 2;
+    }
+    *churn_per_sec = churn_ops / (now_s() - t0);
+
+    fls_destroy(&f);
+}
+
+int main(int argc, char **argv){
+    double t0, inserts_per_sec, walk_ms;
+    double fls_alloc_rate, fls_free_rate, fls_churn_rate;
+    struct fiber *f;
+    int opt, bkt;
+    long walked = 0;
+
+    while ((opt = getopt(argc, argv, "n:l:t:r:")) != -1){
+        switch (opt){
+            case 'n': nfibers     = atol(optarg); break;
+            case 'l': nlookups    = atol(optarg); break;
+            case 't': max_threads = atoi(optarg); break;
+            case 'r': fls_rounds  = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n fibers] [-l lookups] [-t max_threads] [-r fls_rounds]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    // Some other processes in the global table, as on a real system
+    for (pid_t tgid = 1000; tgid < 1064; tgid++) create_process(tgid);
+    proc = create_process(getpid());
+
+    t0 = now_s();
+    for (long i = 0; i < nfibers; i++) create_fiber(proc);
+    inserts_per_sec = nfibers / (now_s() - t0);
+
+    t0 = now_s();
+    hash_for_each_rcu(proc->fibers, bkt, f, fnext) walked++;
+    walk_ms = (now_s() - t0) * 1000;
+
+    bench_fls(&fls_alloc_rate, &fls_free_rate, &fls_churn_rate);
+
+    printf("{\n  \"benchmark\": \"registry\",\n");
+    printf("  \"fibers\": %ld,\n  \"fibers_per_bucket\": %.1f,\n",
+           nfibers, (double) nfibers / HASH_SIZE(proc->fibers));
+    printf("  \"sizeof_struct_fiber\": %zu,\n", sizeof(struct fiber));
+    printf("  \"sizeof_fiber_info\": %zu,\n", sizeof(struct fiber_info));
+    printf("  \"fiber_switch_bytes\": %zu,\n", offsetof(struct fiber, fls));
+    printf("  \"inserts_per_sec\": %.0f,\n", inserts_per_sec);
+    printf("  \"table_walk_ms\": %.3f,\n", walk_ms);
+    printf("  \"lookups\": [");
+    for (int threads = 1; threads <= max_threads; threads *= 2){
+        printf("%s\n    {\"threads\": %d, \"hits_per_sec\": %.0f, \"misses_per_sec\": %.0f}",
+               threads == 1 ? "" : ",", threads,
+               bench_lookups(threads, nfibers),
+               bench_lookups(threads, 2 * nfibers));
+    }
+    printf("\n  ],\n");
+    printf("  \"fls_allocs_per_sec\": %.0f,\n", fls_alloc_rate);
+    printf("  \"fls_frees_per_sec\": %.0f,\n", fls_free_rate);
+    printf("  \"fls_churn_ops_per_sec\": %.0f\n}\n", fls_churn_rate);
+
+    return walked == nfibers ? 0 : 1;
+}
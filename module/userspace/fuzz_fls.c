@@ -0,0 +1,166 @@
+#include "fls.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Consistency checker for the FLS allocator of fls.c. Random sequences of
+// fls_alloc/fls_free (including invalid frees) are replayed against a
+// reference model, and after every operation the allocator state is
+// checked:
+//  - alloc returns a free in-range slot, and only fails when all are used
+//  - free fails exactly for slots that are not allocated
+//  - used bitmap matches the model
+//  - every free-list node points to a free slot, marked in the pointed
+//    bitmap, and every free slot is reachable from a node through a run of
+//    free slots, so no slot is ever lost
+// Every few thousand operations the FLS is replaced by a copy made with
+// fls_clone, as fork() does, which must pass the same checks.
+//
+// Usage: fuzz_fls [-n ops] [-r rounds] [-s seed]
+
+static unsigned char model[FLS_SIZE];
+static long          model_used;
+static long          full_hits;     // Allocations refused on a full FLS
+
+static int fail(unsigned int seed, long op, const char *what, long index){
+    fprintf(stderr, "fuzz_fls: seed %u op %ld: %s (index %ld)\n", seed, op, what, index);
+    return 1;
+}
+
+static int check_state(struct fiber *f, unsigned int seed, long op){
+    static unsigned char node_at[FLS_SIZE];
+    struct fls_free_ll *node;
+    long i, nodes = 0, pointed = 0;
+    int reachable;
+
+    if (!f->used_fls) return model_used ? fail(seed, op, "FLS not initialized", -1) : 0;
+
+    for (i = 0; i < FLS_SIZE; i++){
+        if (test_bit(i, f->fls_used_bmp) != model[i])
+            return fail(seed, op, "used bitmap differs from model", i);
+        if (test_bit(i, f->fls_pointed_bmp)) pointed++;
+        node_at[i] = 0;
+    }
+
+    for (node = f->free_ll; node; node = node->next){
+        if (node->index < 0 || node->index >= FLS_SIZE)
+            return fail(seed, op, "free list node out of range", node->index);
+        if (model[node->index])
+            return fail(seed, op, "free list node points to a used slot", node->index);
+        if (!test_bit(node->index, f->fls_pointed_bmp))
+            return fail(seed, op, "free list node not in pointed bitmap", node->index);
+        if (++nodes > FLS_SIZE)
+            return fail(seed, op, "free list has a cycle", -1);
+
+        node_at[node->index] = 1;
+    }
+
+    if (pointed != nodes)
+        return fail(seed, op, "pointed bitmap does not match free list", pointed);
+
+    // A free slot is reachable if a node points to it or to the free slot
+    // right before it
+    for (i = 0, reachable = 0; i < FLS_SIZE; i++){
+        if (model[i]){
+            reachable = 0;
+            continue;
+        }
+        reachable |= node_at[i];
+        if (!reachable)
+            return fail(seed, op, "free slot unreachable from the free list", i);
+    }
+
+    return 0;
+}
+
+static int run(unsigned int seed, long ops){
+    struct fiber f = { 0 };
+    long op, index;
+    int r;
+
+    srandom(seed);
+    memset(model, 0, sizeof(model));
+    model_used = 0;
+
+    for (op = 0; op < ops; op++){
+        // Drift between mostly-allocating and mostly-freeing phases so that
+        // both the full and the fragmented states are exercised
+        int alloc_pct = (op / 8192) % 2 ? 20 : 80;
+
+        r = random() % 100;
+
+        if (r < alloc_pct){
+            index = fls_alloc(&f);
+            if (index == ERROR){
+                if (model_used != FLS_SIZE)
+                    return fail(seed, op, "alloc failed with free slots", model_used);
+                full_hits++;
+            } else {
+                if (index < 0 || index >= FLS_SIZE)
+                    return fail(seed, op, "alloc returned out of range", index);
+                if (model[index])
+                    return fail(seed, op, "alloc returned a used slot", index);
+                model[index] = 1;
+                model_used++;
+            }
+        } else {
+            // Mostly valid frees, some random and out of range ones
+            index = random() % (FLS_SIZE + 16) - 8;
+            if (r < 95 && model_used){
+                do index = random() % FLS_SIZE; while (!model[index]);
+            }
+
+            int valid = index >= 0 && index < FLS_SIZE && model[index];
+            int ret   = fls_free(&f, index);
+
+            if ((ret == SUCCESS) != valid)
+                return fail(seed, op, valid ? "valid free failed" : "invalid free succeeded", index);
+            if (valid){
+                model[index] = 0;
+                model_used--;
+            }
+        }
+
+        if (check_state(&f, seed, op)) return 1;
+
+        if (op % 4096 == 4095){
+            struct fiber copy = f;
+
+            if (fls_clone(&copy, &f) != SUCCESS)
+                return fail(seed, op, "clone failed", -1);
+            fls_destroy(&f);
+            f = copy;
+            if (check_state(&f, seed, op)) return 1;
+        }
+    }
+
+    fls_destroy(&f);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    long ops = 50000, rounds = 4;
+    unsigned int seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:s:")) != -1){
+        switch (opt){
+            case 'n': ops    = atol(optarg); break;
+            case 'r': rounds = atol(optarg); break;
+            case 's': seed   = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n ops] [-r rounds] [-s seed]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    for (long i = 0; i < rounds; i++){
+        if (run(seed + i, ops)) return 1;
+    }
+
+    printf("fuzz_fls: %ld rounds of %ld operations OK, FLS found full %ld times\n",
+           rounds, ops, full_hits);
+    return 0;
+}
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_ASM_THREAD_INFO
+#define FIBERS_SHIM_ASM_THREAD_INFO
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_ATOMIC
+#define FIBERS_SHIM_LINUX_ATOMIC
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_BITMAP
+#define FIBERS_SHIM_LINUX_BITMAP
+#include "../shim.h"
+#endif
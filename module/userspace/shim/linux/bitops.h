@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_BITOPS
+#define FIBERS_SHIM_LINUX_BITOPS
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_HASHTABLE
+#define FIBERS_SHIM_LINUX_HASHTABLE
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_HRTIMER
+#define FIBERS_SHIM_LINUX_HRTIMER
+#include "../shim.h"
+#endif
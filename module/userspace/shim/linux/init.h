@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_INIT
+#define FIBERS_SHIM_LINUX_INIT
+#include "../shim.h"
+#endif
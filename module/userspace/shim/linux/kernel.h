@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_KERNEL
+#define FIBERS_SHIM_LINUX_KERNEL
+#include "../shim.h"
+#endif
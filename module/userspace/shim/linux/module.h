@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_MODULE
+#define FIBERS_SHIM_LINUX_MODULE
+#include "../shim.h"
+#endif
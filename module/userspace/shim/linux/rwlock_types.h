@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_RWLOCK_TYPES
+#define FIBERS_SHIM_LINUX_RWLOCK_TYPES
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_SCHED
+#define FIBERS_SHIM_LINUX_SCHED
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_SCHED_TASK_STACK
+#define FIBERS_SHIM_LINUX_SCHED_TASK_STACK
+#include "../../shim.h"
+#endif
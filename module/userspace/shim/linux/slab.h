@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_SLAB
+#define FIBERS_SHIM_LINUX_SLAB
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_SPINLOCK
+#define FIBERS_SHIM_LINUX_SPINLOCK
+#include "../shim.h"
+#endif
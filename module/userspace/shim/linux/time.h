@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_TIME
+#define FIBERS_SHIM_LINUX_TIME
+#include "../shim.h"
+#endif
@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_TOPOLOGY
+#define FIBERS_SHIM_LINUX_TOPOLOGY
+#include "../shim.h"
+#endif
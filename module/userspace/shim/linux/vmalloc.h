@@ -0,0 +1,4 @@
+#ifndef FIBERS_SHIM_LINUX_VMALLOC
+#define FIBERS_SHIM_LINUX_VMALLOC
+#include "../shim.h"
+#endif
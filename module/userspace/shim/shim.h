@@ -0,0 +1,307 @@
+#ifndef FIBERS_SHIM
+#define FIBERS_SHIM
+
+// Userspace stand-ins for the kernel APIs used by registry.c and fls.c.
+// Every <linux/...> and <asm/...> header they include resolves to a stub
+// in this directory that includes this file. Semantics follow the kernel
+// (hash functions, bucket selection, bitops), performance characteristics
+// are those of plain userspace memory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+typedef uint8_t  u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t  s64;
+
+#define likely(x)       __builtin_expect(!!(x), 1)
+#define unlikely(x)     __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v)    __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_wmb()           __atomic_thread_fence(__ATOMIC_RELEASE)
+#define smp_rmb()           __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define smp_mb()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define __user
+#define __percpu
+
+#define min_t(type, a, b)   ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b)   ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+
+#ifndef offsetof
+#define offsetof(type, member) __builtin_offsetof(type, member)
+#endif
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+
+// printk is silent unless built with -DSHIM_PRINTK, the module logs on
+// every call and that would dominate any measurement.
+#define KERN_INFO ""
+#ifdef SHIM_PRINTK
+# define printk(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#else
+# define printk(fmt, ...) do {} while (0)
+#endif
+
+
+// Memory allocation
+
+#define GFP_KERNEL 0
+#define GFP_ATOMIC 0
+
+#define kmalloc(size, flags)        malloc(size)
+#define kzalloc(size, flags)        calloc(1, (size))
+#define kfree(ptr)                  free(ptr)
+#define vmalloc(size)               malloc(size)
+#define vzalloc(size)               calloc(1, (size))
+#define vfree(ptr)                  free(ptr)
+
+#define kmalloc_node(size, flags, node) malloc(size)
+#define vmalloc_node(size, node)        malloc(size)
+
+
+// NUMA, a single node
+
+#define NUMA_NO_NODE    (-1)
+#define MAX_NUMNODES    1
+#define numa_node_id()  0
+#define node_online(node) ((node) == 0)
+
+
+// Atomics
+
+typedef struct { int  counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+typedef struct { s64  counter; } atomic64_t;
+
+#define ATOMIC_INIT(i)  { (i) }
+
+#define __shim_read(v)          __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define __shim_set(v, i)        __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define __shim_add_return(v, i) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define __shim_fetch_add(v, i)  __atomic_fetch_add(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define __shim_cmpxchg(v, o, n) ({                                          \
+        __typeof__((v)->counter) __old = (o);                               \
+        __atomic_compare_exchange_n(&(v)->counter, &__old, (n), 0,          \
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);    \
+        __old; })
+
+#define atomic_read(v)              __shim_read(v)
+#define atomic_set(v, i)            __shim_set(v, i)
+#define atomic_inc(v)               ((void) __shim_add_return(v, 1))
+#define atomic_dec(v)               ((void) __shim_add_return(v, -1))
+#define atomic_inc_return(v)        __shim_add_return(v, 1)
+#define atomic_fetch_inc(v)         __shim_fetch_add(v, 1)
+#define atomic_fetch_add(i, v)      __shim_fetch_add(v, i)
+#define atomic_cmpxchg(v, o, n)     __shim_cmpxchg(v, o, n)
+
+#define atomic_long_read(v)         __shim_read(v)
+#define atomic_long_set(v, i)       __shim_set(v, i)
+#define atomic_long_inc(v)          ((void) __shim_add_return(v, 1))
+#define atomic_long_add(i, v)       ((void) __shim_add_return(v, i))
+
+#define atomic64_read(v)            __shim_read(v)
+#define atomic64_set(v, i)          __shim_set(v, i)
+#define atomic64_inc(v)             ((void) __shim_add_return(v, 1))
+#define atomic64_add(i, v)          ((void) __shim_add_return(v, i))
+#define atomic64_inc_return(v)      __shim_add_return(v, 1)
+
+
+// Spinlocks, interrupts do not exist here so the irqsave variants only
+// take the lock
+
+typedef struct { int locked; } spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED(name)  (spinlock_t){ 0 }
+#define DEFINE_SPINLOCK(name)       spinlock_t name = { 0 }
+
+static inline void spin_lock_init(spinlock_t *l){ l->locked = 0; }
+
+static inline void spin_lock(spinlock_t *l){
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+            ;
+}
+
+static inline void spin_unlock(spinlock_t *l){
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+#define spin_lock_irqsave(l, flags)         do { (void)(flags); spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags)    do { (void)(flags); spin_unlock(l); } while (0)
+
+
+// Bit operations
+
+#define BITS_PER_LONG       64
+#define BIT_WORD(nr)        ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)        (1UL << ((nr) % BITS_PER_LONG))
+#define BITS_TO_LONGS(nr)   (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void set_bit(long nr, volatile unsigned long *addr){
+    __atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(long nr, volatile unsigned long *addr){
+    __atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+static inline int test_bit(long nr, const volatile unsigned long *addr){
+    return 1UL & (addr[BIT_WORD(nr)] >> (nr % BITS_PER_LONG));
+}
+
+static inline unsigned long *bitmap_alloc(unsigned int nbits, int flags){
+    return malloc(BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline unsigned long *bitmap_zalloc(unsigned int nbits, int flags){
+    return calloc(BITS_TO_LONGS(nbits), sizeof(unsigned long));
+}
+
+static inline void bitmap_free(const unsigned long *bitmap){
+    free((void *) bitmap);
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned int start, unsigned int len){
+    for (unsigned int i = start; i < start + len; i++) clear_bit(i, map);
+}
+
+static inline void bitmap_zero(unsigned long *map, unsigned int nbits){
+    memset(map, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void bitmap_copy(unsigned long *dst, const unsigned long *src, unsigned int nbits){
+    memcpy(dst, src, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+
+// RCU hlists, readers and writers are not concurrent in the userspace
+// tools so these are plain list operations
+
+struct hlist_head { struct hlist_node *first; };
+struct hlist_node { struct hlist_node *next, **pprev; };
+
+#define INIT_HLIST_HEAD(ptr)    ((ptr)->first = NULL)
+
+static inline void hlist_add_head_rcu(struct hlist_node *n, struct hlist_head *h){
+    struct hlist_node *first = h->first;
+
+    n->next  = first;
+    n->pprev = &h->first;
+    if (first) first->pprev = &n->next;
+    __atomic_store_n(&h->first, n, __ATOMIC_RELEASE);
+}
+
+static inline void hlist_del_init_rcu(struct hlist_node *n){
+    if (n->pprev){
+        *n->pprev = n->next;
+        if (n->next) n->next->pprev = n->pprev;
+        n->pprev = NULL;
+    }
+}
+
+#define hlist_entry(ptr, type, member)  container_of(ptr, type, member)
+
+#define hlist_entry_safe(ptr, type, member) ({                          \
+        struct hlist_node *____ptr = (ptr);                             \
+        ____ptr ? hlist_entry(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry_rcu(pos, head, member)                                         \
+    for (pos = hlist_entry_safe(__atomic_load_n(&(head)->first, __ATOMIC_ACQUIRE),          \
+                                __typeof__(*(pos)), member);                                \
+         pos;                                                                               \
+         pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), member))
+
+
+// Hashtables, same bucket selection as include/linux/hash.h
+
+#define GOLDEN_RATIO_32 0x61C88647
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+static inline u32 hash_32(u32 val, unsigned int bits){
+    return (val * GOLDEN_RATIO_32) >> (32 - bits);
+}
+
+static inline u32 hash_64(u64 val, unsigned int bits){
+    return (u32)((val * GOLDEN_RATIO_64) >> (64 - bits));
+}
+
+#define hash_long(val, bits)    hash_64(val, bits)
+
+#define DEFINE_HASHTABLE(name, bits)    struct hlist_head name[1 << (bits)] = { { NULL } }
+#define DECLARE_HASHTABLE(name, bits)   struct hlist_head name[1 << (bits)]
+
+#define HASH_SIZE(name)     (sizeof(name) / sizeof((name)[0]))
+#define HASH_BITS(name)     ((unsigned int) __builtin_ctzl(HASH_SIZE(name)))
+
+#define hash_min(val, bits) \
+    (sizeof(val) <= 4 ? hash_32(val, bits) : hash_long(val, bits))
+
+#define hash_init(table)    memset((table), 0, sizeof(table))
+
+#define hash_add_rcu(table, node, key) \
+    hlist_add_head_rcu(node, &(table)[hash_min(key, HASH_BITS(table))])
+
+#define hash_del_rcu(node)  hlist_del_init_rcu(node)
+
+#define hash_for_each_rcu(name, bkt, obj, member)                           \
+    for ((bkt) = 0, obj = NULL; obj == NULL && (bkt) < (int) HASH_SIZE(name); \
+         (bkt)++)                                                           \
+        hlist_for_each_entry_rcu(obj, &name[bkt], member)
+
+#define hash_for_each_possible_rcu(name, obj, member, key) \
+    hlist_for_each_entry_rcu(obj, &name[hash_min(key, HASH_BITS(name))], member)
+
+
+// Cpu state saved into struct fiber, sized as on x86_64 so that the
+// footprint of the userspace build matches the module
+
+struct pt_regs {
+    unsigned long r15, r14, r13, r12, bp, bx;
+    unsigned long r11, r10, r9, r8, ax, cx, dx, si, di;
+    unsigned long orig_ax, ip, cs, flags, sp, ss;
+};
+
+struct fxregs_state {
+    u8 data[512];
+} __attribute__((aligned(16)));
+
+struct fpu {
+    unsigned int last_cpu;
+    unsigned char initialized;
+    union {
+        struct fxregs_state fxsave;
+        u8 __padding[4096];
+    } state;
+} __attribute__((aligned(64)));
+
+
+
+// Timers, only their footprint matters here
+
+typedef s64 ktime_t;
+
+struct hrtimer {
+    u8 __opaque[64];
+};
+
+struct task_struct;
+
+
+// RCU, only the footprint of the callback head matters here
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+
+#endif